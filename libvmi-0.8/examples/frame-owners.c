@@ -0,0 +1,104 @@
+/* The LibVMI Library is an introspection library that simplifies access to 
+ * memory in a target virtual machine or in a file containing a dump of 
+ * a system's physical memory.  LibVMI is based on the XenAccess Library.
+ *
+ * Copyright 2011 Sandia Corporation. Under the terms of Contract
+ * DE-AC04-94AL85000 with Sandia Corporation, the U.S. Government
+ * retains certain rights in this software.
+ *
+ * Author: Bryan D. Payne (bdpayne@acm.org)
+ *
+ * This file is part of LibVMI.
+ *
+ * LibVMI is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * LibVMI is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public
+ * License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with LibVMI.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Lists every virtual page, in every process, that maps the given guest
+ * frames, using a reverse map built from one walk of each process.
+ *
+ * usage: frame-owners <name> <gfn> [gfn ...]
+ */
+
+#include <libvmi/libvmi.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#define MAX_OWNERS 64
+
+int main (int argc, char **argv)
+{
+    vmi_instance_t vmi;
+    vmi_process_table_t table = { 0, 0, NULL };
+    vmi_rmap_entry_t owners[MAX_OWNERS];
+    vmi_rmap_t rmap = NULL;
+    addr_t *dtbs = NULL;
+    size_t found = 0, j = 0, n = 0;
+    uint32_t i = 0;
+    int a = 0;
+
+    if (argc < 3){
+        printf("Usage: %s <name> <gfn> [gfn ...]\n", argv[0]);
+        return 1;
+    }
+
+    /* this is the VM or file that we are looking at */
+    char *name = argv[1];
+
+    /* initialize the libvmi library */
+    if (vmi_init(&vmi, VMI_AUTO | VMI_INIT_COMPLETE, name) == VMI_FAILURE){
+        printf("Failed to init LibVMI library.\n");
+        return 1;
+    }
+
+    /* one address space per process that has its own page tables */
+    if (VMI_FAILURE == vmi_snapshot_processes(vmi, &table)){
+        printf("Failed to list the processes.\n");
+        goto error_exit;
+    }
+    dtbs = malloc((table.count ? table.count : 1) * sizeof(addr_t));
+    for (i = 0; i < table.count; ++i){
+        if (table.processes[i].dtb){
+            dtbs[n++] = table.processes[i].dtb;
+        }
+    }
+
+    if ((rmap = vmi_rmap_build(vmi, dtbs, n, 0)) == NULL){
+        printf("Failed to build the reverse map.\n");
+        goto error_exit;
+    }
+
+    for (a = 2; a < argc; ++a){
+        uint64_t gfn = strtoull(argv[a], NULL, 16);
+
+        found = vmi_rmap_lookup(rmap, gfn, owners, MAX_OWNERS);
+        printf("gfn 0x%llx: %lu mappings\n", (unsigned long long) gfn, (unsigned long) found);
+        for (j = 0; j < found && j < MAX_OWNERS; ++j){
+            printf("  dtb 0x%.16llx va 0x%.16llx level %d%s%s\n",
+                (unsigned long long) owners[j].dtb, (unsigned long long) owners[j].va, owners[j].level,
+                (owners[j].flags & VMI_MAP_WRITE) ? " write" : "",
+                (owners[j].flags & VMI_MAP_USER) ? " user" : "");
+        }
+    }
+
+error_exit:
+    vmi_rmap_destroy(rmap);
+    vmi_process_table_free(&table);
+    free(dtbs);
+
+    /* cleanup any memory associated with the libvmi instance */
+    vmi_destroy(vmi);
+
+    return 0;
+}
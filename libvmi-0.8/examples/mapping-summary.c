@@ -0,0 +1,142 @@
+/* The LibVMI Library is an introspection library that simplifies access to 
+ * memory in a target virtual machine or in a file containing a dump of 
+ * a system's physical memory.  LibVMI is based on the XenAccess Library.
+ *
+ * Copyright 2011 Sandia Corporation. Under the terms of Contract
+ * DE-AC04-94AL85000 with Sandia Corporation, the U.S. Government
+ * retains certain rights in this software.
+ *
+ * Author: Bryan D. Payne (bdpayne@acm.org)
+ *
+ * This file is part of LibVMI.
+ *
+ * LibVMI is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * LibVMI is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public
+ * License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with LibVMI.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Walks the page tables of every process on a pool of threads and sums
+ * up how much memory each one maps, and how much of it is writable and
+ * user accessible.  Kernel mappings shared by all processes are counted
+ * once, under the kernel page tables.
+ *
+ * usage: mapping-summary <name> [threads]
+ */
+
+#include <libvmi/libvmi.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#define MB(bytes) ((double) (bytes) / (1024 * 1024))
+
+struct summary{
+    addr_t dtb;
+    uint64_t mapped;
+    uint64_t writable;
+    uint64_t user;
+};
+
+struct summary_table{
+    struct summary *rows;
+    size_t count;
+};
+
+/* called from several threads at once; each row is only updated with
+ * atomic adds, and rows are only looked up, never added, during the walk */
+static status_t summary_visit (vmi_instance_t vmi, addr_t dtb, addr_t va, addr_t pa,
+    addr_t size, uint32_t flags, void *data)
+{
+    struct summary_table *table = (struct summary_table *) data;
+    size_t i = 0;
+
+    for (i = 0; i < table->count; ++i){
+        if (table->rows[i].dtb == dtb){
+            __sync_fetch_and_add(&table->rows[i].mapped, size);
+            if (flags & VMI_MAP_WRITE){
+                __sync_fetch_and_add(&table->rows[i].writable, size);
+            }
+            if (flags & VMI_MAP_USER){
+                __sync_fetch_and_add(&table->rows[i].user, size);
+            }
+            break;
+        }
+    }
+    return VMI_SUCCESS;
+}
+
+int main (int argc, char **argv)
+{
+    vmi_instance_t vmi;
+    vmi_process_table_t table = { 0, 0, NULL };
+    struct summary_table summary = { NULL, 0 };
+    addr_t *dtbs = NULL;
+    size_t n = 0, j = 0;
+    uint32_t i = 0;
+    int threads = 0;
+
+    if (argc < 2){
+        printf("Usage: %s <name> [threads]\n", argv[0]);
+        return 1;
+    }
+
+    /* this is the VM or file that we are looking at */
+    char *name = argv[1];
+
+    if (argc > 2){
+        threads = atoi(argv[2]);
+    }
+
+    /* initialize the libvmi library */
+    if (vmi_init(&vmi, VMI_AUTO | VMI_INIT_COMPLETE, name) == VMI_FAILURE){
+        printf("Failed to init LibVMI library.\n");
+        return 1;
+    }
+
+    if (VMI_FAILURE == vmi_snapshot_processes(vmi, &table)){
+        printf("Failed to list the processes.\n");
+        goto error_exit;
+    }
+
+    /* a row per process, plus one for the shared kernel mappings */
+    dtbs = malloc((table.count ? table.count : 1) * sizeof(addr_t));
+    summary.rows = calloc(table.count + 1, sizeof(struct summary));
+    for (i = 0; i < table.count; ++i){
+        if (table.processes[i].dtb){
+            dtbs[n] = table.processes[i].dtb;
+            summary.rows[n].dtb = dtbs[n];
+            n++;
+        }
+    }
+    summary.rows[n].dtb = vmi_pid_to_dtb(vmi, 0);
+    summary.count = n + 1;
+
+    if (VMI_FAILURE == vmi_walk_many(vmi, dtbs, n, summary_visit, &summary, threads)){
+        printf("The walk was stopped.\n");
+    }
+
+    for (j = 0; j < summary.count; ++j){
+        printf("dtb 0x%.16llx: mapped %9.1fM writable %9.1fM user %9.1fM\n",
+            (unsigned long long) summary.rows[j].dtb, MB(summary.rows[j].mapped),
+            MB(summary.rows[j].writable), MB(summary.rows[j].user));
+    }
+
+error_exit:
+    vmi_process_table_free(&table);
+    free(summary.rows);
+    free(dtbs);
+
+    /* cleanup any memory associated with the libvmi instance */
+    vmi_destroy(vmi);
+
+    return 0;
+}
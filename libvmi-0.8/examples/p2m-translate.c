@@ -0,0 +1,78 @@
+/* The LibVMI Library is an introspection library that simplifies access to 
+ * memory in a target virtual machine or in a file containing a dump of 
+ * a system's physical memory.  LibVMI is based on the XenAccess Library.
+ *
+ * Copyright 2011 Sandia Corporation. Under the terms of Contract
+ * DE-AC04-94AL85000 with Sandia Corporation, the U.S. Government
+ * retains certain rights in this software.
+ *
+ * Author: Bryan D. Payne (bdpayne@acm.org)
+ *
+ * This file is part of LibVMI.
+ *
+ * LibVMI is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * LibVMI is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public
+ * License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with LibVMI.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Translates a virtual address to a guest physical and then a machine
+ * address, with the gfn to mfn mappings read from a p2m file: an array
+ * of 64-bit mfns indexed by gfn, as dumped from the hypervisor.
+ *
+ * usage: p2m-translate <name> <p2m file> <vaddr> <pid>
+ */
+
+#include <libvmi/libvmi.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+
+int main (int argc, char **argv)
+{
+    vmi_instance_t vmi;
+    addr_t vaddr = 0, dtb = 0, paddr = 0, maddr = 0;
+    int pid = 0;
+
+    if (argc != 5){
+        printf("Usage: %s <name> <p2m file> <vaddr> <pid>\n", argv[0]);
+        return 1;
+    }
+
+    /* this is the VM or file that we are looking at */
+    char *name = argv[1];
+
+    vaddr = (addr_t) strtoull(argv[3], NULL, 16);
+    pid = atoi(argv[4]);
+
+    /* initialize the libvmi library */
+    if (vmi_init(&vmi, VMI_AUTO | VMI_INIT_COMPLETE, name) == VMI_FAILURE){
+        printf("Failed to init LibVMI library.\n");
+        return 1;
+    }
+
+    if (VMI_FAILURE == vmi_set_p2m_file(vmi, argv[2])){
+        printf("Failed to load p2m file %s.\n", argv[2]);
+        goto error_exit;
+    }
+
+    dtb = vmi_pid_to_dtb(vmi, pid);
+    paddr = pid ? vmi_translate_uv2p(vmi, vaddr, pid) : vmi_translate_kv2p(vmi, vaddr);
+    maddr = vmi_translate_v2m(vmi, dtb, vaddr);
+    printf("vaddr 0x%llx -> gpa 0x%llx -> mfn address 0x%llx\n",
+        (unsigned long long) vaddr, (unsigned long long) paddr, (unsigned long long) maddr);
+
+error_exit:
+    /* cleanup any memory associated with the libvmi instance */
+    vmi_destroy(vmi);
+
+    return 0;
+}
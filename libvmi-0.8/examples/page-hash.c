@@ -0,0 +1,95 @@
+/* The LibVMI Library is an introspection library that simplifies access to 
+ * memory in a target virtual machine or in a file containing a dump of 
+ * a system's physical memory.  LibVMI is based on the XenAccess Library.
+ *
+ * Copyright 2011 Sandia Corporation. Under the terms of Contract
+ * DE-AC04-94AL85000 with Sandia Corporation, the U.S. Government
+ * retains certain rights in this software.
+ *
+ * Author: Bryan D. Payne (bdpayne@acm.org)
+ *
+ * This file is part of LibVMI.
+ *
+ * LibVMI is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * LibVMI is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public
+ * License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with LibVMI.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Hashes guest pages in place, without copying them out of LibVMI's page
+ * cache: each page is pinned, hashed through the pinned pointer and then
+ * unpinned.  Useful to spot pages of kernel code that change.
+ *
+ * usage: page-hash <name> <vaddr> <pages>
+ */
+
+#include <libvmi/libvmi.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#define PAGE_SIZE (1 << 12)
+
+/* FNV-1a over one page */
+static uint64_t page_hash (const uint8_t *data)
+{
+    uint64_t hash = 14695981039346656037ULL;
+    int i = 0;
+
+    for (i = 0; i < PAGE_SIZE; ++i){
+        hash ^= data[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+int main (int argc, char **argv)
+{
+    vmi_instance_t vmi;
+    addr_t vaddr = 0, pfn = 0;
+    void *data = NULL;
+    int pages = 0, i = 0;
+
+    if (argc != 4){
+        printf("Usage: %s <name> <vaddr> <pages>\n", argv[0]);
+        return 1;
+    }
+
+    /* this is the VM or file that we are looking at */
+    char *name = argv[1];
+
+    vaddr = (addr_t) strtoull(argv[2], NULL, 16) & ~((addr_t) PAGE_SIZE - 1);
+    pages = atoi(argv[3]);
+
+    /* initialize the libvmi library */
+    if (vmi_init(&vmi, VMI_AUTO | VMI_INIT_COMPLETE, name) == VMI_FAILURE){
+        printf("Failed to init LibVMI library.\n");
+        return 1;
+    }
+
+    /* hash a consistent image of the pages */
+    vmi_pause_vm(vmi);
+    for (i = 0; i < pages; ++i, vaddr += PAGE_SIZE){
+        if (VMI_FAILURE == vmi_page_pin_va(vmi, vaddr, 0, &data, &pfn)){
+            printf("0x%.16llx: not mapped\n", (unsigned long long) vaddr);
+            continue;
+        }
+        printf("0x%.16llx: pfn 0x%llx hash %.16llx\n", (unsigned long long) vaddr,
+            (unsigned long long) pfn, (unsigned long long) page_hash(data));
+        vmi_page_unpin(vmi, pfn);
+    }
+    vmi_resume_vm(vmi);
+
+    /* cleanup any memory associated with the libvmi instance */
+    vmi_destroy(vmi);
+
+    return 0;
+}
@@ -0,0 +1,103 @@
+/* The LibVMI Library is an introspection library that simplifies access to 
+ * memory in a target virtual machine or in a file containing a dump of 
+ * a system's physical memory.  LibVMI is based on the XenAccess Library.
+ *
+ * Copyright 2011 Sandia Corporation. Under the terms of Contract
+ * DE-AC04-94AL85000 with Sandia Corporation, the U.S. Government
+ * retains certain rights in this software.
+ *
+ * Author: Bryan D. Payne (bdpayne@acm.org)
+ *
+ * This file is part of LibVMI.
+ *
+ * LibVMI is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * LibVMI is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public
+ * License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with LibVMI.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Reads several ranges of one address space with a single call.  The
+ * pages of all the ranges are translated together, so page table entries
+ * they share are only read once, and a range that is not mapped does not
+ * stop the others.
+ *
+ * usage: read-iov <name> <pid> <vaddr>:<len> [<vaddr>:<len> ...]
+ */
+
+#include <libvmi/libvmi.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+
+int main (int argc, char **argv)
+{
+    vmi_instance_t vmi;
+    vmi_iov_t *req = NULL;
+    size_t *done = NULL;
+    size_t n = 0, i = 0, j = 0;
+    addr_t dtb = 0;
+    int pid = 0;
+
+    if (argc < 4){
+        printf("Usage: %s <name> <pid> <vaddr>:<len> [<vaddr>:<len> ...]\n", argv[0]);
+        return 1;
+    }
+
+    /* this is the VM or file that we are looking at */
+    char *name = argv[1];
+
+    pid = atoi(argv[2]);
+    n = argc - 3;
+    req = calloc(n, sizeof(vmi_iov_t));
+    done = calloc(n, sizeof(size_t));
+    for (i = 0; i < n; ++i){
+        char *p = NULL;
+
+        req[i].va = (addr_t) strtoull(argv[3 + i], &p, 16);
+        req[i].len = (*p == ':') ? strtoul(p + 1, NULL, 0) : 16;
+        req[i].dst = malloc(req[i].len ? req[i].len : 1);
+    }
+
+    /* initialize the libvmi library */
+    if (vmi_init(&vmi, VMI_AUTO | VMI_INIT_COMPLETE, name) == VMI_FAILURE){
+        printf("Failed to init LibVMI library.\n");
+        goto exit;
+    }
+
+    /* 0 reads from the kernel page tables */
+    if (pid){
+        dtb = vmi_pid_to_dtb(vmi, pid);
+    }
+    if (VMI_FAILURE == vmi_read_va_iov(vmi, dtb, req, n, done)){
+        printf("Some ranges could not be read in full.\n");
+    }
+
+    for (i = 0; i < n; ++i){
+        printf("0x%.16llx: %lu of %lu bytes:", (unsigned long long) req[i].va,
+            (unsigned long) done[i], (unsigned long) req[i].len);
+        for (j = 0; j < done[i]; ++j){
+            printf(" %02x", ((uint8_t *) req[i].dst)[j]);
+        }
+        printf("\n");
+    }
+
+    /* cleanup any memory associated with the libvmi instance */
+    vmi_destroy(vmi);
+
+exit:
+    for (i = 0; i < n; ++i){
+        free(req[i].dst);
+    }
+    free(req);
+    free(done);
+
+    return 0;
+}
@@ -0,0 +1,118 @@
+/* The LibVMI Library is an introspection library that simplifies access to 
+ * memory in a target virtual machine or in a file containing a dump of 
+ * a system's physical memory.  LibVMI is based on the XenAccess Library.
+ *
+ * Copyright 2011 Sandia Corporation. Under the terms of Contract
+ * DE-AC04-94AL85000 with Sandia Corporation, the U.S. Government
+ * retains certain rights in this software.
+ *
+ * Author: Bryan D. Payne (bdpayne@acm.org)
+ *
+ * This file is part of LibVMI.
+ *
+ * LibVMI is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * LibVMI is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public
+ * License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with LibVMI.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Measures the cost of a full page table walk.  Each translation is
+ * preceded by a v2p cache flush (which also drops the paging structure
+ * cache), so every lookup walks the guest page tables from the root.
+ * The cost of the flush alone is measured separately and subtracted.
+ *
+ * usage: translate-bench <name> <vaddr> <pid> [iterations]
+ */
+
+#include <libvmi/libvmi.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+
+static inline uint64_t rdtsc (void)
+{
+    uint32_t lo, hi;
+    __asm__ __volatile__ ("rdtsc" : "=a" (lo), "=d" (hi));
+    return ((uint64_t) hi << 32) | lo;
+}
+
+static void translate_bench (vmi_instance_t vmi, addr_t vaddr, int pid, unsigned long iterations)
+{
+    uint64_t start = 0, walk = 0, flush = 0;
+    addr_t paddr = 0;
+    unsigned long i = 0;
+
+    /* warm up the page cache so we measure the walk, not the driver */
+    paddr = vmi_translate_uv2p(vmi, vaddr, pid);
+    printf("vaddr: %lx paddr: %lx\n", vaddr, paddr);
+    if (!paddr){
+        return;
+    }
+
+    start = rdtsc();
+    for (i = 0; i < iterations; ++i){
+        vmi_v2pcache_flush(vmi);
+    }
+    flush = rdtsc() - start;
+
+    start = rdtsc();
+    for (i = 0; i < iterations; ++i){
+        vmi_v2pcache_flush(vmi);
+        paddr = vmi_translate_uv2p(vmi, vaddr, pid);
+    }
+    walk = rdtsc() - start;
+
+    printf("full walk: %.1f cycles per translation (%lu iterations)\n",
+        (double) (walk > flush ? walk - flush : 0) / iterations, iterations);
+
+    start = rdtsc();
+    for (i = 0; i < iterations; ++i){
+        paddr = vmi_translate_uv2p(vmi, vaddr, pid);
+    }
+    walk = rdtsc() - start;
+
+    printf("cache hit: %.1f cycles per translation\n", (double) walk / iterations);
+}
+
+int main (int argc, char **argv)
+{
+    vmi_instance_t vmi;
+    unsigned long iterations = 1000000;
+
+    if (argc < 4){
+        printf("Usage: %s <name> <vaddr> <pid> [iterations]\n", argv[0]);
+        return 1;
+    }
+
+    /* this is the VM or file that we are looking at */
+    char *name = argv[1];
+
+    /* this is the address to translate, and the process it belongs to */
+    addr_t addr = (addr_t) strtoul(argv[2], NULL, 16);
+    int pid = atoi(argv[3]);
+
+    if (argc > 4){
+        iterations = strtoul(argv[4], NULL, 0);
+    }
+
+    /* initialize the libvmi library */
+    if (vmi_init(&vmi, VMI_AUTO | VMI_INIT_COMPLETE, name) == VMI_FAILURE){
+        printf("Failed to init LibVMI library.\n");
+        return 1;
+    }
+
+    translate_bench(vmi, addr, pid, iterations);
+
+    /* cleanup any memory associated with the libvmi instance */
+    vmi_destroy(vmi);
+
+    return 0;
+}
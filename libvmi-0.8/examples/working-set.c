@@ -0,0 +1,120 @@
+/* The LibVMI Library is an introspection library that simplifies access to 
+ * memory in a target virtual machine or in a file containing a dump of 
+ * a system's physical memory.  LibVMI is based on the XenAccess Library.
+ *
+ * Copyright 2011 Sandia Corporation. Under the terms of Contract
+ * DE-AC04-94AL85000 with Sandia Corporation, the U.S. Government
+ * retains certain rights in this software.
+ *
+ * Author: Bryan D. Payne (bdpayne@acm.org)
+ *
+ * This file is part of LibVMI.
+ *
+ * LibVMI is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * LibVMI is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public
+ * License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with LibVMI.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Estimates the working set of one or more processes from the accessed
+ * bits of their page table entries.  With clear set to 1, the accessed
+ * bits are cleared after each sample (this briefly pauses the VM), so
+ * each line shows the memory touched during the last interval.
+ *
+ * usage: working-set <name> <interval ms> <samples> <clear> <pid> [pid ...]
+ */
+
+#include <libvmi/libvmi.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#define MB(bytes) ((double) (bytes) / (1024 * 1024))
+
+static void print_report (int pid, vmi_wss_report_t *report)
+{
+    int i = 0;
+
+    printf("pid %5d: wss %8.1fM mapped %8.1fM dirty %8.1fM idle",
+        pid, MB(report->accessed), MB(report->mapped), MB(report->dirty));
+    for (i = 0; i < VMI_WSS_AGE_BUCKETS; ++i){
+        printf(" %.1f", MB(report->idle[i]));
+    }
+    printf("\n");
+}
+
+int main (int argc, char **argv)
+{
+    vmi_instance_t vmi;
+    vmi_wss_t wss;
+    vmi_wss_report_t report;
+    addr_t *dtbs = NULL;
+    int *pids = NULL;
+    int count = 0, i = 0, s = 0;
+
+    if (argc < 6){
+        printf("Usage: %s <name> <interval ms> <samples> <clear> <pid> [pid ...]\n", argv[0]);
+        return 1;
+    }
+
+    /* this is the VM or file that we are looking at */
+    char *name = argv[1];
+
+    uint32_t interval = strtoul(argv[2], NULL, 0);
+    int samples = atoi(argv[3]);
+    int clear = atoi(argv[4]);
+
+    /* initialize the libvmi library */
+    if (vmi_init(&vmi, VMI_AUTO | VMI_INIT_COMPLETE, name) == VMI_FAILURE){
+        printf("Failed to init LibVMI library.\n");
+        return 1;
+    }
+
+    wss = vmi_wss_create(vmi, clear ? VMI_WSS_CLEAR : 0);
+    count = argc - 5;
+    pids = malloc(count * sizeof(int));
+    dtbs = malloc(count * sizeof(addr_t));
+    for (i = 0; i < count; ++i){
+        pids[i] = atoi(argv[5 + i]);
+        dtbs[i] = vmi_pid_to_dtb(vmi, pids[i]);
+        if (!dtbs[i] || VMI_FAILURE == vmi_wss_add_dtb(wss, dtbs[i])){
+            printf("Failed to find the page tables of pid %d.\n", pids[i]);
+            goto error_exit;
+        }
+    }
+
+    printf("idle buckets (intervals since last access): 0 1 2-3 4-7 8-15 16-31 32-63 64-127 128+\n");
+    for (s = 0; s < samples; ++s){
+        if (s){
+            usleep(interval * 1000);
+        }
+        if (VMI_FAILURE == vmi_wss_sample(wss)){
+            printf("Sample %d failed.\n", s);
+        }
+        printf("-- sample %d\n", s);
+        for (i = 0; i < count; ++i){
+            if (VMI_SUCCESS == vmi_wss_get_report(wss, dtbs[i], &report)){
+                print_report(pids[i], &report);
+            }
+        }
+    }
+
+error_exit:
+    vmi_wss_destroy(wss);
+    free(pids);
+    free(dtbs);
+
+    /* cleanup any memory associated with the libvmi instance */
+    vmi_destroy(vmi);
+
+    return 0;
+}
@@ -27,6 +27,7 @@
 #include "libvmi.h"
 #include "private.h"
 #include "driver/interface.h"
+#include "driver/memory_cache.h"
 
 page_mode_t vmi_get_page_mode (vmi_instance_t vmi)
 {
@@ -138,12 +139,22 @@ status_t vmi_get_vcpureg (vmi_instance_t vmi, reg_t *value, registers_t reg, uns
 
 status_t vmi_pause_vm (vmi_instance_t vmi)
 {
-    return driver_pause_vm(vmi);
+    status_t ret = driver_pause_vm(vmi);
+    if (VMI_SUCCESS == ret){
+        cache_epoch_bump(vmi);
+        memory_cache_set_paused(vmi, 1);
+    }
+    return ret;
 }
 
 status_t vmi_resume_vm (vmi_instance_t vmi)
 {
-    return driver_resume_vm(vmi);
+    status_t ret = driver_resume_vm(vmi);
+    if (VMI_SUCCESS == ret){
+        cache_epoch_bump(vmi);
+        memory_cache_set_paused(vmi, 0);
+    }
+    return ret;
 }
 
 char * vmi_get_name (vmi_instance_t vmi)
@@ -27,7 +27,16 @@
 // Three kinds of cache:
 //  1) PID --> DTB
 //  2) Symbol --> Virtual address
-//  3) Virtual address --> physical address
+//  3) Virtual address --> physical address, one entry per page of any size
+//  4) Paging structure entries (PML4E, PDPTE, PDE) for partial walks
+//
+// The v2p and paging structure caches are coherent within an epoch.  The
+// epoch advances when the VM is paused or resumed, on vmi_cache_epoch_bump,
+// and optionally after a fixed wall-clock interval.  Paging structure
+// entries are dropped when the epoch changes; v2p entries from an earlier
+// epoch are revalidated on their next use by re-reading their leaf entry.
+// Entries added with vmi_v2pcache_add have no leaf entry to re-read, and
+// stay until they are flushed or evicted.
 
 #include "libvmi.h"
 #include "private.h"
@@ -36,9 +45,42 @@
 #include <glib.h>
 #include <time.h>
 #include <string.h>
+#include <sys/time.h>
 
 #include "glib_compat.h"
 
+static uint64_t cache_clock_ms (void)
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return (uint64_t) tv.tv_sec * 1000 + tv.tv_usec / 1000;
+}
+
+void cache_epoch_init (vmi_instance_t vmi)
+{
+    vmi->cache_epoch = 1;
+    vmi->cache_epoch_start = cache_clock_ms();
+    vmi->cache_epoch_interval = 0;
+}
+
+void cache_epoch_bump (vmi_instance_t vmi)
+{
+    vmi->cache_epoch++;
+    vmi->cache_epoch_start = cache_clock_ms();
+    ps_cache_flush(vmi);
+    kernel_share_flush(vmi);
+    dbprint("--Cache epoch is now %llu\n", (unsigned long long) vmi->cache_epoch);
+}
+
+// start a new epoch if the current one has outlived its interval
+static void cache_epoch_check (vmi_instance_t vmi)
+{
+    if (vmi->cache_epoch_interval &&
+        cache_clock_ms() - vmi->cache_epoch_start >= vmi->cache_epoch_interval){
+        cache_epoch_bump(vmi);
+    }
+}
+
 #if ENABLE_ADDRESS_CACHE == 1
 //
 // PID --> DTB cache implementation
@@ -122,6 +164,18 @@ void pid_cache_flush (vmi_instance_t vmi)
     dbprint("--PID cache flushed\n");
 }
 
+static gboolean pid_cache_entry_has_dtb (gpointer key, gpointer value, gpointer data)
+{
+    pid_cache_entry_t entry = (pid_cache_entry_t) value;
+    return (entry->dtb == *(addr_t *) data) ? TRUE : FALSE;
+}
+
+void pid_cache_flush_dtb (vmi_instance_t vmi, addr_t dtb)
+{
+    g_hash_table_foreach_remove(vmi->pid_cache, pid_cache_entry_has_dtb, &dtb);
+    dbprint("--PID cache flushed for dtb 0x%.16llx\n", dtb);
+}
+
 //
 // Symbol --> Virtual address cache implementation
 struct sym_cache_entry{
@@ -199,33 +253,93 @@ void sym_cache_flush (vmi_instance_t vmi)
 
 //
 // Virtual address --> Physical address cache implementation
-struct v2p_cache_entry{
-    addr_t va;
-    addr_t dtb;
+// A fixed size, set associative software TLB.  Each set keeps its tags and
+// address space IDs together in one cache line so a probe touches a single
+// line until it hits, and nothing is allocated on lookup or insert.
+// Replacement is CLOCK within a set; a translation only earns its reference
+// bit on its first hit, so translations used once are evicted before the
+// ones in use.
+//
+// Like PCIDs, an address space ID stands in for the dtb in each tag.  The
+// entries of an address space are chained together, so flushing one dtb
+// or a range of it only touches that address space's entries.
+#define V2P_WAYS 4
+#define V2P_SETS 4096
+#define V2P_ASIDS 1024
+#define V2P_NIL 0xffffffffU
+#define V2P_TAG_VALID 0x4ULL
+#define V2P_CLOCK_HAND(c) (((c) >> V2P_WAYS) & (V2P_WAYS - 1))
+
+struct v2p_tlb_set{
+    uint64_t tag[V2P_WAYS];     // page base | size class | V2P_TAG_VALID
+    uint32_t asid[V2P_WAYS];
+} __attribute__ ((aligned (64)));
+
+struct v2p_tlb_entry{
     addr_t pa;
-    time_t last_used;
+    uint64_t epoch;
+    v2p_leaf_t leaf;
+    int given;                  // from vmi_v2pcache_add, no leaf to check
+    uint32_t prev;              // slots of the same address space
+    uint32_t next;
 };
-typedef struct v2p_cache_entry *v2p_cache_entry_t;
 
-static void v2p_cache_key_free (gpointer data)
-{
-    if (data) free(data);
-}
+struct v2p_asid{
+    addr_t dtb;
+    uint32_t head;              // first slot, or V2P_NIL
+    uint32_t count;
+};
 
-static void v2p_cache_entry_free (gpointer data)
-{
-    v2p_cache_entry_t entry = (v2p_cache_entry_t) data;
-    if (entry) free(entry);
-}
+struct v2p_tlb{
+    struct v2p_tlb_set *sets;
+    struct v2p_tlb_entry *entries;
+    uint8_t *clock;             // reference bits, then the hand
+    uint32_t used;
+    struct v2p_asid asids[V2P_ASIDS];   // asid 0 is never handed out
+    GHashTable *asid_map;       // dtb -> asid
+    uint32_t asid_free[V2P_ASIDS];
+    uint32_t asid_nfree;
+    uint32_t asid_victim;       // next asid to recycle when none are free
+    addr_t last_dtb;
+    uint32_t last_asid;
+};
+
+// the accessed and dirty bits change under us without affecting the mapping
+#define LEAF_AD_BITS 0x60ULL
 
-static v2p_cache_entry_t v2p_cache_entry_create (addr_t va, addr_t dtb, addr_t pa)
+// re-read the leaf entry of a translation from an earlier epoch, and
+// carry it into the current epoch if the entry hasn't changed; entries
+// added with vmi_v2pcache_add have no leaf and are carried over as given
+static status_t v2p_cache_revalidate (vmi_instance_t vmi, struct v2p_tlb_entry *entry, addr_t va)
 {
-    v2p_cache_entry_t entry = (v2p_cache_entry_t) safe_malloc(sizeof(struct v2p_cache_entry));
-    entry->va = va;
-    entry->dtb = dtb;
-    entry->pa = pa;
-    entry->last_used = time(NULL);
-    return entry;
+    uint64_t value = 0;
+
+    if (entry->given){
+        entry->epoch = vmi->cache_epoch;
+        return VMI_SUCCESS;
+    }
+    else if (entry->leaf.width == 8){
+        if (VMI_FAILURE == vmi_read_64_pa(vmi, entry->leaf.addr, &value)){
+            return VMI_FAILURE;
+        }
+    }
+    else if (entry->leaf.width == 4){
+        uint32_t value32 = 0;
+        if (VMI_FAILURE == vmi_read_32_pa(vmi, entry->leaf.addr, &value32)){
+            return VMI_FAILURE;
+        }
+        value = value32;
+    }
+    else{
+        return VMI_FAILURE;
+    }
+
+    if ((value | LEAF_AD_BITS) != (entry->leaf.value | LEAF_AD_BITS)){
+        dbprint("--V2P cache leaf changed for 0x%.16llx\n", va);
+        return VMI_FAILURE;
+    }
+    entry->epoch = vmi->cache_epoch;
+    return VMI_SUCCESS;
 }
 
 // This function borrowed from cityhash-1.0.3
@@ -241,82 +355,541 @@ static uint64_t hash128to64 (uint64_t low, uint64_t high)
     return b;
 }
 
-static gint64 *v2p_build_key (vmi_instance_t vmi, addr_t va, addr_t dtb)
+// A large page is cached as one entry keyed by its own base address, so
+// a lookup tries the 4KB tag first and then each large page size that has
+// been cached since the last flush.  The size class goes into the tag, as
+// a stale 4KB entry and a 2MB entry can share a base address.
+#define V2P_SIZE_CLASSES 4
+static const addr_t v2p_large_sizes[V2P_SIZE_CLASSES] = { 0, 0x200000ULL, 0x400000ULL, 0x40000000ULL };
+
+static int v2p_size_class (addr_t size)
 {
-    uint64_t *key = (uint64_t *) safe_malloc(sizeof(uint64_t));
-    va = (va & ~(vmi->page_size - 1));
-    *key = hash128to64(dtb, va);
-    return (gint64 *) key;
+    int class = 0;
+
+    for (class = 1; class < V2P_SIZE_CLASSES; ++class){
+        if (v2p_large_sizes[class] == size){
+            return class;
+        }
+    }
+    return 0;
+}
+
+static addr_t v2p_class_size (vmi_instance_t vmi, int class)
+{
+    return class ? v2p_large_sizes[class] : vmi->page_size;
+}
+
+static uint64_t v2p_build_tag (vmi_instance_t vmi, addr_t va, int class)
+{
+    return (va & ~(v2p_class_size(vmi, class) - 1)) | class | V2P_TAG_VALID;
+}
+
+static uint32_t v2p_set_index (uint32_t asid, uint64_t tag)
+{
+    return hash128to64(asid, tag) & (V2P_SETS - 1);
+}
+
+// way holding (tag, asid) in the set, or -1
+static int v2p_set_find (struct v2p_tlb_set *set, uint64_t tag, uint32_t asid)
+{
+    int way = 0;
+
+    for (way = 0; way < V2P_WAYS; ++way){
+        if (set->tag[way] == tag && set->asid[way] == asid){
+            return way;
+        }
+    }
+    return -1;
+}
+
+static void v2p_slot_link (struct v2p_tlb *tlb, uint32_t slot, uint32_t asid)
+{
+    struct v2p_asid *as = &tlb->asids[asid];
+
+    tlb->entries[slot].prev = V2P_NIL;
+    tlb->entries[slot].next = as->head;
+    if (as->head != V2P_NIL){
+        tlb->entries[as->head].prev = slot;
+    }
+    as->head = slot;
+    as->count++;
+}
+
+static void v2p_slot_drop (struct v2p_tlb *tlb, uint32_t slot)
+{
+    uint32_t index = slot / V2P_WAYS;
+    int way = slot % V2P_WAYS;
+    struct v2p_tlb_entry *entry = &tlb->entries[slot];
+    struct v2p_asid *as = &tlb->asids[tlb->sets[index].asid[way]];
+
+    if (entry->prev != V2P_NIL){
+        tlb->entries[entry->prev].next = entry->next;
+    }
+    else{
+        as->head = entry->next;
+    }
+    if (entry->next != V2P_NIL){
+        tlb->entries[entry->next].prev = entry->prev;
+    }
+    as->count--;
+
+    tlb->sets[index].tag[way] = 0;
+    tlb->clock[index] &= ~(1 << way);
+    tlb->used--;
+}
+
+// pick a way for a new translation: a free one if there is one, otherwise
+// the first way under the hand without its reference bit
+static int v2p_set_victim (struct v2p_tlb *tlb, uint32_t index)
+{
+    struct v2p_tlb_set *set = &tlb->sets[index];
+    uint8_t clock = tlb->clock[index];
+    int way = 0;
+
+    for (way = 0; way < V2P_WAYS; ++way){
+        if (!set->tag[way]){
+            return way;
+        }
+    }
+
+    way = V2P_CLOCK_HAND(clock);
+    while (clock & (1 << way)){
+        clock &= ~(1 << way);
+        way = (way + 1) & (V2P_WAYS - 1);
+    }
+    clock = (clock & ((1 << V2P_WAYS) - 1)) | (((way + 1) & (V2P_WAYS - 1)) << V2P_WAYS);
+    tlb->clock[index] = clock;
+    return way;
+}
+
+static void v2p_asid_key_free (gpointer data)
+{
+    if (data) free(data);
+}
+
+static void v2p_asid_reset (struct v2p_tlb *tlb)
+{
+    uint32_t asid = 0;
+
+    g_hash_table_remove_all(tlb->asid_map);
+    tlb->asid_nfree = 0;
+    for (asid = V2P_ASIDS - 1; asid > 0; --asid){
+        tlb->asid_free[tlb->asid_nfree++] = asid;
+    }
+    tlb->asid_victim = 1;
+    tlb->last_dtb = 0;
+    tlb->last_asid = 0;
+}
+
+// address space ID of dtb, or 0 if it has nothing cached
+static uint32_t v2p_asid_find (struct v2p_tlb *tlb, addr_t dtb)
+{
+    gpointer value = NULL;
+
+    if (tlb->last_asid && tlb->last_dtb == dtb){
+        return tlb->last_asid;
+    }
+    if ((value = g_hash_table_lookup(tlb->asid_map, &dtb)) == NULL){
+        return 0;
+    }
+    tlb->last_dtb = dtb;
+    tlb->last_asid = GPOINTER_TO_UINT(value);
+    return tlb->last_asid;
+}
+
+// drop every entry of an address space and give its ID back
+static void v2p_asid_release (struct v2p_tlb *tlb, uint32_t asid)
+{
+    struct v2p_asid *as = &tlb->asids[asid];
+
+    while (as->head != V2P_NIL){
+        v2p_slot_drop(tlb, as->head);
+    }
+    g_hash_table_remove(tlb->asid_map, &as->dtb);
+    tlb->asid_free[tlb->asid_nfree++] = asid;
+    if (tlb->last_asid == asid){
+        tlb->last_asid = 0;
+        tlb->last_dtb = 0;
+    }
+}
+
+// address space ID of dtb, handing out a new one if needed; when all IDs
+// are in use they are recycled round robin, flushing the old owner
+static uint32_t v2p_asid_get (struct v2p_tlb *tlb, addr_t dtb)
+{
+    uint32_t asid = v2p_asid_find(tlb, dtb);
+    addr_t *key = NULL;
+
+    if (asid){
+        return asid;
+    }
+    if (!tlb->asid_nfree){
+        dbprint("--V2P cache recycling asid %u\n", tlb->asid_victim);
+        v2p_asid_release(tlb, tlb->asid_victim);
+        tlb->asid_victim = tlb->asid_victim % (V2P_ASIDS - 1) + 1;
+    }
+    asid = tlb->asid_free[--tlb->asid_nfree];
+    tlb->asids[asid].dtb = dtb;
+    tlb->asids[asid].head = V2P_NIL;
+    tlb->asids[asid].count = 0;
+
+    key = (addr_t *) safe_malloc(sizeof(addr_t));
+    *key = dtb;
+    g_hash_table_insert(tlb->asid_map, key, GUINT_TO_POINTER(asid));
+    tlb->last_dtb = dtb;
+    tlb->last_asid = asid;
+    return asid;
 }
 
 void v2p_cache_init (vmi_instance_t vmi)
 {
-    vmi->v2p_cache = g_hash_table_new_full(g_int64_hash, g_int64_equal, v2p_cache_key_free, v2p_cache_entry_free);
+    struct v2p_tlb *tlb = (struct v2p_tlb *) safe_malloc(sizeof(struct v2p_tlb));
+
+    if (posix_memalign((void **) &tlb->sets, 64, V2P_SETS * sizeof(struct v2p_tlb_set))){
+        errprint("Failed to allocate the V2P cache.\n");
+        exit(EXIT_FAILURE);
+    }
+    tlb->entries = (struct v2p_tlb_entry *) safe_malloc(V2P_SETS * V2P_WAYS * sizeof(struct v2p_tlb_entry));
+    tlb->clock = (uint8_t *) safe_malloc(V2P_SETS);
+    memset(tlb->sets, 0, V2P_SETS * sizeof(struct v2p_tlb_set));
+    memset(tlb->clock, 0, V2P_SETS);
+    tlb->used = 0;
+    tlb->asid_map = g_hash_table_new_full(g_int64_hash, g_int64_equal, v2p_asid_key_free, NULL);
+    v2p_asid_reset(tlb);
+    vmi->v2p_cache = tlb;
 }
 
 void v2p_cache_destroy (vmi_instance_t vmi)
 {
-    g_hash_table_destroy(vmi->v2p_cache);
+    struct v2p_tlb *tlb = vmi->v2p_cache;
+
+    if (!tlb){
+        return;
+    }
+    g_hash_table_destroy(tlb->asid_map);
+    free(tlb->sets);
+    free(tlb->entries);
+    free(tlb->clock);
+    free(tlb);
+    vmi->v2p_cache = NULL;
 }
 
-status_t v2p_cache_get (vmi_instance_t vmi, addr_t va, addr_t dtb, addr_t *pa)
+static status_t v2p_cache_get_class (vmi_instance_t vmi, addr_t va, uint32_t asid, int class, addr_t *pa)
 {
-    v2p_cache_entry_t entry = NULL;
-    gint64 *key = v2p_build_key(vmi, va, dtb);
+    struct v2p_tlb *tlb = vmi->v2p_cache;
+    addr_t mask = v2p_class_size(vmi, class) - 1;
+    uint64_t tag = v2p_build_tag(vmi, va, class);
+    uint32_t index = v2p_set_index(asid, tag);
+    int way = v2p_set_find(&tlb->sets[index], tag, asid);
+    struct v2p_tlb_entry *entry = NULL;
+
+    if (way < 0){
+        return VMI_FAILURE;
+    }
+    entry = &tlb->entries[index * V2P_WAYS + way];
+
+    cache_epoch_check(vmi);
+    if (entry->epoch != vmi->cache_epoch &&
+        VMI_FAILURE == v2p_cache_revalidate(vmi, entry, va)){
+        v2p_slot_drop(tlb, index * V2P_WAYS + way);
+        return VMI_FAILURE;
+    }
 
-    if ((entry = g_hash_table_lookup(vmi->v2p_cache, key)) != NULL){
+    tlb->clock[index] |= (1 << way);
+    *pa = entry->pa | (mask & va);
+    dbprint("--V2P cache hit 0x%.16llx -- 0x%.16llx (set %u)\n", va, *pa, index);
+    return VMI_SUCCESS;
+}
 
-        // make sure we don't have a key collision
-        if ((entry->va & ~(vmi->page_size - 1)) != (va & ~(vmi->page_size - 1)) || entry->dtb != dtb){
-            dbprint("--V2P cache collision\n");
-            return VMI_FAILURE;
-        }
+status_t v2p_cache_get (vmi_instance_t vmi, addr_t va, addr_t dtb, addr_t *pa)
+{
+    uint32_t asid = v2p_asid_find(vmi->v2p_cache, dtb);
+    int class = 0;
 
-        entry->last_used = time(NULL);
-        *pa = entry->pa | ((vmi->page_size - 1) & va);
-        dbprint("--V2P cache hit 0x%.16llx -- 0x%.16llx (0x%.16llx)\n", va, *pa, *key);
-        free(key);
+    if (!asid){
+        return VMI_FAILURE;
+    }
+    if (VMI_SUCCESS == v2p_cache_get_class(vmi, va, asid, 0, pa)){
         return VMI_SUCCESS;
     }
-
-    free(key);
+    for (class = 1; class < V2P_SIZE_CLASSES; ++class){
+        if ((vmi->v2p_large & (1 << class)) &&
+            VMI_SUCCESS == v2p_cache_get_class(vmi, va, asid, class, pa)){
+            return VMI_SUCCESS;
+        }
+    }
     return VMI_FAILURE;
 }
 
-void v2p_cache_set (vmi_instance_t vmi, addr_t va, addr_t dtb, addr_t pa)
+void v2p_cache_set (vmi_instance_t vmi, addr_t va, addr_t dtb, addr_t pa, const v2p_leaf_t *leaf)
 {
     if (!va || !dtb || !pa){
         return;
     }
-    gint64 *key = v2p_build_key(vmi, va, dtb);
-    pa &= ~(vmi->page_size - 1);
-    v2p_cache_entry_t entry = v2p_cache_entry_create(va, dtb, pa);
-    g_hash_table_insert(vmi->v2p_cache, key, entry);
-    dbprint("--V2P cache set 0x%.16llx -- 0x%.16llx (0x%.16llx)\n", va, pa, *key);
+    struct v2p_tlb *tlb = vmi->v2p_cache;
+    uint32_t asid = v2p_asid_get(tlb, dtb);
+    int class = (leaf && leaf->size) ? v2p_size_class(leaf->size) : 0;
+    addr_t mask = v2p_class_size(vmi, class) - 1;
+    uint64_t tag = v2p_build_tag(vmi, va, class);
+    uint32_t index = v2p_set_index(asid, tag);
+    int way = v2p_set_find(&tlb->sets[index], tag, asid);
+    struct v2p_tlb_entry *entry = NULL;
+
+    if (way < 0){
+        way = v2p_set_victim(tlb, index);
+        if (tlb->sets[index].tag[way]){
+            v2p_slot_drop(tlb, index * V2P_WAYS + way);
+        }
+        tlb->sets[index].tag[way] = tag;
+        tlb->sets[index].asid[way] = asid;
+        v2p_slot_link(tlb, index * V2P_WAYS + way, asid);
+        tlb->used++;
+    }
+    entry = &tlb->entries[index * V2P_WAYS + way];
+    entry->pa = pa & ~mask;
+    entry->epoch = vmi->cache_epoch;
+    entry->given = (leaf == NULL);
+    if (leaf){
+        entry->leaf = *leaf;
+    }
+    else{
+        memset(&entry->leaf, 0, sizeof(v2p_leaf_t));
+    }
+    vmi->v2p_large |= (1 << class) & ~1;
+    dbprint("--V2P cache set 0x%.16llx -- 0x%.16llx size 0x%llx (set %u)\n", va, pa, mask + 1, index);
 }
 
 status_t v2p_cache_del (vmi_instance_t vmi, addr_t va, addr_t dtb)
 {
-    gint64 *key = v2p_build_key(vmi, va, dtb);
-    dbprint("--V2P cache del 0x%.16llx (0x%.16llx)\n", va, *key);
+    struct v2p_tlb *tlb = vmi->v2p_cache;
+    uint32_t asid = v2p_asid_find(tlb, dtb);
+    status_t ret = VMI_FAILURE;
+    int class = 0;
 
-    // key collision doesn't really matter here because worst case
-    // scenario we incur an small performance hit
+    if (!asid){
+        return VMI_FAILURE;
+    }
+    for (class = 0; class < V2P_SIZE_CLASSES; ++class){
+        if (class && !(vmi->v2p_large & (1 << class))){
+            continue;
+        }
+        uint64_t tag = v2p_build_tag(vmi, va, class);
+        uint32_t index = v2p_set_index(asid, tag);
+        int way = v2p_set_find(&tlb->sets[index], tag, asid);
+
+        dbprint("--V2P cache del 0x%.16llx (set %u)\n", va, index);
+        if (way >= 0){
+            v2p_slot_drop(tlb, index * V2P_WAYS + way);
+            ret = VMI_SUCCESS;
+        }
+    }
+    return ret;
+}
 
-    if (TRUE == g_hash_table_remove(vmi->v2p_cache, key)){
-        free(key);
-        return VMI_SUCCESS;
+void v2p_cache_flush (vmi_instance_t vmi)
+{
+    struct v2p_tlb *tlb = vmi->v2p_cache;
+
+    dbprint("--V2P cache flushing %u entries\n", tlb->used);
+    memset(tlb->sets, 0, V2P_SETS * sizeof(struct v2p_tlb_set));
+    memset(tlb->clock, 0, V2P_SETS);
+    tlb->used = 0;
+    v2p_asid_reset(tlb);
+    vmi->v2p_large = 0;
+}
+
+void v2p_cache_flush_dtb (vmi_instance_t vmi, addr_t dtb)
+{
+    struct v2p_tlb *tlb = vmi->v2p_cache;
+    uint32_t asid = v2p_asid_find(tlb, dtb);
+
+    if (asid){
+        dbprint("--V2P cache flushing %u entries for dtb 0x%.16llx\n", tlb->asids[asid].count, dtb);
+        v2p_asid_release(tlb, asid);
+    }
+}
+
+void v2p_cache_flush_range (vmi_instance_t vmi, addr_t dtb, addr_t va, addr_t len)
+{
+    struct v2p_tlb *tlb = vmi->v2p_cache;
+    uint32_t asid = v2p_asid_find(tlb, dtb);
+    addr_t last = va + len - 1;
+    int class = 0;
+
+    if (!asid || !len){
+        return;
+    }
+    if (last < va){
+        last = ~0ULL;
+    }
+
+    // probe page by page when the range is smaller than the address space
+    if ((last - va) / vmi->page_size < tlb->asids[asid].count){
+        for (class = 0; class < V2P_SIZE_CLASSES; ++class){
+            if (class && !(vmi->v2p_large & (1 << class))){
+                continue;
+            }
+            addr_t size = v2p_class_size(vmi, class);
+            addr_t base = va & ~(size - 1);
+
+            while (1){
+                uint64_t tag = v2p_build_tag(vmi, base, class);
+                uint32_t index = v2p_set_index(asid, tag);
+                int way = v2p_set_find(&tlb->sets[index], tag, asid);
+
+                if (way >= 0){
+                    v2p_slot_drop(tlb, index * V2P_WAYS + way);
+                }
+                if (last - base < size){
+                    break;
+                }
+                base += size;
+            }
+        }
     }
     else{
-        free(key);
-        return VMI_FAILURE;
+        uint32_t slot = tlb->asids[asid].head;
+
+        while (slot != V2P_NIL){
+            uint32_t next = tlb->entries[slot].next;
+            uint64_t tag = tlb->sets[slot / V2P_WAYS].tag[slot % V2P_WAYS];
+            addr_t size = v2p_class_size(vmi, tag & (V2P_TAG_VALID - 1));
+            addr_t base = tag & ~(size - 1);
+
+            if (base <= last && base + size - 1 >= va){
+                v2p_slot_drop(tlb, slot);
+            }
+            slot = next;
+        }
     }
+    dbprint("--V2P cache flushed 0x%.16llx-0x%.16llx for dtb 0x%.16llx\n", va, last, dtb);
 }
 
-void v2p_cache_flush (vmi_instance_t vmi)
+//
+// Paging structure cache implementation
+// Holds the upper-level entries seen during page table walks, keyed by
+// (dtb, level, tag) where tag is the part of the vaddr selecting the entry.
+struct ps_cache_entry{
+    addr_t dtb;
+    addr_t tag;
+    int level;
+    uint64_t value;
+    addr_t location;
+    uint64_t last_used;
+};
+typedef struct ps_cache_entry *ps_cache_entry_t;
+
+static void ps_cache_key_free (gpointer data)
+{
+    if (data) free(data);
+}
+
+static void ps_cache_entry_free (gpointer data)
+{
+    ps_cache_entry_t entry = (ps_cache_entry_t) data;
+    if (entry) free(entry);
+}
+
+static uint64_t ps_build_key (addr_t dtb, int level, addr_t tag)
+{
+    return hash128to64(dtb, (tag << 2) | level);
+}
+
+static gboolean ps_cache_entry_is_old (gpointer key, gpointer value, gpointer data)
+{
+    ps_cache_entry_t entry = (ps_cache_entry_t) value;
+    uint64_t cutoff = *(uint64_t *) data;
+    return (entry->last_used < cutoff) ? TRUE : FALSE;
+}
+
+static gboolean ps_cache_entry_has_dtb (gpointer key, gpointer value, gpointer data)
+{
+    ps_cache_entry_t entry = (ps_cache_entry_t) value;
+    return (entry->dtb == *(addr_t *) data) ? TRUE : FALSE;
+}
+
+// drop the least recently used half of the cache
+static void ps_cache_clean (vmi_instance_t vmi)
+{
+    uint64_t cutoff = 0;
+    if (vmi->ps_cache_tick > vmi->ps_cache_size_max / 2){
+        cutoff = vmi->ps_cache_tick - vmi->ps_cache_size_max / 2;
+    }
+    g_hash_table_foreach_remove(vmi->ps_cache, ps_cache_entry_is_old, &cutoff);
+    if (g_hash_table_size(vmi->ps_cache) >= vmi->ps_cache_size_max){
+        g_hash_table_remove_all(vmi->ps_cache);
+    }
+    dbprint("--PS cache cleanup round complete (cache size = %u)\n", g_hash_table_size(vmi->ps_cache));
+}
+
+void ps_cache_init (vmi_instance_t vmi)
+{
+    vmi->ps_cache = g_hash_table_new_full(g_int64_hash, g_int64_equal, ps_cache_key_free, ps_cache_entry_free);
+    vmi->ps_cache_size_max = MAX_PS_CACHE_SIZE;
+    vmi->ps_cache_tick = 0;
+}
+
+void ps_cache_destroy (vmi_instance_t vmi)
+{
+    g_hash_table_destroy(vmi->ps_cache);
+}
+
+status_t ps_cache_get (vmi_instance_t vmi, addr_t dtb, int level, addr_t tag, uint64_t *value, addr_t *location)
+{
+    ps_cache_entry_t entry = NULL;
+    uint64_t key = ps_build_key(dtb, level, tag);
+
+    cache_epoch_check(vmi);
+    if ((entry = g_hash_table_lookup(vmi->ps_cache, &key)) != NULL){
+
+        // make sure we don't have a key collision
+        if (entry->dtb != dtb || entry->level != level || entry->tag != tag){
+            dbprint("--PS cache collision\n");
+            return VMI_FAILURE;
+        }
+
+        entry->last_used = ++vmi->ps_cache_tick;
+        *value = entry->value;
+        *location = entry->location;
+        return VMI_SUCCESS;
+    }
+
+    return VMI_FAILURE;
+}
+
+void ps_cache_set (vmi_instance_t vmi, addr_t dtb, int level, addr_t tag, uint64_t value, addr_t location)
+{
+    if (!dtb){
+        return;
+    }
+    cache_epoch_check(vmi);
+    if (g_hash_table_size(vmi->ps_cache) >= vmi->ps_cache_size_max){
+        ps_cache_clean(vmi);
+    }
+
+    uint64_t *key = (uint64_t *) safe_malloc(sizeof(uint64_t));
+    *key = ps_build_key(dtb, level, tag);
+
+    ps_cache_entry_t entry = (ps_cache_entry_t) safe_malloc(sizeof(struct ps_cache_entry));
+    entry->dtb = dtb;
+    entry->tag = tag;
+    entry->level = level;
+    entry->value = value;
+    entry->location = location;
+    entry->last_used = ++vmi->ps_cache_tick;
+    g_hash_table_insert(vmi->ps_cache, key, entry);
+}
+
+void ps_cache_flush (vmi_instance_t vmi)
+{
+    g_hash_table_remove_all(vmi->ps_cache);
+    dbprint("--PS cache flushed\n");
+}
+
+void ps_cache_flush_dtb (vmi_instance_t vmi, addr_t dtb)
 {
-    g_hash_table_remove_all(vmi->v2p_cache);
-    dbprint("--V2P cache flushed\n");
+    g_hash_table_foreach_remove(vmi->ps_cache, ps_cache_entry_has_dtb, &dtb);
+    dbprint("--PS cache flushed for dtb 0x%.16llx\n", dtb);
 }
 
 #else
@@ -326,6 +899,7 @@ status_t pid_cache_get (vmi_instance_t vmi, int pid, addr_t *dtb){ return VMI_FA
 void pid_cache_set (vmi_instance_t vmi, int pid, addr_t dtb){ return; }
 status_t pid_cache_del (vmi_instance_t vmi, int pid){ return VMI_FAILURE; }
 void pid_cache_flush (vmi_instance_t vmi) { return; }
+void pid_cache_flush_dtb (vmi_instance_t vmi, addr_t dtb) { return; }
 void sym_cache_init (vmi_instance_t vmi){ return; }
 void sym_cache_destroy (vmi_instance_t vmi){ return; }
 status_t sym_cache_get (vmi_instance_t vmi, char *sym, addr_t *va){ return VMI_FAILURE; }
@@ -335,9 +909,17 @@ void sym_cache_flush (vmi_instance_t vmi) { return; }
 void v2p_cache_init (vmi_instance_t vmi){ return; }
 void v2p_cache_destroy (vmi_instance_t vmi){ return; }
 status_t v2p_cache_get (vmi_instance_t vmi, addr_t va, addr_t dtb, addr_t *pa){ return VMI_FAILURE; }
-void v2p_cache_set (vmi_instance_t vmi, addr_t va, addr_t dtb, addr_t pa){ return; }
+void v2p_cache_set (vmi_instance_t vmi, addr_t va, addr_t dtb, addr_t pa, const v2p_leaf_t *leaf){ return; }
 status_t v2p_cache_del (vmi_instance_t vmi, addr_t va, addr_t dtb){ return VMI_FAILURE; }
 void v2p_cache_flush (vmi_instance_t vmi) { return; }
+void v2p_cache_flush_dtb (vmi_instance_t vmi, addr_t dtb) { return; }
+void v2p_cache_flush_range (vmi_instance_t vmi, addr_t dtb, addr_t va, addr_t len) { return; }
+void ps_cache_init (vmi_instance_t vmi){ return; }
+void ps_cache_destroy (vmi_instance_t vmi){ return; }
+status_t ps_cache_get (vmi_instance_t vmi, addr_t dtb, int level, addr_t tag, uint64_t *value, addr_t *location){ return VMI_FAILURE; }
+void ps_cache_set (vmi_instance_t vmi, addr_t dtb, int level, addr_t tag, uint64_t value, addr_t location){ return; }
+void ps_cache_flush (vmi_instance_t vmi) { return; }
+void ps_cache_flush_dtb (vmi_instance_t vmi, addr_t dtb) { return; }
 #endif
 
 // Below are wrapper functions for external API access to the cache
@@ -345,5 +927,11 @@ void vmi_pidcache_add (vmi_instance_t vmi, int pid, addr_t dtb){ return pid_cach
 void vmi_pidcache_flush (vmi_instance_t vmi){ return pid_cache_flush(vmi); }
 void vmi_symcache_add (vmi_instance_t vmi, char *sym, addr_t va){ return sym_cache_set(vmi, sym, va); }
 void vmi_symcache_flush (vmi_instance_t vmi){ return sym_cache_flush(vmi); }
-void vmi_v2pcache_add (vmi_instance_t vmi, addr_t va, addr_t dtb, addr_t pa){ return v2p_cache_set(vmi, va, dtb, pa); }
-void vmi_v2pcache_flush (vmi_instance_t vmi){ return v2p_cache_flush(vmi); }
+void vmi_v2pcache_add (vmi_instance_t vmi, addr_t va, addr_t dtb, addr_t pa){ return v2p_cache_set(vmi, va, dtb, pa, NULL); }
+void vmi_v2pcache_flush (vmi_instance_t vmi){ v2p_cache_flush(vmi); ps_cache_flush(vmi); kernel_share_flush(vmi); }
+void vmi_v2pcache_flush_dtb (vmi_instance_t vmi, addr_t dtb){ v2p_cache_flush_dtb(vmi, dtb); ps_cache_flush_dtb(vmi, dtb); pid_cache_flush_dtb(vmi, dtb); kernel_share_flush_dtb(vmi, dtb); }
+void vmi_v2pcache_flush_range (vmi_instance_t vmi, addr_t dtb, addr_t va, addr_t len){ v2p_cache_flush_range(vmi, dtb, va, len); ps_cache_flush_dtb(vmi, dtb); }
+void vmi_pscache_flush (vmi_instance_t vmi){ return ps_cache_flush(vmi); }
+void vmi_pscache_flush_dtb (vmi_instance_t vmi, addr_t dtb){ return ps_cache_flush_dtb(vmi, dtb); }
+void vmi_cache_epoch_bump (vmi_instance_t vmi){ return cache_epoch_bump(vmi); }
+void vmi_set_cache_epoch_interval (vmi_instance_t vmi, uint32_t msec){ vmi->cache_epoch_interval = msec; }
@@ -291,6 +291,7 @@ _exit:
         vmi->pae = vmi->pse = vmi->lme = vmi->cr3 = 0;
         dbprint("**set paging-related fields to 0\n");
     }
+    v2p_walker_init(vmi);
 
     return ret;
 }
@@ -391,7 +392,7 @@ static status_t set_id_and_name (vmi_instance_t vmi, vmi_mode_t mode, unsigned l
     return VMI_SUCCESS;
 }
 
-static status_t vmi_init_private (vmi_instance_t *vmi, uint32_t flags, unsigned long id, char *name, char *configstr)
+static status_t vmi_init_private (vmi_instance_t *vmi, uint32_t flags, unsigned long id, char *name, char *configstr, vmi_pool_t pool)
 {
     uint32_t access_mode = flags & 0x0000FFFF;
     uint32_t init_mode = flags & 0xFFFF0000;
@@ -408,11 +409,23 @@ static status_t vmi_init_private (vmi_instance_t *vmi, uint32_t flags, unsigned
     (*vmi)->flags     = flags;
     (*vmi)->init_mode = init_mode;
     (*vmi)->configstr = configstr;
+    pthread_mutex_init(&(*vmi)->read_lock, NULL);
+
+    /* share the pool's resources */
+    if (pool){
+        pool_retain(pool);
+        (*vmi)->pool = pool;
+        if (!configstr && pool->config){
+            (*vmi)->configstr = strdup(pool->config);
+        }
+    }
 
     /* setup the caches */
+    cache_epoch_init(*vmi);
     pid_cache_init(*vmi);
     sym_cache_init(*vmi);
     v2p_cache_init(*vmi);
+    ps_cache_init(*vmi);
 
     /* connecting to xen, kvm, file, etc */
     if (VMI_FAILURE == set_driver_type(*vmi, access_mode, id, name)){
@@ -493,7 +506,7 @@ char *build_config_str (vmi_instance_t *vmi, char *config)
 
 status_t vmi_init (vmi_instance_t *vmi, uint32_t flags, char *name)
 {
-    return vmi_init_private(vmi, flags, 0, name, NULL);
+    return vmi_init_private(vmi, flags, 0, name, NULL, NULL);
 }
 
 status_t vmi_init_complete (vmi_instance_t *vmi, char *config)
@@ -501,24 +514,54 @@ status_t vmi_init_complete (vmi_instance_t *vmi, char *config)
     uint32_t flags = VMI_INIT_COMPLETE | (*vmi)->mode;
     char *name = strdup((*vmi)->image_type);
     char *configstr = NULL;
+    vmi_pool_t pool = (*vmi)->pool;
+    status_t ret = VMI_FAILURE;
 
     if (config){
         configstr = build_config_str(vmi, config);
     }
+    if (pool){
+        pool_retain(pool);
+    }
     vmi_destroy(*vmi);
-    return vmi_init_private(vmi, flags, 0, name, configstr);
+    if (pool){
+        pthread_mutex_lock(&pool->init_lock);
+    }
+    ret = vmi_init_private(vmi, flags, 0, name, configstr, pool);
+    if (pool){
+        pthread_mutex_unlock(&pool->init_lock);
+        pool_release(pool);
+    }
+    return ret;
+}
+
+status_t vmi_pool_open (vmi_pool_t pool, vmi_instance_t *vmi, uint32_t flags, char *name)
+{
+    status_t ret = VMI_FAILURE;
+
+    pthread_mutex_lock(&pool->init_lock);
+    ret = vmi_init_private(vmi, flags, 0, name, NULL, pool);
+    pthread_mutex_unlock(&pool->init_lock);
+    return ret;
 }
 
 status_t vmi_destroy (vmi_instance_t vmi)
 {
+    memory_cache_destroy(vmi);
     driver_destroy(vmi);
     pid_cache_destroy(vmi);
     sym_cache_destroy(vmi);
     v2p_cache_destroy(vmi);
-    memory_cache_destroy(vmi);
+    ps_cache_destroy(vmi);
+    walk_snapshot_destroy(vmi);
+    p2m_destroy(vmi);
+    kernel_share_destroy(vmi);
+    linux_system_map_destroy(vmi);
     if (vmi->sysmap) free(vmi->sysmap);
     if (vmi->image_type) free(vmi->image_type);
     if (vmi->configstr) free(vmi->configstr);
+    if (vmi->pool) pool_release(vmi->pool);
+    pthread_mutex_destroy(&vmi->read_lock);
     if (vmi) free(vmi);
     return VMI_SUCCESS;
 }
@@ -30,6 +30,7 @@
 #include "driver/kvm.h"
 #include "driver/file.h"
 #include <stdlib.h>
+#include <string.h>
 
 struct driver_instance{
     status_t (*init_ptr)(vmi_instance_t);
@@ -50,14 +51,20 @@ struct driver_instance{
 };
 typedef struct driver_instance * driver_instance_t;
 
-static driver_instance_t instance = NULL;
-static xen_instance_t xeninst;
-static kvm_instance_t kvminst;
-static file_instance_t fileinst;
+// The function table and the driver data are both allocated per instance,
+// so instances using different drivers, or several domains on the same
+// driver, can live side by side in one process.
 
-static void driver_xen_setup (vmi_instance_t vmi)
+static void *driver_data_new (size_t size)
 {
-    vmi->driver = &xeninst;
+    void *data = safe_malloc(size);
+    memset(data, 0, size);
+    return data;
+}
+
+static void driver_xen_setup (vmi_instance_t vmi, driver_instance_t instance)
+{
+    vmi->driver = driver_data_new(sizeof(xen_instance_t));
     instance->init_ptr = &xen_init;
     instance->destroy_ptr = &xen_destroy;
     instance->get_id_from_name_ptr = &xen_get_domainid_from_name;
@@ -75,9 +82,9 @@ static void driver_xen_setup (vmi_instance_t vmi)
     instance->resume_vm_ptr = &xen_resume_vm;
 }
 
-static void driver_kvm_setup (vmi_instance_t vmi)
+static void driver_kvm_setup (vmi_instance_t vmi, driver_instance_t instance)
 {
-    vmi->driver = &kvminst;
+    vmi->driver = driver_data_new(sizeof(kvm_instance_t));
     instance->init_ptr = &kvm_init;
     instance->destroy_ptr = &kvm_destroy;
     instance->get_id_from_name_ptr = &kvm_get_id_from_name;
@@ -95,9 +102,9 @@ static void driver_kvm_setup (vmi_instance_t vmi)
     instance->resume_vm_ptr = &kvm_resume_vm;
 }
 
-static void driver_file_setup (vmi_instance_t vmi)
+static void driver_file_setup (vmi_instance_t vmi, driver_instance_t instance)
 {
-    vmi->driver = &fileinst;
+    vmi->driver = driver_data_new(sizeof(file_instance_t));
     instance->init_ptr = &file_init;
     instance->destroy_ptr = &file_destroy;
     instance->get_id_from_name_ptr = NULL; //TODO add get_id_from_name_ptr
@@ -115,7 +122,7 @@ static void driver_file_setup (vmi_instance_t vmi)
     instance->resume_vm_ptr = &file_resume_vm;
 }
 
-static void driver_null_setup (vmi_instance_t vmi)
+static void driver_null_setup (vmi_instance_t vmi, driver_instance_t instance)
 {
     vmi->driver = NULL;
     instance->init_ptr = NULL;
@@ -136,24 +143,27 @@ static void driver_null_setup (vmi_instance_t vmi)
 
 static driver_instance_t driver_get_instance (vmi_instance_t vmi)
 {
+    driver_instance_t instance = vmi->driver_ptrs;
+
     if (NULL == vmi->driver || NULL == instance){
         /* allocate memory for the function pointers, if needed */
         if (NULL == instance){
-            instance = (driver_instance_t) safe_malloc(sizeof(struct driver_instance));
+            instance = (driver_instance_t) driver_data_new(sizeof(struct driver_instance));
+            vmi->driver_ptrs = instance;
         }
 
         /* assign the function pointers */
         if (VMI_XEN == vmi->mode){
-            driver_xen_setup(vmi);
+            driver_xen_setup(vmi, instance);
         }
         else if (VMI_KVM == vmi->mode){
-            driver_kvm_setup(vmi);
+            driver_kvm_setup(vmi, instance);
         }
         else if (VMI_FILE == vmi->mode){
-            driver_file_setup(vmi);
+            driver_file_setup(vmi, instance);
         }
         else{
-            driver_null_setup(vmi);
+            driver_null_setup(vmi, instance);
         }
 
     }
@@ -212,12 +222,16 @@ void driver_destroy (vmi_instance_t vmi)
 {
     driver_instance_t ptrs = driver_get_instance(vmi);
     if (NULL != ptrs && NULL != ptrs->destroy_ptr){
-        return ptrs->destroy_ptr(vmi);
+        ptrs->destroy_ptr(vmi);
     }
     else{
         dbprint("WARNING: driver_destroy function not implemented.\n");
-        return;
     }
+
+    if (vmi->driver) free(vmi->driver);
+    if (vmi->driver_ptrs) free(vmi->driver_ptrs);
+    vmi->driver = NULL;
+    vmi->driver_ptrs = NULL;
 }
 
 unsigned long driver_get_id_from_name (vmi_instance_t vmi, char *name)
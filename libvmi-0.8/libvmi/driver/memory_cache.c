@@ -30,80 +30,233 @@
 #define _GNU_SOURCE
 #include <glib.h>
 #include <time.h>
+#include <limits.h>
+#include <string.h>
 
 #include "glib_compat.h"
 
+#define PAGE_CACHE_SIZE_ENV "LIBVMI_PAGE_CACHE_SIZE"
+
+// The page cache is indexed directly by frame number through a two level
+// array: vmi->memory_cache holds pointers to leaves of PAGE_INDEX_LEAF
+// entry pointers each, allocated on first use, so a lookup is two loads
+// with no hashing or allocation.  Guest physical memory is dense, so the
+// leaves stay allocated until the cache is destroyed; each costs 4KB per
+// 2MB of guest memory touched.  On top of that, an LRU list is threaded
+// through the entries themselves.  The list is circular and
+// vmi->memory_cache_lru points at the most recently used entry, so its
+// prev is the eviction candidate.  Touching and evicting an entry are both
+// O(1), and the capacity is a byte budget rather than a page count.
+//
+// Drivers that copy guest memory give an age limit after which a cached
+// copy is fetched again; an age of 0 means the driver's pages are live
+// mappings or immutable and never need refreshing.  The age is only
+// checked while the VM runs, against a coarse monotonic clock that is read
+// at most once per read batch.  While the VM is paused, a page fetched
+// during the current pause window cannot have changed and is trusted
+// regardless of age; a copy made before the pause is fetched once more.
+// A batch can also ask for fresh reads, which refetches each copied page
+// the first time the batch touches it.
+//
+// Callers can pin an entry to hold on to its data pointer.  A pinned entry
+// is taken off the LRU ring, so eviction never sees it, and its data is
+// neither refreshed nor released until the last pin is dropped.
+
+#define PAGE_INDEX_SHIFT 9
+#define PAGE_INDEX_LEAF (1ULL << PAGE_INDEX_SHIFT)
+#define PAGE_INDEX_MAX_LEAVES (1ULL << 24)   // 32TB of 4KB frames
+
 struct memory_cache_entry{
     addr_t paddr;
     uint32_t length;
-    time_t last_updated;
-    time_t last_used;
+    uint64_t last_updated;      // coarse clock, msec
+    uint64_t window;            // pause window the data was fetched in
+    uint64_t fresh;             // fresh batch the data was fetched in
+    uint32_t pins;              // off the LRU ring while nonzero
+    int stale;                  // written while pinned, dropped at the last unpin
     void *data;
+    struct memory_cache_entry *prev;
+    struct memory_cache_entry *next;
 };
 typedef struct memory_cache_entry *memory_cache_entry_t;
-static void *(*get_data_callback)(vmi_instance_t, addr_t, uint32_t) = NULL;
-static void (*release_data_callback)(void *, size_t) = NULL;
 
 //---------------------------------------------------------
 // Internal implementation functions
 
-static void memory_cache_key_free (gpointer data)
+static void memory_cache_entry_free (vmi_instance_t vmi, memory_cache_entry_t entry)
 {
-    if (data) free(data);
+    if (entry){
+        vmi->memory_cache_release_data(entry->data, entry->length);
+        free(entry);
+    }
 }
 
-static void memory_cache_entry_free (gpointer data)
+// Returns the index slot for \a paddr, or NULL if there is none.  With
+// \a create the top level is grown and the leaf allocated as needed.
+static memory_cache_entry_t *index_slot (vmi_instance_t vmi, addr_t paddr, int create)
 {
-    memory_cache_entry_t entry = (memory_cache_entry_t) data;
-    if (entry){
-        release_data_callback(entry->data, entry->length);
-        free(entry);
+    uint64_t frame = paddr >> 12;
+    uint64_t index = frame >> PAGE_INDEX_SHIFT;
+    memory_cache_entry_t *leaf = NULL;
+
+    if (index >= vmi->memory_cache_nleaves){
+        uint64_t nleaves = vmi->memory_cache_nleaves ? vmi->memory_cache_nleaves : 64;
+        if (!create || index >= PAGE_INDEX_MAX_LEAVES){
+            return NULL;
+        }
+        while (nleaves <= index){
+            nleaves <<= 1;
+        }
+        memory_cache_entry_t **leaves = realloc(vmi->memory_cache, nleaves * sizeof(memory_cache_entry_t *));
+        if (!leaves){
+            errprint("Failed to grow the page cache index to 0x%llx leaves\n", nleaves);
+            return NULL;
+        }
+        memset(leaves + vmi->memory_cache_nleaves, 0,
+               (nleaves - vmi->memory_cache_nleaves) * sizeof(memory_cache_entry_t *));
+        vmi->memory_cache = leaves;
+        vmi->memory_cache_nleaves = nleaves;
+    }
+
+    if ((leaf = vmi->memory_cache[index]) == NULL){
+        if (!create){
+            return NULL;
+        }
+        leaf = (memory_cache_entry_t *) safe_malloc(PAGE_INDEX_LEAF * sizeof(memory_cache_entry_t));
+        memset(leaf, 0, PAGE_INDEX_LEAF * sizeof(memory_cache_entry_t));
+        vmi->memory_cache[index] = leaf;
     }
+    return &leaf[frame & (PAGE_INDEX_LEAF - 1)];
 }
 
 static void *get_memory_data (vmi_instance_t vmi, addr_t paddr, uint32_t length)
 {
-    return get_data_callback(vmi, paddr, length);
+    return vmi->memory_cache_get_data(vmi, paddr, length);
 }
 
-static void remove_entry (gpointer key, gpointer cache)
+static uint64_t coarse_clock_ms (void)
 {
-    GHashTable *memory_cache = cache;
-    g_hash_table_remove(memory_cache, key);
-    free(key);
+    struct timespec ts;
+#ifdef CLOCK_MONOTONIC_COARSE
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+#else
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+#endif
+    return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// The clock for the current batch, read on first use.  Outside a batch
+// every call is a batch of its own.
+static uint64_t batch_clock (vmi_instance_t vmi)
+{
+    if (!vmi->memory_cache_batch){
+        return coarse_clock_ms();
+    }
+    if (!vmi->memory_cache_clock){
+        vmi->memory_cache_clock = coarse_clock_ms();
+    }
+    return vmi->memory_cache_clock;
 }
 
-static void clean_cache (vmi_instance_t vmi)
+static void stamp_entry (vmi_instance_t vmi, memory_cache_entry_t entry)
 {
-    GList *list = NULL;
-    while (vmi->memory_cache_size > vmi->memory_cache_size_max / 2){
-        gpointer key = NULL;
-        GList *last = g_list_last(vmi->memory_cache_lru);
-        key = last->data;
-        list = g_list_prepend(list, key);
-        vmi->memory_cache_lru = g_list_remove_link(vmi->memory_cache_lru, last);
-        vmi->memory_cache_size--;
+    entry->window = vmi->memory_cache_window;
+    entry->fresh = vmi->memory_cache_fresh;
+    entry->last_updated = vmi->memory_cache_age ? batch_clock(vmi) : 0;
+}
+
+static int entry_is_fresh (vmi_instance_t vmi, memory_cache_entry_t entry)
+{
+    if (!vmi->memory_cache_age){
+        return 1;
+    }
+    if (vmi->memory_cache_fresh && entry->fresh != vmi->memory_cache_fresh){
+        return 0;
+    }
+    if (vmi->memory_cache_paused){
+        return entry->window == vmi->memory_cache_window;
+    }
+    return batch_clock(vmi) - entry->last_updated <= vmi->memory_cache_age;
+}
+
+static void lru_unlink (vmi_instance_t vmi, memory_cache_entry_t entry)
+{
+    if (entry->next == entry){
+        vmi->memory_cache_lru = NULL;
+    }
+    else{
+        entry->prev->next = entry->next;
+        entry->next->prev = entry->prev;
+        if (vmi->memory_cache_lru == entry){
+            vmi->memory_cache_lru = entry->next;
+        }
+    }
+    entry->prev = entry->next = NULL;
+}
+
+static void lru_push (vmi_instance_t vmi, memory_cache_entry_t entry)
+{
+    memory_cache_entry_t head = vmi->memory_cache_lru;
+    if (!head){
+        entry->prev = entry->next = entry;
+    }
+    else{
+        entry->next = head;
+        entry->prev = head->prev;
+        head->prev->next = entry;
+        head->prev = entry;
+    }
+    vmi->memory_cache_lru = entry;
+}
+
+static void lru_touch (vmi_instance_t vmi, memory_cache_entry_t entry)
+{
+    if (vmi->memory_cache_lru != entry){
+        lru_unlink(vmi, entry);
+        lru_push(vmi, entry);
+    }
+}
+
+// Evicts least recently used entries until \a needed more bytes fit in
+// the budget.  Only the victims are touched.
+static void clean_cache (vmi_instance_t vmi, uint64_t needed)
+{
+    uint32_t evicted = 0;
+    while (vmi->memory_cache_lru &&
+           vmi->memory_cache_size + needed > vmi->memory_cache_size_max){
+        memory_cache_entry_t victim = vmi->memory_cache_lru->prev;
+        lru_unlink(vmi, victim);
+        vmi->memory_cache_size -= victim->length;
+        *index_slot(vmi, victim->paddr, 0) = NULL;
+        vmi->memory_cache_count--;
+        memory_cache_entry_free(vmi, victim);
+        evicted++;
+    }
+    if (evicted){
+        dbprint("--MEMORY cache evicted %u pages (cache size = %u)\n", evicted, vmi->memory_cache_count);
     }
-    g_list_foreach(list, remove_entry, vmi->memory_cache);
-    g_list_free(list);
-    dbprint("--MEMORY cache cleanup round complete (cache size = %u)\n", g_hash_table_size(vmi->memory_cache));
 }
 
 static void *validate_and_return_data (vmi_instance_t vmi, memory_cache_entry_t entry)
 {
-    time_t now = time(NULL);
-    if (vmi->memory_cache_age && (now - entry->last_updated > vmi->memory_cache_age)){
+    if (entry->pins){
+        return entry->data;
+    }
+    if (!entry_is_fresh(vmi, entry)){
         dbprint("--MEMORY cache refresh 0x%llx\n", entry->paddr);
-		release_data_callback(entry->data, entry->length);
+        vmi->memory_cache_release_data(entry->data, entry->length);
         entry->data = get_memory_data(vmi, entry->paddr, entry->length);
-        entry->last_updated = now;
-
-        gint64 *key = safe_malloc(sizeof(gint64));
-        *key = entry->paddr;
-        vmi->memory_cache_lru = g_list_remove(vmi->memory_cache_lru, key);
-        vmi->memory_cache_lru = g_list_prepend(vmi->memory_cache_lru, key);
+        if (!entry->data){
+            lru_unlink(vmi, entry);
+            *index_slot(vmi, entry->paddr, 0) = NULL;
+            vmi->memory_cache_count--;
+            vmi->memory_cache_size -= entry->length;
+            free(entry);
+            return NULL;
+        }
+        stamp_entry(vmi, entry);
     }
-    entry->last_used = now;
+    lru_touch(vmi, entry);
     return entry->data;
 }
 
@@ -127,18 +280,22 @@ static memory_cache_entry_t create_new_entry (vmi_instance_t vmi, addr_t paddr,
         return 0;
     }
 
+    void *data = get_memory_data(vmi, paddr, length);
+    if (!data){
+        return 0;
+    }
+
     memory_cache_entry_t entry =
         (memory_cache_entry_t) safe_malloc(sizeof(struct memory_cache_entry));
 
     entry->paddr        = paddr;
     entry->length       = length;
-    entry->last_updated = time(NULL);
-    entry->last_used    = entry->last_updated;
-    entry->data         = get_memory_data(vmi, paddr, length);
-
-    if (vmi->memory_cache_size >= vmi->memory_cache_size_max){
-        clean_cache(vmi);
-    }
+    entry->data         = data;
+    entry->prev         = NULL;
+    entry->next         = NULL;
+    entry->pins         = 0;
+    entry->stale        = 0;
+    stamp_entry(vmi, entry);
 
     return entry;
 }
@@ -151,13 +308,27 @@ void memory_cache_init (
 		void (*release_data)(void *, size_t),
 		unsigned long age_limit)
 {
-    vmi->memory_cache = g_hash_table_new_full(g_int64_hash, g_int64_equal, memory_cache_key_free, memory_cache_entry_free);
+    char *budget = getenv(PAGE_CACHE_SIZE_ENV);
+
+    vmi->memory_cache = NULL;
+    vmi->memory_cache_nleaves = 0;
+    vmi->memory_cache_count = 0;
     vmi->memory_cache_lru = NULL;
-    vmi->memory_cache_age = age_limit;
+    vmi->memory_cache_age = (age_limit < UINT32_MAX / 1000) ? age_limit * 1000 : 0;
+    vmi->memory_cache_clock = 0;
+    vmi->memory_cache_batch = 0;
+    vmi->memory_cache_fresh = 0;
+    vmi->memory_cache_fresh_next = 0;
+    vmi->memory_cache_window = 1;
+    vmi->memory_cache_paused = 0;
     vmi->memory_cache_size = 0;
     vmi->memory_cache_size_max = MAX_PAGE_CACHE_SIZE;
-    get_data_callback = get_data;
-	release_data_callback = release_data;
+    if (budget && *budget){
+        vmi->memory_cache_size_max = strtoull(budget, NULL, 0);
+        dbprint("--MEMORY cache budget from %s = %llu bytes\n", PAGE_CACHE_SIZE_ENV, vmi->memory_cache_size_max);
+    }
+    vmi->memory_cache_get_data = get_data;
+    vmi->memory_cache_release_data = release_data;
 }
 
 #if ENABLE_PAGE_CACHE == 1
@@ -170,11 +341,14 @@ void *memory_cache_insert (vmi_instance_t vmi, addr_t paddr)
         return NULL;
     }
 
-    gint64 *key = safe_malloc(sizeof(gint64));
-    *key = paddr;
-    if ((entry = g_hash_table_lookup(vmi->memory_cache, key)) != NULL){
+    memory_cache_entry_t *slot = index_slot(vmi, paddr, 1);
+    if (!slot){
+        errprint("Memory cache request for PA [0x%llx] beyond the page index\n", paddr);
+        return NULL;
+    }
+
+    if ((entry = *slot) != NULL){
         dbprint("--MEMORY cache hit 0x%llx\n", paddr);
-        free(key);
         return validate_and_return_data(vmi, entry);
     }
     else{
@@ -185,12 +359,11 @@ void *memory_cache_insert (vmi_instance_t vmi, addr_t paddr)
             return 0;
         }
 
-        g_hash_table_insert(vmi->memory_cache, key, entry);
-
-        gint64 *key2 = safe_malloc(sizeof(gint64));
-        *key2 = paddr;
-        vmi->memory_cache_lru = g_list_prepend(vmi->memory_cache_lru, key2);
-        vmi->memory_cache_size++;
+        clean_cache(vmi, entry->length);
+        *slot = entry;
+        vmi->memory_cache_count++;
+        lru_push(vmi, entry);
+        vmi->memory_cache_size += entry->length;
 
         return entry->data;
     }
@@ -202,10 +375,136 @@ void *memory_cache_insert (vmi_instance_t vmi, addr_t paddr)
 }
 #endif
 
+void memory_cache_batch_begin (vmi_instance_t vmi, int fresh)
+{
+    if (0 == vmi->memory_cache_batch++){
+        vmi->memory_cache_clock = 0;
+        vmi->memory_cache_fresh = fresh ? ++vmi->memory_cache_fresh_next : 0;
+    }
+}
+
+void memory_cache_batch_end (vmi_instance_t vmi)
+{
+    if (vmi->memory_cache_batch && 0 == --vmi->memory_cache_batch){
+        vmi->memory_cache_fresh = 0;
+    }
+}
+
+void memory_cache_set_paused (vmi_instance_t vmi, int paused)
+{
+    if (paused){
+        if (0 == vmi->memory_cache_paused++){
+            vmi->memory_cache_window++;
+        }
+    }
+    else if (vmi->memory_cache_paused && 0 == --vmi->memory_cache_paused){
+        vmi->memory_cache_window++;
+    }
+}
+
+status_t memory_cache_pin (vmi_instance_t vmi, addr_t paddr)
+{
+    memory_cache_entry_t *slot = index_slot(vmi, paddr, 0);
+    memory_cache_entry_t entry = slot ? *slot : NULL;
+
+    if (!entry){
+        return VMI_FAILURE;
+    }
+    if (0 == entry->pins++){
+        lru_unlink(vmi, entry);
+    }
+    return VMI_SUCCESS;
+}
+
+// Drops an entry that is not on the LRU ring from the index and frees it.
+static void remove_entry (vmi_instance_t vmi, memory_cache_entry_t entry)
+{
+    *index_slot(vmi, entry->paddr, 0) = NULL;
+    vmi->memory_cache_count--;
+    vmi->memory_cache_size -= entry->length;
+    memory_cache_entry_free(vmi, entry);
+}
+
+status_t memory_cache_unpin (vmi_instance_t vmi, addr_t paddr)
+{
+    memory_cache_entry_t *slot = index_slot(vmi, paddr, 0);
+    memory_cache_entry_t entry = slot ? *slot : NULL;
+
+    if (!entry || !entry->pins){
+        errprint("Memory cache unpin of PA [0x%llx] that is not pinned\n", paddr);
+        return VMI_FAILURE;
+    }
+    if (0 == --entry->pins){
+        if (entry->stale){
+            dbprint("--MEMORY cache drop written page 0x%llx at unpin\n", entry->paddr);
+            remove_entry(vmi, entry);
+            return VMI_SUCCESS;
+        }
+        lru_push(vmi, entry);
+        clean_cache(vmi, 0);
+    }
+    return VMI_SUCCESS;
+}
+
+// Called after a write to guest memory.  Drivers that copy guest memory
+// would keep returning the old copy, so the entries for the written frames
+// are dropped and fetched again on the next read.  A pinned entry cannot
+// be freed under its pins; it keeps its data, and is dropped when the last
+// pin goes.
+void memory_cache_invalidate (vmi_instance_t vmi, addr_t paddr, size_t length)
+{
+    addr_t page = paddr & ~(((addr_t) vmi->page_size) - 1);
+
+    for (; page < paddr + length; page += vmi->page_size){
+        memory_cache_entry_t *slot = index_slot(vmi, page, 0);
+        memory_cache_entry_t entry = slot ? *slot : NULL;
+
+        if (!entry){
+            continue;
+        }
+        if (entry->pins){
+            entry->stale = 1;
+            continue;
+        }
+        dbprint("--MEMORY cache drop written page 0x%llx\n", page);
+        lru_unlink(vmi, entry);
+        remove_entry(vmi, entry);
+    }
+}
+
+// Frees every entry, pinned or not, by going through the index rather
+// than the LRU ring.
 void memory_cache_destroy (vmi_instance_t vmi)
 {
-    uint32_t tmp = vmi->memory_cache_size_max;
-    vmi->memory_cache_size_max = 0;
-    clean_cache(vmi);
-    vmi->memory_cache_size_max = tmp;
+    uint64_t i, j;
+
+    if (vmi->memory_cache){
+        for (i = 0; i < vmi->memory_cache_nleaves; ++i){
+            memory_cache_entry_t *leaf = vmi->memory_cache[i];
+            if (!leaf){
+                continue;
+            }
+            for (j = 0; j < PAGE_INDEX_LEAF; ++j){
+                if (leaf[j]) memory_cache_entry_free(vmi, leaf[j]);
+            }
+            free(leaf);
+        }
+        free(vmi->memory_cache);
+    }
+    vmi->memory_cache = NULL;
+    vmi->memory_cache_nleaves = 0;
+    vmi->memory_cache_lru = NULL;
+    vmi->memory_cache_count = 0;
+    vmi->memory_cache_size = 0;
+}
+
+void vmi_set_page_cache_size (vmi_instance_t vmi, uint64_t bytes)
+{
+    vmi->memory_cache_size_max = bytes;
+    clean_cache(vmi, 0);
+}
+
+uint64_t vmi_get_page_cache_size (vmi_instance_t vmi)
+{
+    return vmi->memory_cache_size_max;
 }
@@ -36,4 +36,16 @@ void memory_cache_init (
 
 void *memory_cache_insert (vmi_instance_t vmi, addr_t paddr);
 
+void memory_cache_batch_begin (vmi_instance_t vmi, int fresh);
+
+void memory_cache_batch_end (vmi_instance_t vmi);
+
+void memory_cache_set_paused (vmi_instance_t vmi, int paused);
+
+status_t memory_cache_pin (vmi_instance_t vmi, addr_t paddr);
+
+status_t memory_cache_unpin (vmi_instance_t vmi, addr_t paddr);
+
+void memory_cache_invalidate (vmi_instance_t vmi, addr_t paddr, size_t length);
+
 void memory_cache_destroy (vmi_instance_t vmi);
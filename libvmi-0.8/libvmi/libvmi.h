@@ -55,8 +55,14 @@
 /* enable or disable the page cache */
 #define ENABLE_PAGE_CACHE 1
 
-/* max number of pages held in page cache */
-#define MAX_PAGE_CACHE_SIZE 512
+/* default byte budget of the page cache, see vmi_set_page_cache_size */
+#define MAX_PAGE_CACHE_SIZE (32 * 1024 * 1024)
+
+/* max number of upper-level page table entries held in the paging structure cache */
+#define MAX_PS_CACHE_SIZE 4096
+
+/* max number of processes in a snapshot, guards against a corrupt task list */
+#define MAX_PROCESS_LIST 1048576
 
 typedef uint32_t vmi_mode_t;
 
@@ -68,6 +74,9 @@ typedef uint32_t vmi_mode_t;
 #define VMI_INIT_PARTIAL  (1 << 16) /**< init enough to view physical addresses */
 #define VMI_INIT_COMPLETE (1 << 17) /**< full initialization */
 
+/* Flags for vmi_read_pa_flags and vmi_read_va_flags */
+#define VMI_READ_FRESH (1 << 0) /**< refetch pages copied before this read */
+
 
 typedef enum status{
     VMI_SUCCESS,  /**< return value indicating success */
@@ -192,6 +201,122 @@ typedef enum registers{
 /* type def for forward compatibility with 64-bit guests */
 typedef uint64_t addr_t;
 
+/* These describe a mapping found by vmi_foreach_mapping */
+#define VMI_MAP_WRITE (1 << 0)  /**< writable at every level of the walk */
+#define VMI_MAP_USER  (1 << 1)  /**< user accessible at every level of the walk */
+#define VMI_MAP_NX    (1 << 2)  /**< execute disabled at some level of the walk */
+#define VMI_MAP_LARGE (1 << 3)  /**< mapped by a large (2MB, 4MB or 1GB) page */
+
+/* What a leaf page table entry describes, see vmi_pte_classify */
+typedef enum pte_class{
+    VMI_PTE_PRESENT,    /**< maps a page */
+    VMI_PTE_EMPTY,      /**< all zero, nothing mapped */
+    VMI_PTE_SWAP,       /**< Linux swap entry or Windows pagefile entry */
+    VMI_PTE_TRANSITION, /**< Windows transition page, still in memory */
+    VMI_PTE_PROTOTYPE,  /**< Windows reference to a prototype PTE */
+    VMI_PTE_DEMAND_ZERO,/**< Windows demand zero page */
+    VMI_PTE_OTHER       /**< not present, with no known meaning for the OS */
+} pte_class_t;
+
+/* Location of a swapped out page, decoded from a leaf page table entry */
+typedef struct vmi_swap_entry{
+    uint32_t type;      /**< Linux swap area index, or Windows pagefile number */
+    addr_t offset;      /**< page offset within the swap area or pagefile */
+} vmi_swap_entry_t;
+
+/* Counts of leaf page table entries by class, see vmi_get_pte_stats */
+typedef struct vmi_pte_stats{
+    uint64_t present;     /**< present entries, including large pages */
+    uint64_t large;       /**< present entries that map a large page */
+    uint64_t empty;
+    uint64_t swap;
+    uint64_t transition;
+    uint64_t prototype;
+    uint64_t demand_zero;
+    uint64_t other;
+} vmi_pte_stats_t;
+
+/* Changes to the leaf entries of an address space, see vmi_get_pte_delta */
+typedef struct vmi_pte_delta{
+    uint64_t newly_present; /**< present now, but not at the last walk */
+    uint64_t newly_swapped; /**< swapped out now, but not at the last walk */
+    uint64_t unmapped;      /**< present or swapped at the last walk, now neither */
+    uint64_t tables;        /**< page table pages read by this walk */
+    uint64_t tables_changed;/**< table pages that are new or changed since the last walk */
+} vmi_pte_delta_t;
+
+/* An unmapped guest frame, see vmi_gfn_to_mfn */
+#define VMI_INVALID_MFN (~0ULL)
+
+/**
+ * Source of the second stage translation, from guest frame numbers (gfn)
+ * to machine frame numbers (mfn).  See vmi_set_p2m_provider.
+ */
+typedef struct vmi_p2m_provider{
+    /** fill mfns with the mfn of each of count frames starting at gfn,
+     *  VMI_INVALID_MFN for frames that are not mapped */
+    status_t (*populate) (void *data, uint64_t gfn, uint64_t count, uint64_t *mfns);
+    /** release data when the provider is replaced, may be NULL */
+    void (*destroy) (void *data);
+    void *data;             /**< passed to populate and destroy */
+} vmi_p2m_provider_t;
+
+/* Flags for vmi_rmap_build */
+#define VMI_RMAP_USER (1 << 0)  /**< only index user accessible mappings */
+
+/* One virtual page that maps a frame, see vmi_rmap_lookup */
+typedef struct vmi_rmap_entry{
+    addr_t dtb;         /**< address space of the mapping */
+    addr_t va;          /**< virtual address of the frame */
+    int level;          /**< leaf level: 1 for a PTE, 2 for a PDE, 3 for a PDPTE */
+    uint32_t flags;     /**< VMI_MAP_* flags of the mapping */
+} vmi_rmap_entry_t;
+
+/* Reverse map from frames to virtual pages, see vmi_rmap_build */
+typedef struct vmi_rmap * vmi_rmap_t;
+
+/* Flags for vmi_wss_create */
+#define VMI_WSS_CLEAR (1 << 0)  /**< clear accessed bits after each sample */
+
+/* Idle age buckets: 0 intervals, 1, 2-3, 4-7, ... 128 or more */
+#define VMI_WSS_AGE_BUCKETS 9
+
+/* Working set of one address space, see vmi_wss_get_report */
+typedef struct vmi_wss_report{
+    uint64_t samples;       /**< samples taken of this address space */
+    uint64_t interval_ms;   /**< length of the last sampling interval */
+    uint64_t mapped;        /**< bytes mapped by present leaf entries */
+    uint64_t accessed;      /**< bytes accessed in the last interval */
+    uint64_t dirty;         /**< bytes with the dirty bit set */
+    uint64_t idle[VMI_WSS_AGE_BUCKETS]; /**< mapped bytes by intervals since last access */
+} vmi_wss_report_t;
+
+/* Working set estimator, see vmi_wss_create */
+typedef struct vmi_wss * vmi_wss_t;
+
+/* One process, see vmi_snapshot_processes */
+typedef struct vmi_process{
+    int pid;
+    char name[16];      /**< task_struct->comm or EPROCESS->ImageFileName */
+    addr_t task;        /**< virtual address of the task_struct or EPROCESS */
+    addr_t mm;          /**< Linux mm_struct, 0 for kernel threads and on Windows */
+    addr_t dtb;         /**< directory table base, 0 if there is none */
+} vmi_process_t;
+
+/* Every process found in one pass over the task list */
+typedef struct vmi_process_table{
+    uint64_t generation;        /**< increases with each snapshot of an instance */
+    uint32_t count;
+    vmi_process_t *processes;
+} vmi_process_table_t;
+
+/* One element of a scatter-gather read, see vmi_read_va_iov */
+typedef struct vmi_iov{
+    addr_t va;          /**< virtual address to read from */
+    size_t len;         /**< bytes to read */
+    void *dst;          /**< buffer of at least len bytes */
+} vmi_iov_t;
+
 /**
  * Generic representation of Unicode string to be used within libvmi
  */
@@ -211,6 +336,16 @@ typedef struct _ustring {
  */
 typedef struct vmi_instance * vmi_instance_t;
 
+/**
+ * @brief LibVMI instance pool.
+ *
+ * A pool lets many instances in one process share read-only resources,
+ * such as the config file and System.map symbol indexes, instead of each
+ * loading its own copy.  Create one with vmi_pool_init and open instances
+ * from it with vmi_pool_open.
+ */
+typedef struct vmi_pool * vmi_pool_t;
+
 /*---------------------------------------------------------
  * Initialization and Destruction functions from core.c
  */
@@ -257,6 +392,39 @@ status_t vmi_init_complete (vmi_instance_t *vmi, char *config);
  */
 status_t vmi_destroy (vmi_instance_t vmi);
 
+/**
+ * Creates a pool for instances that should share read-only resources.
+ * The config file is read once here, and a System.map symbol index is
+ * loaded once for all the pool's instances that use that System.map.
+ *
+ * @param[out] pool The new pool
+ * @return VMI_SUCCESS or VMI_FAILURE
+ */
+status_t vmi_pool_init (vmi_pool_t *pool);
+
+/**
+ * Initializes an instance like vmi_init, as a member of \a pool.  The
+ * instance is still freed with vmi_destroy and is otherwise independent of
+ * the other instances in the pool.  This may be called from several
+ * threads at once, though the inits themselves are serialized.
+ *
+ * @param[in] pool Pool to open the instance from
+ * @param[out] vmi Struct that holds instance information
+ * @param[in] flags As for vmi_init
+ * @param[in] name Unique name specifying the VM or file to view
+ * @return VMI_SUCCESS or VMI_FAILURE
+ */
+status_t vmi_pool_open (vmi_pool_t pool, vmi_instance_t *vmi, uint32_t flags, char *name);
+
+/**
+ * Releases the caller's reference to a pool.  The shared resources are
+ * freed once the last instance opened from the pool is destroyed as well.
+ *
+ * @param[in] pool Pool to destroy
+ * @return VMI_SUCCESS or VMI_FAILURE
+ */
+status_t vmi_pool_destroy (vmi_pool_t pool);
+
 /*---------------------------------------------------------
  * Memory translation functions from memory.c
  */
@@ -282,6 +450,318 @@ addr_t vmi_translate_kv2p(vmi_instance_t vmi, addr_t vaddr);
  */
 addr_t vmi_translate_uv2p(vmi_instance_t vmi, addr_t vaddr, int pid);
 
+/**
+ * Performs the translation from virtual to physical addresses for many
+ * addresses in a single address space.  The addresses are walked in
+ * sorted order so that page table entries shared between them are only
+ * read from guest memory once.
+ *
+ * @param[in] vmi LibVMI instance
+ * @param[in] dtb Directory table base for the address space
+ * @param[in] va Array of \a n virtual addresses to translate
+ * @param[in] n Number of addresses in \a va
+ * @param[out] pa_out Array of \a n physical addresses, zero where the
+ *  translation failed
+ * @return The number of addresses translated
+ */
+size_t vmi_translate_batch (vmi_instance_t vmi, addr_t dtb, const addr_t *va, size_t n, addr_t *pa_out);
+
+/*---------------------------------------------------------
+ * Second stage (guest physical to machine) translation from p2m.c
+ */
+
+/**
+ * Sets the source of gfn to mfn translations.  LibVMI asks the provider
+ * for whole chunks of frames at a time and keeps them, so a provider
+ * backed by a hypercall is called once per chunk instead of once per
+ * lookup.  Any previous provider is destroyed and its translations are
+ * dropped.
+ *
+ * @param[in] vmi LibVMI instance
+ * @param[in] provider The provider, copied into the instance
+ * @return VMI_SUCCESS, or VMI_FAILURE if \a provider has no populate function
+ */
+status_t vmi_set_p2m_provider (vmi_instance_t vmi, const vmi_p2m_provider_t *provider);
+
+/**
+ * Sets a provider that reads gfn to mfn translations from a file.  The
+ * file is an array of 64-bit mfns in host byte order, indexed by gfn,
+ * with VMI_INVALID_MFN for frames that are not mapped.  Frames past the
+ * end of the file are not mapped.
+ *
+ * @param[in] vmi LibVMI instance
+ * @param[in] path Path to the mapping file
+ * @return VMI_SUCCESS or VMI_FAILURE
+ */
+status_t vmi_set_p2m_file (vmi_instance_t vmi, const char *path);
+
+/**
+ * Drops all cached gfn to mfn translations, e.g. after the guest
+ * balloons memory.  They are fetched again from the provider on use.
+ *
+ * @param[in] vmi LibVMI instance
+ */
+void vmi_p2m_flush (vmi_instance_t vmi);
+
+/**
+ * Translates a guest frame number to a machine frame number.
+ *
+ * @param[in] vmi LibVMI instance
+ * @param[in] gfn Guest frame number
+ * @param[out] mfn Machine frame number
+ * @return VMI_SUCCESS, or VMI_FAILURE if there is no provider or the
+ *  frame is not mapped
+ */
+status_t vmi_gfn_to_mfn (vmi_instance_t vmi, uint64_t gfn, uint64_t *mfn);
+
+/**
+ * Translates a virtual address all the way to a machine address, through
+ * the guest page tables and then the p2m.
+ *
+ * @param[in] vmi LibVMI instance
+ * @param[in] dtb Directory table base for the address space
+ * @param[in] vaddr Virtual address to translate
+ * @return Machine address, or zero on error
+ */
+addr_t vmi_translate_v2m (vmi_instance_t vmi, addr_t dtb, addr_t vaddr);
+
+/**
+ * Callback for vmi_foreach_mapping.
+ *
+ * @param[in] vmi LibVMI instance
+ * @param[in] va Virtual address where the mapping starts
+ * @param[in] pa Physical address where the mapping starts
+ * @param[in] size Size of the mapping in bytes
+ * @param[in] flags VMI_MAP_* flags for the mapping
+ * @param[in] data User data passed to vmi_foreach_mapping
+ * @return VMI_SUCCESS to continue the walk, VMI_FAILURE to stop it
+ */
+typedef status_t (*vmi_mapping_func_t) (vmi_instance_t vmi, addr_t va, addr_t pa, addr_t size, uint32_t flags, void *data);
+
+/**
+ * Walks the complete page table tree for an address space once and calls
+ * \a func for each present mapping, in increasing virtual address order.
+ * Mappings that are contiguous in both virtual and physical memory and
+ * have the same flags are merged into a single call.
+ *
+ * @param[in] vmi LibVMI instance
+ * @param[in] dtb Directory table base for the address space
+ * @param[in] func Function called for each mapping
+ * @param[in] data User data passed through to \a func
+ * @return VMI_SUCCESS, or VMI_FAILURE if the walk could not start or
+ *  \a func stopped it
+ */
+status_t vmi_foreach_mapping (vmi_instance_t vmi, addr_t dtb, vmi_mapping_func_t func, void *data);
+
+/**
+ * Callback for vmi_walk_many, like vmi_mapping_func_t with the directory
+ * table base of the address space that the mapping belongs to.
+ *
+ * @return VMI_SUCCESS to continue the walk, VMI_FAILURE to stop it
+ */
+typedef status_t (*vmi_walk_visitor_t) (vmi_instance_t vmi, addr_t dtb, addr_t va, addr_t pa,
+    addr_t size, uint32_t flags, void *data);
+
+/**
+ * Walks many address spaces at once, spread over a pool of threads.  An
+ * address space is split into one piece per present entry of its root
+ * table (PML4 entry on IA-32e), so a single large address space is also
+ * walked in parallel.  Idle threads steal pieces from busy ones.
+ *
+ * The visitor is called from several threads at once and must be thread
+ * safe.  Mappings of one root table entry are reported in address order
+ * from one thread, with contiguous mappings merged as in
+ * vmi_foreach_mapping, but there is no order between pieces.  While the
+ * walk runs, vmi_read_pa is safe to call from the visitor: finding and
+ * fetching pages is serialized with a lock, but copies out of pages that
+ * are already cached run in parallel.  The other LibVMI functions are not
+ * safe to call.
+ *
+ * On IA-32e, kernel half PML4 entries that point at the same tables as
+ * those of the kernel page tables (kpgd) are walked only once, however
+ * many processes share them, and their mappings are reported with kpgd as
+ * the dtb.  Entries that differ only in the accessed bit or in bits
+ * ignored by the CPU count as shared.
+ *
+ * @param[in] vmi LibVMI instance
+ * @param[in] dtbs Directory table bases of the address spaces
+ * @param[in] n Number of entries in \a dtbs
+ * @param[in] visitor Called for each run of mappings
+ * @param[in] data User data passed through to \a visitor
+ * @param[in] nthreads Number of threads, including the calling thread,
+ *  or 0 for one per online CPU
+ * @return VMI_SUCCESS, or VMI_FAILURE if \a visitor stopped the walk
+ */
+status_t vmi_walk_many (vmi_instance_t vmi, const addr_t *dtbs, size_t n,
+    vmi_walk_visitor_t visitor, void *data, int nthreads);
+
+/**
+ * Builds a reverse map from guest frame numbers to the virtual pages that
+ * map them, with a full walk of each address space.  The map is a snapshot
+ * of the page tables at the time of the walk; build a new one to pick up
+ * later changes.  Large pages are indexed per 2MB, so they cost 512
+ * entries per GB mapped.  On IA-32e, kernel half PML4 entries that a
+ * process shares with the kernel page tables (kpgd) are indexed once,
+ * and their mappings are reported with kpgd as the dtb.
+ *
+ * @param[in] vmi LibVMI instance
+ * @param[in] dtbs Directory table bases of the address spaces
+ * @param[in] n Number of entries in \a dtbs
+ * @param[in] flags VMI_RMAP_USER or 0
+ * @return The reverse map, or NULL on error
+ */
+vmi_rmap_t vmi_rmap_build (vmi_instance_t vmi, const addr_t *dtbs, size_t n, uint32_t flags);
+
+/**
+ * Finds the virtual pages that map a guest frame.  This takes a few
+ * array lookups, independent of the size of the map.
+ *
+ * @param[in] rmap Reverse map from vmi_rmap_build
+ * @param[in] gfn Guest frame number
+ * @param[out] out Array for up to \a max mappings, may be NULL if \a max is 0
+ * @param[in] max Number of entries in \a out
+ * @return The number of mappings of \a gfn, which can be more than \a max
+ */
+size_t vmi_rmap_lookup (vmi_rmap_t rmap, uint64_t gfn, vmi_rmap_entry_t *out, size_t max);
+
+/**
+ * Frees a reverse map.
+ *
+ * @param[in] rmap Reverse map from vmi_rmap_build
+ */
+void vmi_rmap_destroy (vmi_rmap_t rmap);
+
+/**
+ * Decodes a leaf page table entry (a PTE, or a PDE / PDPTE that maps a
+ * large page) according to the paging mode and OS of the instance.
+ * Entries that are not present are decoded as a Linux swap entry, or as
+ * a Windows pagefile, transition, prototype or demand zero entry.  Linux
+ * entries use the swap layout of 3.x kernels: on 32-bit non-PAE and
+ * IA-32e the type is in bits 1-5 and the offset starts at bit 9, and with
+ * PAE the type and offset are in the upper 32 bits.
+ *
+ * @param[in] vmi LibVMI instance
+ * @param[in] entry The page table entry
+ * @param[out] swp Swap location for VMI_PTE_SWAP entries, may be NULL
+ * @return The class of the entry
+ */
+pte_class_t vmi_pte_classify (vmi_instance_t vmi, uint64_t entry, vmi_swap_entry_t *swp);
+
+/**
+ * Walks the complete page table tree for an address space once and
+ * counts its leaf entries by class (see vmi_pte_classify).  The swap
+ * count gives the number of pages of the address space that are
+ * currently swapped out.  Only leaf tables that are present are
+ * visited, so pages below a swapped out page table are not counted.
+ *
+ * @param[in] vmi LibVMI instance
+ * @param[in] dtb Directory table base for the address space
+ * @param[out] stats Counts for the address space
+ * @return VMI_SUCCESS or VMI_FAILURE
+ */
+status_t vmi_get_pte_stats (vmi_instance_t vmi, addr_t dtb, vmi_pte_stats_t *stats);
+
+/**
+ * Like vmi_get_pte_stats, but also reports what changed since the last
+ * call for the same \a dtb.  LibVMI keeps a hash and a summary of each
+ * page table page seen, so leaf tables that have not changed are not
+ * decoded again.  Every table page is still read and hashed, and upper
+ * level tables are always decoded, so this saves decoding time rather
+ * than memory reads.  The counts in \a stats are the same as those of
+ * vmi_get_pte_stats.  The first call for a dtb reports every entry as
+ * new.  Use vmi_pte_delta_reset to drop the saved state, e.g. when the
+ * process exits.
+ *
+ * @param[in] vmi LibVMI instance
+ * @param[in] dtb Directory table base for the address space
+ * @param[out] stats Counts for the address space
+ * @param[out] delta Changes since the last call for \a dtb
+ * @return VMI_SUCCESS or VMI_FAILURE
+ */
+status_t vmi_get_pte_delta (vmi_instance_t vmi, addr_t dtb, vmi_pte_stats_t *stats, vmi_pte_delta_t *delta);
+
+/**
+ * Drops the state kept by vmi_get_pte_delta for one address space.
+ *
+ * @param[in] vmi LibVMI instance
+ * @param[in] dtb Directory table base for the address space
+ */
+void vmi_pte_delta_reset (vmi_instance_t vmi, addr_t dtb);
+
+/**
+ * Creates a working set estimator.  Each call to vmi_wss_sample walks the
+ * leaf page table entries of the address spaces added with
+ * vmi_wss_add_dtb and records their accessed (A) and dirty (D) bits.
+ * With VMI_WSS_CLEAR, the A bits that were found set are cleared after
+ * each sample, with the VM paused, so that the next sample sees only the
+ * pages accessed in between.  Without it, the A bits are left to the
+ * guest OS, and a page counts as accessed until the guest clears its bit.
+ * D bits are never cleared, since the guest relies on them to write back
+ * modified pages.  The guest TLB may keep a translation with the A bit
+ * already set, so pages that stay hot in the TLB can be missed.
+ *
+ * @param[in] vmi LibVMI instance
+ * @param[in] flags VMI_WSS_CLEAR or 0
+ * @return The estimator, or NULL on error
+ */
+vmi_wss_t vmi_wss_create (vmi_instance_t vmi, uint32_t flags);
+
+/**
+ * Frees an estimator and the state it keeps.
+ *
+ * @param[in] wss Estimator from vmi_wss_create
+ */
+void vmi_wss_destroy (vmi_wss_t wss);
+
+/**
+ * Adds an address space to sample.
+ *
+ * @param[in] wss Estimator from vmi_wss_create
+ * @param[in] dtb Directory table base for the address space
+ * @return VMI_SUCCESS, or VMI_FAILURE if it was already added
+ */
+status_t vmi_wss_add_dtb (vmi_wss_t wss, addr_t dtb);
+
+/**
+ * Stops sampling an address space and drops its state.
+ *
+ * @param[in] wss Estimator from vmi_wss_create
+ * @param[in] dtb Directory table base for the address space
+ * @return VMI_SUCCESS, or VMI_FAILURE if it was not added
+ */
+status_t vmi_wss_remove_dtb (vmi_wss_t wss, addr_t dtb);
+
+/**
+ * Takes one sample of every address space.  The sampling interval is the
+ * time since the previous sample, so call this at the rate you want, or
+ * use vmi_wss_run.
+ *
+ * @param[in] wss Estimator from vmi_wss_create
+ * @return VMI_SUCCESS, or VMI_FAILURE if an address space could not be
+ *  walked or the accessed bits could not be cleared
+ */
+status_t vmi_wss_sample (vmi_wss_t wss);
+
+/**
+ * Takes \a count samples, \a interval_ms apart.
+ *
+ * @param[in] wss Estimator from vmi_wss_create
+ * @param[in] interval_ms Length of each sampling interval in msec
+ * @param[in] count Number of samples to take
+ * @return VMI_SUCCESS, or VMI_FAILURE if a sample failed
+ */
+status_t vmi_wss_run (vmi_wss_t wss, uint32_t interval_ms, uint32_t count);
+
+/**
+ * Gets the working set of an address space as of the last sample.
+ *
+ * @param[in] wss Estimator from vmi_wss_create
+ * @param[in] dtb Directory table base for the address space
+ * @param[out] report The working set
+ * @return VMI_SUCCESS, or VMI_FAILURE if \a dtb was not added
+ */
+status_t vmi_wss_get_report (vmi_wss_t wss, addr_t dtb, vmi_wss_report_t *report);
+
 /**
  * Performs the translation from a kernel symbol to a virtual address.
  *
@@ -291,6 +771,20 @@ addr_t vmi_translate_uv2p(vmi_instance_t vmi, addr_t vaddr, int pid);
  */
 addr_t vmi_translate_ksym2v (vmi_instance_t vmi, char *symbol);
 
+/**
+ * Finds the kernel symbol at or below \a vaddr, e.g. to name the function
+ * holding an instruction pointer.  This uses the symbol table built from
+ * System.map, so it is only available for Linux guests.  The table is
+ * parsed once and saved beside System.map, so later instances using the
+ * same kernel build map it instead of parsing the file again.
+ *
+ * @param[in] vmi LibVMI instance
+ * @param[in] vaddr Kernel virtual address to look up
+ * @param[out] offset Set to \a vaddr minus the symbol's address, may be NULL
+ * @return Symbol name, valid until vmi_destroy, or NULL if none is found
+ */
+const char *vmi_translate_v2ksym (vmi_instance_t vmi, addr_t vaddr, addr_t *offset);
+
 /**
  * Given a \a pid, this function returns the virtual address of the
  * directory table base for this process' address space.  This value
@@ -303,6 +797,29 @@ addr_t vmi_translate_ksym2v (vmi_instance_t vmi, char *symbol);
  */
 addr_t vmi_pid_to_dtb (vmi_instance_t vmi, int pid);
 
+/**
+ * Walks the guest's process list once and records the pid, name, task
+ * structure, memory descriptor and directory table base of every process.
+ * The PID cache is replaced with the pid to dtb mappings found, so later
+ * calls to vmi_pid_to_dtb for these processes don't walk the list again.
+ * Use this instead of calling vmi_pid_to_dtb for each pid, which walks the
+ * list once per call.  Pause the VM first for a consistent snapshot.  Each
+ * snapshot of an instance carries a higher generation number than the one
+ * before.  Free the table with vmi_process_table_free.
+ *
+ * @param[in] vmi LibVMI instance
+ * @param[out] table Filled in with the processes found
+ * @return VMI_SUCCESS or VMI_FAILURE
+ */
+status_t vmi_snapshot_processes (vmi_instance_t vmi, vmi_process_table_t *table);
+
+/**
+ * Frees the processes held by a table from vmi_snapshot_processes.
+ *
+ * @param[in] table Table to free
+ */
+void vmi_process_table_free (vmi_process_table_t *table);
+
 /*---------------------------------------------------------
  * Memory access functions from util.c
  */
@@ -332,6 +849,41 @@ size_t vmi_read_ksym (vmi_instance_t vmi, char *sym, void *buf, size_t count);
  */
 size_t vmi_read_va (vmi_instance_t vmi, addr_t vaddr, int pid, void *buf, size_t count);
 
+/**
+ * Like vmi_read_va, with \a flags controlling the read.  With
+ * VMI_READ_FRESH, pages that LibVMI holds as copies of guest memory are
+ * fetched again the first time this read touches them, including the
+ * page tables used for the translation.  Without it, a cached copy is
+ * reused while the VM is paused and until it ages out while the VM runs.
+ *
+ * @param[in] vmi LibVMI instance
+ * @param[in] vaddr Virtual address to read from
+ * @param[in] pid Pid of the virtual address space (0 for kernel)
+ * @param[out] buf The data read from memory
+ * @param[in] count The number of bytes to read
+ * @param[in] flags Bitwise OR of VMI_READ_* flags
+ * @return The number of bytes read.
+ */
+size_t vmi_read_va_flags (vmi_instance_t vmi, addr_t vaddr, int pid, void *buf, size_t count, uint32_t flags);
+
+/**
+ * Reads many ranges of one address space at once.  The pages of all \a n
+ * requests are translated together as in vmi_translate_batch, so page
+ * table entries shared between them are read once, and each guest frame
+ * is fetched once however many requests touch it.  Unlike vmi_read_va, an
+ * unmapped page only cuts short the requests that touch it.
+ *
+ * @param[in] vmi LibVMI instance
+ * @param[in] dtb Directory table base of the address space, see
+ *  vmi_pid_to_dtb, or 0 for the kernel
+ * @param[in] req Array of \a n requests
+ * @param[in] n Number of requests in \a req
+ * @param[out] done Array of \a n byte counts; each is the length of the
+ *  prefix of its request that was read, as vmi_read_va would return
+ * @return VMI_SUCCESS if every request was read in full, else VMI_FAILURE
+ */
+status_t vmi_read_va_iov (vmi_instance_t vmi, addr_t dtb, const vmi_iov_t *req, size_t n, size_t *done);
+
 /**
  * Reads \a count bytes from memory located at the physical address \a paddr
  * and stores the output in \a buf.
@@ -344,6 +896,62 @@ size_t vmi_read_va (vmi_instance_t vmi, addr_t vaddr, int pid, void *buf, size_t
  */
 size_t vmi_read_pa (vmi_instance_t vmi, addr_t paddr, void *buf, size_t count);
 
+/**
+ * Like vmi_read_pa, with \a flags controlling the read (see
+ * vmi_read_va_flags).
+ *
+ * @param[in] vmi LibVMI instance
+ * @param[in] paddr Physical address to read from
+ * @param[out] buf The data read from memory
+ * @param[in] count The number of bytes to read
+ * @param[in] flags Bitwise OR of VMI_READ_* flags
+ * @return The number of bytes read.
+ */
+size_t vmi_read_pa_flags (vmi_instance_t vmi, addr_t paddr, void *buf, size_t count, uint32_t flags);
+
+/**
+ * Pins the guest page \a pfn in LibVMI's page cache and returns a pointer
+ * to its data, so it can be read in place without copying it out.  The
+ * pointer stays valid until the matching vmi_page_unpin, however many
+ * other pages are read in between.  A pinned page is never evicted, and
+ * its data is not refreshed while it is pinned, so keep pins short while
+ * the VM runs.  Pins nest, and pinned pages count against the page cache
+ * budget.  Do not write through the pointer.
+ *
+ * A page written with vmi_write_* while it is pinned keeps serving its
+ * pinned data, to the pointer and to reads, until the last pin is dropped;
+ * then it is fetched again.  With drivers that map guest memory directly
+ * (Xen), the pointer shows the write right away.
+ *
+ * @param[in] vmi LibVMI instance
+ * @param[in] pfn Guest page frame number to pin
+ * @param[out] ptr Start of the page's data
+ * @return VMI_SUCCESS or VMI_FAILURE
+ */
+status_t vmi_page_pin (vmi_instance_t vmi, addr_t pfn, void **ptr);
+
+/**
+ * Like vmi_page_pin, for the page holding the virtual address \a vaddr.
+ *
+ * @param[in] vmi LibVMI instance
+ * @param[in] vaddr Virtual address to pin
+ * @param[in] pid Pid of the virtual address space (0 for kernel)
+ * @param[out] ptr Data at \a vaddr, valid up to the end of its page
+ * @param[out] pfn Frame that was pinned, to pass to vmi_page_unpin
+ * @return VMI_SUCCESS or VMI_FAILURE
+ */
+status_t vmi_page_pin_va (vmi_instance_t vmi, addr_t vaddr, int pid, void **ptr, addr_t *pfn);
+
+/**
+ * Drops a pin taken with vmi_page_pin or vmi_page_pin_va.  Once the last
+ * pin on the page is gone, its pointer may be invalidated by the next read.
+ *
+ * @param[in] vmi LibVMI instance
+ * @param[in] pfn Frame that was pinned
+ * @return VMI_SUCCESS or VMI_FAILURE if \a pfn was not pinned
+ */
+status_t vmi_page_unpin (vmi_instance_t vmi, addr_t pfn);
+
 /**
  * Reads 8 bits from memory, given a kernel symbol.
  *
@@ -884,7 +1492,9 @@ status_t vmi_get_vcpureg (vmi_instance_t vmi, reg_t *value, registers_t reg, uns
 
 /**
  * Pauses the VM.  Use vmi_resume_vm to resume the VM after pausing
- * it.  If accessing a memory file, this has no effect.
+ * it.  If accessing a memory file, this has no effect.  Pausing starts
+ * a new cache epoch (see vmi_cache_epoch_bump).  Guest pages read while
+ * the VM is paused are served from the page cache without aging out.
  *
  * @param[in] vmi LibVMI instance
  * @return VMI_SUCCESS or VMI_FAILURE
@@ -894,24 +1504,125 @@ status_t vmi_pause_vm (vmi_instance_t vmi);
 /**
  * Resumes the VM.  Use vmi_pause_vm to pause the VM before calling
  * this function.  If accessing a memory file, this has no effect.
+ * Resuming starts a new cache epoch (see vmi_cache_epoch_bump).
  *
  * @param[in] vmi LibVMI instance
  * @return VMI_SUCCESS or VMI_FAILURE
  */
 status_t vmi_resume_vm (vmi_instance_t vmi);
 
+/**
+ * Starts a new epoch for LibVMI's address caches.  Cached translations
+ * are trusted without touching guest memory while their epoch is current.
+ * A translation from an earlier epoch is revalidated on its next use by
+ * re-reading the page table entry that produced it, and is dropped if
+ * that entry has changed.  The paging structure cache is flushed.  Call
+ * this when you know the guest may have changed its page tables, e.g.
+ * after letting it run for a while.
+ *
+ * @param[in] vmi LibVMI instance
+ */
+void vmi_cache_epoch_bump (vmi_instance_t vmi);
+
+/**
+ * Sets a wall-clock limit on the length of a cache epoch, after which
+ * a new epoch is started automatically (see vmi_cache_epoch_bump).  This
+ * bounds how stale a cached translation can be while the guest is running.
+ * The default of 0 means epochs only change on pause, resume, or an
+ * explicit bump.
+ *
+ * @param[in] vmi LibVMI instance
+ * @param[in] msec Maximum epoch length in milliseconds, or 0 for no limit
+ */
+void vmi_set_cache_epoch_interval (vmi_instance_t vmi, uint32_t msec);
+
+/**
+ * Sets the number of bytes of guest memory LibVMI's page cache may hold.
+ * If the cache is over the new budget, least recently used pages are
+ * dropped right away.  The budget is MAX_PAGE_CACHE_SIZE unless the
+ * LIBVMI_PAGE_CACHE_SIZE environment variable was set at vmi_init time.
+ * A budget smaller than a page keeps only the most recently used page.
+ *
+ * @param[in] vmi LibVMI instance
+ * @param[in] bytes Page cache budget in bytes
+ */
+void vmi_set_page_cache_size (vmi_instance_t vmi, uint64_t bytes);
+
+/**
+ * Gets the current byte budget of LibVMI's page cache.
+ *
+ * @param[in] vmi LibVMI instance
+ * @return Page cache budget in bytes
+ */
+uint64_t vmi_get_page_cache_size (vmi_instance_t vmi);
+
 /**
  * Removes all entries from LibVMI's internal virtual to physical address
  * cache.  This is generally only useful if you believe that an entry in 
- * the cache is incorrect, or out of date.
+ * the cache is incorrect, or out of date.  This also flushes the paging
+ * structure cache, since both hold state derived from the page tables.
  *
  * @param[in] vmi LibVMI instance
  */
 void vmi_v2pcache_flush (vmi_instance_t vmi);
 
+/**
+ * Removes the entries belonging to one address space from LibVMI's
+ * internal virtual to physical address cache, leaving every other address
+ * space's translations in place.  Its paging structure cache entries, any
+ * PID cache entries resolving to \a dtb and the record of which kernel
+ * entries it shares with the kernel page directory are dropped as well.
+ * Call this when a process exits or replaces its address space (e.g. on
+ * execve).  Kernel translations shared through the kernel page directory
+ * are cached under that directory and are not affected.  The cost is
+ * proportional to the number of entries cached for \a dtb.
+ *
+ * @param[in] vmi LibVMI instance
+ * @param[in] dtb Directory table base of the address space to flush
+ */
+void vmi_v2pcache_flush_dtb (vmi_instance_t vmi, addr_t dtb);
+
+/**
+ * Removes the translations for [\a va, \a va + \a len) in one address space
+ * from LibVMI's internal virtual to physical address cache.  A large page
+ * overlapping the range is dropped whole.  As with INVLPG, the paging
+ * structure cache entries of \a dtb are dropped too, since unmapping a
+ * range can free page tables.  The cost is proportional to the smaller of
+ * the number of pages in the range and the entries cached for \a dtb.
+ *
+ * @param[in] vmi LibVMI instance
+ * @param[in] dtb Directory table base of the address space
+ * @param[in] va First virtual address of the range
+ * @param[in] len Length of the range in bytes
+ */
+void vmi_v2pcache_flush_range (vmi_instance_t vmi, addr_t dtb, addr_t va, addr_t len);
+
+/**
+ * Removes all entries from LibVMI's internal paging structure cache.  This
+ * cache holds upper-level page table entries (PML4E, PDPTE, PDE) so that a
+ * translation miss only needs to read the levels below the deepest cached
+ * entry.  Flush it if the guest has changed its upper-level page tables.
+ *
+ * @param[in] vmi LibVMI instance
+ */
+void vmi_pscache_flush (vmi_instance_t vmi);
+
+/**
+ * Removes the entries belonging to one address space from LibVMI's
+ * internal paging structure cache.  This is useful when a process has
+ * exited or its page tables are known to have changed.
+ *
+ * @param[in] vmi LibVMI instance
+ * @param[in] dtb Directory table base of the address space to flush
+ */
+void vmi_pscache_flush_dtb (vmi_instance_t vmi, addr_t dtb);
+
 /**
  * Adds one entry to LibVMI's internal virtual to physical address
- * cache.
+ * cache.  Unlike the entries LibVMI adds from its own page table walks,
+ * this entry has no page table entry to check it against, so it is kept
+ * across cache epochs (see vmi_cache_epoch_bump) until it is flushed or
+ * evicted.  Flush it when the mapping may have changed.
  *
  * @param[in] vmi LibVMI instance
  * @param[in] va Virtual address
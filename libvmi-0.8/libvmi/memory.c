@@ -28,7 +28,9 @@
 #include "private.h"
 #include "driver/interface.h"
 #include <stdlib.h>
+#include <string.h>
 #include <sys/mman.h>
+#include "glib_compat.h"
 
 /* bit flag testing */
 int entry_present (uint64_t entry){
@@ -39,411 +41,544 @@ int page_size_flag (uint64_t entry){
     return vmi_get_bit(entry, 7);
 }
 
-/* utility bit grabbing functions */
-uint64_t get_bits_51to12 (uint64_t value)
-{
-    return value & 0x000FFFFFFFFFF000ULL;
-}
-
-/* PML4 Table  */
-addr_t get_pml4_index (addr_t vaddr)
-{
-    return (vaddr & 0x0000FF8000000000ULL) >> 36;
-}
-
-uint64_t get_pml4e (vmi_instance_t vmi, addr_t vaddr, reg_t cr3)
-{
-    uint64_t value = 0;
-    addr_t pml4e_address = get_bits_51to12(cr3) | get_pml4_index(vaddr);
-    dbprint("--PTLookup pml4e_address = 0x%.16llx\n", pml4e_address);
-    vmi_read_64_pa(vmi, pml4e_address, &value);
-    return value;
-}
-
-/* page directory pointer table */
-uint32_t get_pdptb (uint32_t pdpr){
-    return pdpr & 0xFFFFFFE0;
-}
-
-uint32_t pdpi_index (uint32_t pdpi){
-    return (pdpi >> 30) * sizeof(uint64_t);
-}
-
-uint64_t get_pdpi (vmi_instance_t instance, uint32_t vaddr, uint32_t cr3)
+/* Page table geometry for each paging mode.  Everything here is a
+ * compile-time constant, so the walkers below reduce to shifts and masks
+ * with no checks of the paging mode or the pae flag at lookup time.
+ *
+ * PT_ENTRY gives the address of the entry selecting vaddr in the table
+ * whose frame is held in parent (an entry or the dtb). */
+#define PT_ENTRY(parent, frame_mask, vaddr, shift, index_mask, entry_size) \
+    (((parent) & (frame_mask)) + ((((vaddr) >> (shift)) & (index_mask)) * (entry_size)))
+#define PT_PRESENT(entry) ((entry) & 0x1ULL)
+#define PT_LARGE(entry)   ((entry) & 0x80ULL)
+
+/* 32-bit legacy paging: two levels of 1024 4-byte entries */
+#define NOPAE_FRAME         0xFFFFF000ULL
+#define NOPAE_4MB_FRAME     0xFFC00000ULL
+#define NOPAE_PDE(dtb, va)  PT_ENTRY(dtb, NOPAE_FRAME, va, 22, 0x3FF, 4)
+#define NOPAE_PTE(pde, va)  PT_ENTRY(pde, NOPAE_FRAME, va, 12, 0x3FF, 4)
+
+/* PAE paging: a 4-entry PDPT, then two levels of 512 8-byte entries */
+#define PAE_PDPT_FRAME      0xFFFFFFE0ULL
+#define PAE_FRAME           0xFFFFFF000ULL
+#define PAE_2MB_FRAME       0xFFFE00000ULL
+#define PAE_PDPTE(dtb, va)  PT_ENTRY(dtb, PAE_PDPT_FRAME, va, 30, 0x3, 8)
+#define PAE_PDE(pdpte, va)  PT_ENTRY(pdpte, PAE_FRAME, va, 21, 0x1FF, 8)
+#define PAE_PTE(pde, va)    PT_ENTRY(pde, PAE_FRAME, va, 12, 0x1FF, 8)
+
+/* IA-32e paging: four levels of 512 8-byte entries */
+#define IA32E_FRAME         0x000FFFFFFFFFF000ULL
+#define IA32E_2MB_FRAME     0x000FFFFFFFE00000ULL
+#define IA32E_1GB_FRAME     0x000FFFFFC0000000ULL
+#define IA32E_PML4E(dtb, va)    PT_ENTRY(dtb, IA32E_FRAME, va, 39, 0x1FF, 8)
+#define IA32E_PDPTE(pml4e, va)  PT_ENTRY(pml4e, IA32E_FRAME, va, 30, 0x1FF, 8)
+#define IA32E_PDE(pdpte, va)    PT_ENTRY(pdpte, IA32E_FRAME, va, 21, 0x1FF, 8)
+#define IA32E_PTE(pde, va)      PT_ENTRY(pde, IA32E_FRAME, va, 12, 0x1FF, 8)
+
+/* Non-present entry decoding.  For Windows, see "Using Every Part of the
+ * Buffalo in Windows Memory Analysis" by Jesse D. Kornblum.  The software
+ * PTE keeps the pagefile number in bits 1-4, the prototype and transition
+ * flags in bits 10 and 11, and the pagefile offset in the upper bits
+ * (bits 12-31 for 4-byte entries, bits 32-63 for 8-byte entries). */
+#define WIN_PTE_PROTOTYPE   (1ULL << 10)
+#define WIN_PTE_TRANSITION  (1ULL << 11)
+
+/* Linux (3.x) marks PROT_NONE and nonlinear file mappings with these */
+#define LINUX_PTE_FILE      (1ULL << 6)
+#define LINUX_PTE_PROTNONE  (1ULL << 8)
+
+static pte_class_t pte_classify_windows (vmi_instance_t vmi, uint64_t entry, vmi_swap_entry_t *swp)
 {
-    uint64_t value;
-    uint32_t pdpi_entry = get_pdptb(cr3) + pdpi_index(vaddr);
-    dbprint("--PTLookup: pdpi_entry = 0x%.8x\n", pdpi_entry);
-    vmi_read_64_pa(instance, pdpi_entry, &value);
-    return value;
-}
+    addr_t offset = (VMI_PM_LEGACY == vmi->page_mode) ? (entry >> 12) : (entry >> 32);
 
-addr_t get_pdpt_index_ia32e (addr_t vaddr)
-{
-    return (vaddr & 0x0000007FC0000000ULL) >> 27;
+    if (entry & WIN_PTE_PROTOTYPE){
+        return VMI_PTE_PROTOTYPE;
+    }
+    if (entry & WIN_PTE_TRANSITION){
+        return VMI_PTE_TRANSITION;
+    }
+    if (!offset){
+        return VMI_PTE_DEMAND_ZERO;
+    }
+    if (swp){
+        swp->type = (entry >> 1) & 0xF;
+        swp->offset = offset;
+    }
+    return VMI_PTE_SWAP;
 }
 
-uint64_t get_pdpte_ia32e (vmi_instance_t vmi, addr_t vaddr, uint64_t pml4e)
+static pte_class_t pte_classify_linux (vmi_instance_t vmi, uint64_t entry, vmi_swap_entry_t *swp)
 {
-    uint64_t value = 0;
-    addr_t pdpte_address = get_bits_51to12(pml4e) | get_pdpt_index_ia32e(vaddr);
-    dbprint("--PTLookup: pdpte_address = 0x%.16llx\n", pdpte_address);
-    vmi_read_64_pa(vmi, pdpte_address, &value);
-    return value;
-}
+    uint32_t type = 0;
+    addr_t offset = 0;
 
-/* page directory */
-uint32_t pgd_index (vmi_instance_t instance, uint32_t address){
-    if (!instance->pae){
-        return (((address) >> 22) & 0x3FF) * sizeof(uint32_t);
+    if (VMI_PM_PAE == vmi->page_mode){
+        /* the whole swap entry lives in the high word */
+        if (entry & 0xFFFFFFFFULL){
+            return VMI_PTE_OTHER;
+        }
+        type = (entry >> 32) & 0x1F;
+        offset = entry >> 37;
     }
     else{
-        return (((address) >> 21) & 0x1FF) * sizeof(uint64_t);
+        if (entry & (LINUX_PTE_FILE | LINUX_PTE_PROTNONE)){
+            return VMI_PTE_OTHER;
+        }
+        type = (entry >> 1) & 0x1F;
+        offset = entry >> 9;
     }
-}
-
-uint32_t pdba_base_nopae (uint32_t pdpe){
-    return pdpe & 0xFFFFF000;
-}
 
-uint64_t pdba_base_pae (uint64_t pdpe){
-    return pdpe & 0xFFFFFF000ULL;
+    if (swp){
+        swp->type = type;
+        swp->offset = offset;
+    }
+    return VMI_PTE_SWAP;
 }
 
-uint32_t get_pgd_nopae (vmi_instance_t instance, uint32_t vaddr, uint32_t pdpe)
+pte_class_t vmi_pte_classify (vmi_instance_t vmi, uint64_t entry, vmi_swap_entry_t *swp)
 {
-    uint32_t value;
-    uint32_t pgd_entry = pdba_base_nopae(pdpe) + pgd_index(instance, vaddr);
-    dbprint("--PTLookup: pgd_entry = 0x%.8x\n", pgd_entry);
-    vmi_read_32_pa(instance, pgd_entry, &value);
-    return value;
+    if (VMI_PM_LEGACY == vmi->page_mode){
+        entry &= 0xFFFFFFFFULL;
+    }
+    if (entry_present(entry)){
+        return VMI_PTE_PRESENT;
+    }
+    if (!entry){
+        return VMI_PTE_EMPTY;
+    }
+    if (VMI_OS_WINDOWS == vmi->os_type){
+        return pte_classify_windows(vmi, entry, swp);
+    }
+    if (VMI_OS_LINUX == vmi->os_type){
+        return pte_classify_linux(vmi, entry, swp);
+    }
+    return VMI_PTE_OTHER;
 }
 
-uint64_t get_pgd_pae (vmi_instance_t instance, uint32_t vaddr, uint64_t pdpe)
-{
-    uint64_t value;
-    uint32_t pgd_entry = pdba_base_pae(pdpe) + pgd_index(instance, vaddr);
-    dbprint("--PTLookup: pgd_entry = 0x%.8x\n", pgd_entry);
-    vmi_read_64_pa(instance, pgd_entry, &value);
-    return value;
-}
+/* upper-level entries remembered between walks of the same dtb, so that
+ * neighbouring addresses only re-read the levels where they differ.  The
+ * tag for each level is the part of the vaddr that selects that entry.
+ * The walkers also leave the entry that produced the translation in leaf. */
+typedef struct v2p_memo{
+    addr_t tag[3];
+    uint64_t entry[3];
+    addr_t location[3];
+    int valid[3];
+    v2p_leaf_t leaf;
+} v2p_memo_t;
 
-uint64_t get_pd_index_ia32e (addr_t vaddr)
+/* look for an upper-level entry in the memo, then the paging structure cache */
+static int upper_get (vmi_instance_t vmi, addr_t dtb, v2p_memo_t *memo, int level, addr_t tag, uint64_t *entry, addr_t *location)
 {
-    return (vaddr & 0x000000003FE00000ULL) >> 18;
+    if (memo && memo->valid[level] && memo->tag[level] == tag){
+        *entry = memo->entry[level];
+        *location = memo->location[level];
+        return 1;
+    }
+    if (VMI_SUCCESS == ps_cache_get(vmi, dtb, level, tag, entry, location)){
+        if (memo){
+            memo->tag[level] = tag;
+            memo->entry[level] = *entry;
+            memo->location[level] = *location;
+            memo->valid[level] = 1;
+        }
+        return 1;
+    }
+    return 0;
 }
 
-uint64_t get_pde_ia32e (vmi_instance_t vmi, addr_t vaddr, uint64_t pdpte)
+static void upper_set (vmi_instance_t vmi, addr_t dtb, v2p_memo_t *memo, int level, addr_t tag, uint64_t entry, addr_t location)
 {
-    uint64_t value = 0;
-    addr_t pde_address = get_bits_51to12(pdpte) | get_pd_index_ia32e(vaddr);
-    dbprint("--PTLookup: pde_address = 0x%.16llx\n", pde_address);
-    vmi_read_64_pa(vmi, pde_address, &value);
-    return value;
-}
-
-/* page table */
-uint32_t pte_index (vmi_instance_t instance, uint32_t address){
-    if (!instance->pae){
-        return (((address) >> 12) & 0x3FF) * sizeof(uint32_t);
+    if (memo){
+        memo->tag[level] = tag;
+        memo->entry[level] = entry;
+        memo->location[level] = location;
+        memo->valid[level] = 1;
     }
-    else{
-        return (((address) >> 12) & 0x1FF) * sizeof(uint64_t); 
+    if (entry_present(entry)){
+        ps_cache_set(vmi, dtb, level, tag, entry, location);
     }
 }
-        
-uint32_t ptba_base_nopae (uint32_t pde){
-    return pde & 0xFFFFF000;
-}
-
-uint64_t ptba_base_pae (uint64_t pde){
-    return pde & 0xFFFFFF000ULL;
-}
-
-uint32_t get_pte_nopae (vmi_instance_t instance, uint32_t vaddr, uint32_t pgd){
-    uint32_t value;
-    uint32_t pte_entry = ptba_base_nopae(pgd) + pte_index(instance, vaddr);
-    dbprint("--PTLookup: pte_entry = 0x%.8x\n", pte_entry);
-    vmi_read_32_pa(instance, pte_entry, &value);
-    return value;
-}
 
-uint64_t get_pte_pae (vmi_instance_t instance, uint32_t vaddr, uint64_t pgd){
-    uint64_t value;
-    uint32_t pte_entry = ptba_base_pae(pgd) + pte_index(instance, vaddr);
-    dbprint("--PTLookup: pte_entry = 0x%.8x\n", pte_entry);
-    vmi_read_64_pa(instance, pte_entry, &value);
-    return value;
-}
-
-uint64_t get_pt_index_ia32e (addr_t vaddr)
+static void leaf_set (v2p_memo_t *memo, addr_t location, uint64_t entry, int width, addr_t size)
 {
-    return (vaddr & 0x00000000001FF000ULL) >> 9;
+    if (memo){
+        memo->leaf.addr = location;
+        memo->leaf.value = entry;
+        memo->leaf.width = width;
+        memo->leaf.size = size;
+    }
 }
 
-uint64_t get_pte_ia32e (vmi_instance_t vmi, addr_t vaddr, uint64_t pde)
+/* translation
+ *
+ * One walker per paging mode, installed in the instance by v2p_walker_init
+ * once the paging mode is known.  Each walk starts from the deepest
+ * upper-level entry that is already known for this vaddr, and only falls
+ * back to the root of the page table when none of them are cached. */
+static addr_t v2p_nopae (vmi_instance_t vmi, addr_t dtb, addr_t vaddr, v2p_memo_t *memo)
 {
-    uint64_t value = 0;
-    addr_t pte_address = get_bits_51to12(pde) | get_pt_index_ia32e(vaddr);
-    dbprint("--PTLookup: pte_address = 0x%.16llx\n", pte_address);
-    vmi_read_64_pa(vmi, pte_address, &value);
-    return value;
-}
+    uint32_t value = 0;
+    uint64_t pde = 0;
+    addr_t pde_addr = 0, pte_addr = 0;
 
-/* page */
-uint32_t pte_pfn_nopae (uint32_t pte){
-    return pte & 0xFFFFF000;
-}
+    if (!upper_get(vmi, dtb, memo, PS_PDE, vaddr >> 22, &pde, &pde_addr)){
+        pde_addr = NOPAE_PDE(dtb, vaddr);
+        vmi_read_32_pa(vmi, pde_addr, &value);
+        pde = value;
+        upper_set(vmi, dtb, memo, PS_PDE, vaddr >> 22, pde, pde_addr);
+    }
+    if (!PT_PRESENT(pde)){
+        return 0;
+    }
+    if (PT_LARGE(pde)){
+        leaf_set(memo, pde_addr, pde, 4, 0x400000);
+        return (pde & NOPAE_4MB_FRAME) | (vaddr & 0x3FFFFF);
+    }
 
-uint64_t pte_pfn_pae (uint64_t pte){
-    return pte & 0xFFFFFF000ULL;
+    value = 0;
+    pte_addr = NOPAE_PTE(pde, vaddr);
+    vmi_read_32_pa(vmi, pte_addr, &value);
+    if (!PT_PRESENT(value)){
+        return 0;
+    }
+    leaf_set(memo, pte_addr, value, 4, 0x1000);
+    return (value & NOPAE_FRAME) | (vaddr & 0xFFF);
 }
 
-uint32_t get_paddr_nopae (uint32_t vaddr, uint32_t pte){
-    return pte_pfn_nopae(pte) | (vaddr & 0xFFF);
-}
+static addr_t v2p_pae (vmi_instance_t vmi, addr_t dtb, addr_t vaddr, v2p_memo_t *memo)
+{
+    uint64_t pdpte = 0, pde = 0, pte = 0;
+    addr_t pdpte_addr = 0, pde_addr = 0, pte_addr = 0;
+
+    if (!upper_get(vmi, dtb, memo, PS_PDE, vaddr >> 21, &pde, &pde_addr)){
+        if (!upper_get(vmi, dtb, memo, PS_PDPTE, vaddr >> 30, &pdpte, &pdpte_addr)){
+            pdpte_addr = PAE_PDPTE(dtb, vaddr);
+            vmi_read_64_pa(vmi, pdpte_addr, &pdpte);
+            upper_set(vmi, dtb, memo, PS_PDPTE, vaddr >> 30, pdpte, pdpte_addr);
+        }
+        if (!PT_PRESENT(pdpte)){
+            return 0;
+        }
+        pde_addr = PAE_PDE(pdpte, vaddr);
+        vmi_read_64_pa(vmi, pde_addr, &pde);
+        upper_set(vmi, dtb, memo, PS_PDE, vaddr >> 21, pde, pde_addr);
+    }
+    if (!PT_PRESENT(pde)){
+        return 0;
+    }
+    if (PT_LARGE(pde)){
+        leaf_set(memo, pde_addr, pde, 8, 0x200000);
+        return (pde & PAE_2MB_FRAME) | (vaddr & 0x1FFFFF);
+    }
 
-uint64_t get_paddr_pae (uint32_t vaddr, uint64_t pte){
-    return pte_pfn_pae(pte) | (vaddr & 0xFFF);
+    pte_addr = PAE_PTE(pde, vaddr);
+    vmi_read_64_pa(vmi, pte_addr, &pte);
+    if (!PT_PRESENT(pte)){
+        return 0;
+    }
+    leaf_set(memo, pte_addr, pte, 8, 0x1000);
+    return (pte & PAE_FRAME) | (vaddr & 0xFFF);
 }
 
-uint64_t get_paddr_ia32e (addr_t vaddr, uint64_t pte)
+static addr_t v2p_ia32e (vmi_instance_t vmi, addr_t dtb, addr_t vaddr, v2p_memo_t *memo)
 {
-    return get_bits_51to12(pte) | (vaddr & 0x0000000000000FFFULL);
+    uint64_t pml4e = 0, pdpte = 0, pde = 0, pte = 0;
+    addr_t pml4e_addr = 0, pdpte_addr = 0, pde_addr = 0, pte_addr = 0;
+
+    if (!upper_get(vmi, dtb, memo, PS_PDE, vaddr >> 21, &pde, &pde_addr)){
+        if (!upper_get(vmi, dtb, memo, PS_PDPTE, vaddr >> 30, &pdpte, &pdpte_addr)){
+            if (!upper_get(vmi, dtb, memo, PS_PML4E, vaddr >> 39, &pml4e, &pml4e_addr)){
+                pml4e_addr = IA32E_PML4E(dtb, vaddr);
+                vmi_read_64_pa(vmi, pml4e_addr, &pml4e);
+                upper_set(vmi, dtb, memo, PS_PML4E, vaddr >> 39, pml4e, pml4e_addr);
+            }
+            if (!PT_PRESENT(pml4e)){
+                return 0;
+            }
+            pdpte_addr = IA32E_PDPTE(pml4e, vaddr);
+            vmi_read_64_pa(vmi, pdpte_addr, &pdpte);
+            upper_set(vmi, dtb, memo, PS_PDPTE, vaddr >> 30, pdpte, pdpte_addr);
+        }
+        if (!PT_PRESENT(pdpte)){
+            return 0;
+        }
+        if (PT_LARGE(pdpte)){ // pdpte maps a 1GB page
+            leaf_set(memo, pdpte_addr, pdpte, 8, 0x40000000ULL);
+            return (pdpte & IA32E_1GB_FRAME) | (vaddr & 0x3FFFFFFFULL);
+        }
+        pde_addr = IA32E_PDE(pdpte, vaddr);
+        vmi_read_64_pa(vmi, pde_addr, &pde);
+        upper_set(vmi, dtb, memo, PS_PDE, vaddr >> 21, pde, pde_addr);
+    }
+    if (!PT_PRESENT(pde)){
+        return 0;
+    }
+    if (PT_LARGE(pde)){ // pde maps a 2MB page
+        leaf_set(memo, pde_addr, pde, 8, 0x200000);
+        return (pde & IA32E_2MB_FRAME) | (vaddr & 0x1FFFFFULL);
+    }
+
+    pte_addr = IA32E_PTE(pde, vaddr);
+    vmi_read_64_pa(vmi, pte_addr, &pte);
+    if (!PT_PRESENT(pte)){
+        return 0;
+    }
+    leaf_set(memo, pte_addr, pte, 8, 0x1000);
+    return (pte & IA32E_FRAME) | (vaddr & 0xFFFULL);
 }
 
-uint32_t get_large_paddr (
-        vmi_instance_t instance, uint32_t vaddr, uint32_t pgd_entry)
+void v2p_walker_init (vmi_instance_t vmi)
 {
-    if (!instance->pae){
-        return (pgd_entry & 0xFFC00000) | (vaddr & 0x3FFFFF);
+    if (vmi->page_mode == VMI_PM_LEGACY){
+        vmi->v2p_walker = v2p_nopae;
+    }
+    else if (vmi->page_mode == VMI_PM_PAE){
+        vmi->v2p_walker = v2p_pae;
+    }
+    else if (vmi->page_mode == VMI_PM_IA32E){
+        vmi->v2p_walker = v2p_ia32e;
     }
     else{
-        return (pgd_entry & 0xFFE00000) | (vaddr & 0x1FFFFF);
+        vmi->v2p_walker = NULL;
     }
+    vmi->v2p_walker_mode = vmi->page_mode;
 }
 
-uint64_t get_gigpage_ia32e (addr_t vaddr, uint64_t pdpte)
+static addr_t v2p_walk (vmi_instance_t vmi, addr_t dtb, addr_t vaddr, v2p_memo_t *memo)
 {
-    return (pdpte & 0x000FFFFFC0000000ULL) | (vaddr & 0x000000003FFFFFFFULL);
-}
+    addr_t paddr = 0;
 
-uint64_t get_2megpage_ia32e (addr_t vaddr, uint64_t pde)
-{
-    return (pde & 0x000FFFFFFFE00000ULL) | (vaddr & 0x00000000001FFFFFULL);
-}
+    /* partial init skips get_memory_layout, and callers that probe for
+     * the paging mode change it after init, so pick the walker again
+     * whenever it does not match */
+    if (!vmi->v2p_walker || vmi->v2p_walker_mode != vmi->page_mode){
+        v2p_walker_init(vmi);
+        if (!vmi->v2p_walker){
+            errprint("Invalid paging mode during vmi_pagetable_lookup\n");
+            return 0;
+        }
+    }
 
-/* "buffalo" routines
- * see "Using Every Part of the Buffalo in Windows Memory Analysis" by
- * Jesse D. Kornblum for details. 
- * for now, just test the bits and print out details */
-int get_transition_bit(uint32_t entry)
-{
-    return vmi_get_bit(entry, 11);
+    dbprint("--PTLookup: lookup vaddr = 0x%.16llx, dtb = 0x%.16llx\n", vaddr, dtb);
+    if (memo){
+        memo->leaf.width = 0;
+        memo->leaf.size = 0;
+    }
+    paddr = vmi->v2p_walker(vmi, dtb, vaddr, memo);
+    dbprint("--PTLookup: paddr = 0x%.16llx\n", paddr);
+    return paddr;
 }
 
-int get_prototype_bit(uint32_t entry)
+/* Kernel half sharing (IA-32e).  Linux and Windows copy the upper 256
+ * PML4 entries of the kernel page tables into every process, so kernel
+ * addresses translate the same way from any dtb.  For each dtb we keep
+ * which of those entries match kpgd, checked once per cache epoch, and
+ * kernel addresses under a matching entry are walked and cached as if
+ * they came from kpgd.  Entries that differ per process (the Windows
+ * self-map, session space) are left with their own dtb. */
+#define KSHARE_FIRST 256
+#define KSHARE_WORDS 4
+
+struct kshare_entry{
+    uint64_t epoch;
+    uint64_t mask[KSHARE_WORDS];  /**< upper PML4 entries that match kpgd */
+};
+
+static void kshare_key_free (gpointer data)
 {
-    return vmi_get_bit(entry, 10);
+    if (data) free(data);
 }
 
-void buffalo_nopae (vmi_instance_t instance, uint32_t entry, int pde)
+static void kshare_compare (vmi_instance_t vmi, addr_t dtb, struct kshare_entry *share)
 {
-    /* similar techniques are surely doable in linux, but for now
-     * this is only testing for windows domains */
-    if (!instance->os_type == VMI_OS_WINDOWS){
+    uint64_t mine[KSHARE_FIRST], kernel[KSHARE_FIRST];
+    size_t len = sizeof(mine);
+    int i = 0;
+
+    memset(share->mask, 0, sizeof(share->mask));
+    share->epoch = vmi->cache_epoch;
+    if (len != vmi_read_pa(vmi, IA32E_PML4E(dtb, 0xFFFF800000000000ULL), mine, len) ||
+        len != vmi_read_pa(vmi, IA32E_PML4E(vmi->kpgd, 0xFFFF800000000000ULL), kernel, len)){
         return;
     }
+    for (i = 0; i < KSHARE_FIRST; ++i){
+        if (PT_PRESENT(mine[i]) && PML4E_SAME_TABLE(mine[i], kernel[i])){
+            share->mask[i / 64] |= 1ULL << (i % 64);
+        }
+    }
+}
 
-    if (!get_transition_bit(entry) && !get_prototype_bit(entry)){
-        uint32_t pfnum = (entry >> 1) & 0xF;
-        uint32_t pfframe = entry & 0xFFFFF000;
+/* the kshare entry of dtb, compared again against kpgd if it is stale */
+static struct kshare_entry *kshare_get (vmi_instance_t vmi, addr_t dtb)
+{
+    struct kshare_entry *share = NULL;
 
-        /* pagefile */
-        if (pfnum != 0 && pfframe != 0){
-            dbprint("--Buffalo: page file = %d, frame = 0x%.8x\n",
-                pfnum, pfframe);
+    if (vmi->kshare_last && vmi->kshare_last_dtb == dtb){
+        share = vmi->kshare_last;
+    }
+    else{
+        if (!vmi->kshare){
+            vmi->kshare = g_hash_table_new_full(g_int64_hash, g_int64_equal, kshare_key_free, free);
         }
-        /* demand zero */
-        else if (pfnum == 0 && pfframe == 0){
-            dbprint("--Buffalo: demand zero page\n");
+        if ((share = g_hash_table_lookup(vmi->kshare, &dtb)) == NULL){
+            addr_t *key = (addr_t *) safe_malloc(sizeof(addr_t));
+            *key = dtb;
+            share = (struct kshare_entry *) safe_malloc(sizeof(struct kshare_entry));
+            share->epoch = 0;
+            g_hash_table_insert(vmi->kshare, key, share);
         }
+        vmi->kshare_last = share;
+        vmi->kshare_last_dtb = dtb;
     }
 
-    else if (get_transition_bit(entry) && !get_prototype_bit(entry)){
-        /* transition */
-        dbprint("--Buffalo: page in transition\n");
+    if (share->epoch != vmi->cache_epoch){
+        kshare_compare(vmi, dtb, share);
     }
+    return share;
+}
 
-    else if (!pde && get_prototype_bit(entry)){
-        /* prototype */
-        dbprint("--Buffalo: prototype entry\n");
+/* the dtb to walk and cache vaddr under: kpgd if vaddr is in a shared
+ * part of the kernel half, dtb otherwise */
+addr_t kernel_share_dtb (vmi_instance_t vmi, addr_t dtb, addr_t vaddr)
+{
+    struct kshare_entry *share = NULL;
+    int index = (vaddr >> 39) & 0x1FF;
+
+    if (VMI_PM_IA32E != vmi->page_mode || index < KSHARE_FIRST || !vmi->kpgd || dtb == vmi->kpgd){
+        return dtb;
     }
+    share = kshare_get(vmi, dtb);
+    index -= KSHARE_FIRST;
+    return (share->mask[index / 64] & (1ULL << (index % 64))) ? vmi->kpgd : dtb;
+}
 
-    else if (entry == 0){
-        /* zero */
-        dbprint("--Buffalo: entry is zero\n");
+/* one bit per kernel half PML4 entry (256 and up) that dtb shares with
+ * kpgd, all clear if nothing is shared */
+void kernel_share_mask (vmi_instance_t vmi, addr_t dtb, uint64_t mask[4])
+{
+    memset(mask, 0, KSHARE_WORDS * sizeof(uint64_t));
+    if (VMI_PM_IA32E != vmi->page_mode || !vmi->kpgd || dtb == vmi->kpgd){
+        return;
     }
+    memcpy(mask, kshare_get(vmi, dtb)->mask, KSHARE_WORDS * sizeof(uint64_t));
+}
 
-    else{
-        /* zero */
-        dbprint("--Buffalo: unknown\n");
+/* entries are dropped with the v2p cache, so dtbs that are gone do not
+ * pile up in a long running monitor */
+void kernel_share_flush (vmi_instance_t vmi)
+{
+    if (vmi->kshare){
+        g_hash_table_remove_all(vmi->kshare);
     }
+    vmi->kshare_last = NULL;
 }
 
-/* translation */
-addr_t v2p_nopae(vmi_instance_t vmi, addr_t dtb, addr_t vaddr)
+void kernel_share_flush_dtb (vmi_instance_t vmi, addr_t dtb)
 {
-    addr_t paddr = 0;
-    uint32_t pgd, pte;
-        
-    dbprint("--PTLookup: lookup vaddr = 0x%.16llx\n", vaddr);
-    dbprint("--PTLookup: dtb = 0x%.16llx\n", dtb);
-    pgd = get_pgd_nopae(vmi, vaddr, dtb);
-    dbprint("--PTLookup: pgd = 0x%.8x\n", pgd);
-        
-    if (entry_present(pgd)){
-        if (page_size_flag(pgd)){
-            paddr = get_large_paddr(vmi, vaddr, pgd);
-            dbprint("--PTLookup: 4MB page\n", pgd);
-        }
-        else{
-            pte = get_pte_nopae(vmi, vaddr, pgd);
-            dbprint("--PTLookup: pte = 0x%.8x\n", pte);
-            if (entry_present(pte)){
-                paddr = get_paddr_nopae(vaddr, pte);
-            }
-            else{
-                buffalo_nopae(vmi, pte, 1);
-            }
-        }
+    if (vmi->kshare){
+        g_hash_table_remove(vmi->kshare, &dtb);
     }
-    else{
-        buffalo_nopae(vmi, pgd, 0);
+    if (vmi->kshare_last_dtb == dtb){
+        vmi->kshare_last = NULL;
     }
-    dbprint("--PTLookup: paddr = 0x%.16llx\n", paddr);
-    return paddr;
 }
 
-addr_t v2p_pae (vmi_instance_t vmi, addr_t dtb, addr_t vaddr)
+void kernel_share_destroy (vmi_instance_t vmi)
 {
-    addr_t paddr = 0;
-    uint64_t pdpe, pgd, pte;
-        
-    dbprint("--PTLookup: lookup vaddr = 0x%.16llx\n", vaddr);
-    dbprint("--PTLookup: dtb = 0x%.16llx\n", dtb);
-    pdpe = get_pdpi(vmi, vaddr, dtb);
-    dbprint("--PTLookup: pdpe = 0x%.16llx\n", pdpe);
-    if (!entry_present(pdpe)){
-        return paddr;
+    if (vmi->kshare){
+        g_hash_table_destroy(vmi->kshare);
+        vmi->kshare = NULL;
     }
-    pgd = get_pgd_pae(vmi, vaddr, pdpe);
-    dbprint("--PTLookup: pgd = 0x%.16llx\n", pgd);
+    vmi->kshare_last = NULL;
+}
 
-    if (entry_present(pgd)){
-        if (page_size_flag(pgd)){
-            paddr = get_large_paddr(vmi, vaddr, pgd);
-            dbprint("--PTLookup: 2MB page\n");
-        }
-        else{
-            pte = get_pte_pae(vmi, vaddr, pgd);
-            dbprint("--PTLookup: pte = 0x%.16llx\n", pte);
-            if (entry_present(pte)){
-                paddr = get_paddr_pae(vaddr, pte);
-            }
-        }
-    }
-    dbprint("--PTLookup: paddr = 0x%.16llx\n", paddr);
-    return paddr;
+/* Cache lookup shared by single and batch translations, so both apply
+ * the same checks: entries from an earlier epoch are revalidated by the
+ * cache against their leaf entry.  *walk_dtb is the dtb that vaddr is
+ * cached under, and the one to walk on a miss. */
+static status_t v2p_lookup_cached (vmi_instance_t vmi, addr_t dtb, addr_t vaddr, addr_t *walk_dtb, addr_t *paddr)
+{
+    *walk_dtb = kernel_share_dtb(vmi, dtb, vaddr);
+    return v2p_cache_get(vmi, vaddr, *walk_dtb, paddr);
 }
 
-addr_t v2p_ia32e (vmi_instance_t vmi, addr_t dtb, addr_t vaddr)
+addr_t vmi_pagetable_lookup (vmi_instance_t vmi, addr_t dtb, addr_t vaddr)
 {
     addr_t paddr = 0;
-    uint64_t pml4e = 0, pdpte = 0, pde = 0, pte = 0;
-
-    // are we in compatibility mode OR 64-bit mode ???
-
-    // validate address based on above (e.g., is it canonical?)
+    v2p_memo_t memo;
 
-    // determine what MAXPHYADDR is
-
-    dbprint("--PTLookup: lookup vaddr = 0x%.16llx\n", vaddr);
-    dbprint("--PTLookup: dtb = 0x%.16llx\n", dtb);
-    pml4e = get_pml4e(vmi, vaddr, dtb);
-    dbprint("--PTLookup: pml4e = 0x%.16llx\n", pml4e);
-
-    if (entry_present(pml4e)){
-        pdpte = get_pdpte_ia32e(vmi, vaddr, pml4e);
-        dbprint("--PTLookup: pdpte = 0x%.16llx\n", pdpte);
+    if (VMI_SUCCESS == v2p_lookup_cached(vmi, dtb, vaddr, &dtb, &paddr)){
+        return paddr;
+    }
 
-        if (entry_present(pdpte)){
-            if (page_size_flag(pdpte)){ // pdpte maps a 1GB page
-                paddr = get_gigpage_ia32e(vaddr, pdpte);
-                dbprint("--PTLookup: 1GB page\n");
-            }
-            else{
-                pde = get_pde_ia32e(vmi, vaddr, pdpte);
-                dbprint("--PTLookup: pde = 0x%.16llx\n", pde);
-            }
+    /* do the actual page walk in guest memory */
+    memset(&memo, 0, sizeof(memo));
+    paddr = v2p_walk(vmi, dtb, vaddr, &memo);
 
-            if (entry_present(pde)){
-                if (page_size_flag(pde)){ // pde maps a 2MB page
-                    paddr = get_2megpage_ia32e(vaddr, pde);
-                    dbprint("--PTLookup: 2MB page\n");
-                }
-                else{
-                    pte = get_pte_ia32e(vmi, vaddr, pde);
-                    dbprint("--PTLookup: pte = 0x%.16llx\n", pte);
-                }
-
-                if (entry_present(pte)){
-                    paddr = get_paddr_ia32e(vaddr, pte);
-                }
-            }
-        }
+    /* add this to the cache */
+    if (paddr){
+        v2p_cache_set(vmi, vaddr, dtb, paddr, &memo.leaf);
     }
-
-    dbprint("--PTLookup: paddr = 0x%.16llx\n", paddr);
     return paddr;
 }
 
-addr_t vmi_pagetable_lookup (vmi_instance_t vmi, addr_t dtb, addr_t vaddr)
+struct batch_item{
+    addr_t va;
+    addr_t dtb;     /**< dtb to walk, from v2p_lookup_cached */
+    size_t idx;
+};
+
+static int batch_item_compare (const void *a, const void *b)
 {
-    addr_t paddr = 0;
+    addr_t va_a = ((const struct batch_item *) a)->va;
+    addr_t va_b = ((const struct batch_item *) b)->va;
+    return (va_a > va_b) - (va_a < va_b);
+}
 
-    /* check if entry exists in the cachec */
-    if (VMI_SUCCESS == v2p_cache_get(vmi, vaddr, dtb, &paddr)){
+/* translate many addresses in one address space, walking them in sorted
+ * order so that each shared upper-level entry is only read once */
+size_t vmi_translate_batch (vmi_instance_t vmi, addr_t dtb, const addr_t *va, size_t n, addr_t *pa_out)
+{
+    struct batch_item *items = NULL;
+    v2p_memo_t memo;
+    size_t i = 0, misses = 0, found = 0;
 
-        /* verify that address is still valid */
-        uint8_t value = 0;
-        if (VMI_SUCCESS == vmi_read_8_pa(vmi, paddr, &value)){
-            return paddr;
-        }
-        else{
-            v2p_cache_del(vmi, vaddr, dtb);
-        }
+    if (!dtb || !va || !pa_out || !n){
+        dbprint("--early bail on batch v2p lookup because of bad arguments\n");
+        return 0;
     }
 
-    /* do the actual page walk in guest memory */
-    if (vmi->page_mode == VMI_PM_LEGACY){
-        paddr = v2p_nopae(vmi, dtb, vaddr);
-    }
-    else if (vmi->page_mode == VMI_PM_PAE){
-        paddr = v2p_pae(vmi, dtb, vaddr);
-    }
-    else if (vmi->page_mode == VMI_PM_IA32E){
-        paddr = v2p_ia32e(vmi, dtb, vaddr);
-    }
-    else{
-        errprint("Invalid paging mode during vmi_pagetable_lookup\n");
+    /* anything already in the v2p cache doesn't need a walk */
+    items = (struct batch_item *) safe_malloc(n * sizeof(struct batch_item));
+    for (i = 0; i < n; ++i){
+        pa_out[i] = 0;
+        if (VMI_SUCCESS == v2p_lookup_cached(vmi, dtb, va[i], &items[misses].dtb, &pa_out[i])){
+            found++;
+            continue;
+        }
+        items[misses].va = va[i];
+        items[misses].idx = i;
+        misses++;
+    }
+
+    qsort(items, misses, sizeof(struct batch_item), batch_item_compare);
+    memset(&memo, 0, sizeof(memo));
+    for (i = 0; i < misses; ++i){
+        /* a shared kernel entry has the same subtree under either dtb,
+         * so the memo stays valid when the dtb switches */
+        addr_t paddr = v2p_walk(vmi, items[i].dtb, items[i].va, &memo);
+        pa_out[items[i].idx] = paddr;
+        if (paddr){
+            v2p_cache_set(vmi, items[i].va, items[i].dtb, paddr, &memo.leaf);
+            found++;
+        }
     }
+    dbprint("--Batch v2p: %lu addresses, %lu walked, %lu translated\n",
+        (unsigned long) n, (unsigned long) misses, (unsigned long) found);
 
-    /* add this to the cache */
-    if (paddr){
-        v2p_cache_set(vmi, vaddr, dtb, paddr);
-    }
-    return paddr;
+    free(items);
+    return found;
 }
 
 /* expose virtual to physical mapping for kernel space via api call */
@@ -525,6 +660,16 @@ addr_t vmi_translate_ksym2v (vmi_instance_t vmi, char *symbol)
     return ret;
 }
 
+/* convert an address into the kernel symbol containing it */
+const char *vmi_translate_v2ksym (vmi_instance_t vmi, addr_t vaddr, addr_t *offset)
+{
+    if (VMI_OS_LINUX == vmi->os_type){
+        return linux_system_map_address_to_symbol(vmi, vaddr, offset);
+    }
+    dbprint("--reverse symbol lookup is only supported for Linux\n");
+    return NULL;
+}
+
 /* finds the address of the page global directory for a given pid */
 addr_t vmi_pid_to_dtb (vmi_instance_t vmi, int pid)
 {
@@ -546,6 +691,75 @@ addr_t vmi_pid_to_dtb (vmi_instance_t vmi, int pid)
     return dtb;
 }
 
+/* appends an empty process to a table being built, or NULL when full */
+vmi_process_t *process_table_add (vmi_process_table_t *table)
+{
+    vmi_process_t *proc = NULL;
+    uint32_t n = table->count;
+
+    if (n >= MAX_PROCESS_LIST){
+        errprint("Process list is longer than %d entries.\n", MAX_PROCESS_LIST);
+        return NULL;
+    }
+
+    /* capacity is the next power of two, starting at 64 */
+    if (!n || (n >= 64 && !(n & (n - 1)))){
+        uint32_t capacity = n ? n * 2 : 64;
+        vmi_process_t *processes = realloc(table->processes, capacity * sizeof(vmi_process_t));
+        if (!processes){
+            errprint("Failed to grow the process list to %u entries.\n", capacity);
+            return NULL;
+        }
+        table->processes = processes;
+    }
+    proc = &table->processes[table->count++];
+    memset(proc, 0, sizeof(vmi_process_t));
+    return proc;
+}
+
+status_t vmi_snapshot_processes (vmi_instance_t vmi, vmi_process_table_t *table)
+{
+    status_t ret = VMI_FAILURE;
+    uint32_t i = 0;
+
+    table->count = 0;
+    table->processes = NULL;
+    table->generation = 0;
+
+    if (VMI_OS_LINUX == vmi->os_type){
+        ret = linux_snapshot_processes(vmi, table);
+    }
+    else if (VMI_OS_WINDOWS == vmi->os_type){
+        ret = windows_snapshot_processes(vmi, table);
+    }
+
+    if (VMI_FAILURE == ret){
+        vmi_process_table_free(table);
+        return VMI_FAILURE;
+    }
+
+    /* the snapshot is authoritative, so pids that are gone drop out */
+    pid_cache_flush(vmi);
+    for (i = 0; i < table->count; ++i){
+        if (table->processes[i].dtb){
+            pid_cache_set(vmi, table->processes[i].pid, table->processes[i].dtb);
+        }
+    }
+    table->generation = ++vmi->process_generation;
+    dbprint("--process snapshot %llu has %u processes\n",
+            (unsigned long long) table->generation, table->count);
+    return VMI_SUCCESS;
+}
+
+void vmi_process_table_free (vmi_process_table_t *table)
+{
+    if (table->processes){
+        free(table->processes);
+    }
+    table->processes = NULL;
+    table->count = 0;
+}
+
 void *vmi_read_page (vmi_instance_t vmi, addr_t frame_num)
 {
     if (!frame_num) {
@@ -88,3 +88,47 @@ addr_t linux_pid_to_pgd (vmi_instance_t vmi, int pid)
 error_exit:
     return pgd;
 }
+
+/* walks the task list once, recording every task_struct on it */
+status_t linux_snapshot_processes (vmi_instance_t vmi, vmi_process_table_t *table)
+{
+    addr_t list_head = vmi->init_task, next_process = vmi->init_task;
+    int pid_offset = vmi->os.linux_instance.pid_offset;
+    int tasks_offset = vmi->os.linux_instance.tasks_offset;
+    int mm_offset = vmi->os.linux_instance.mm_offset;
+    int pgd_offset = vmi->os.linux_instance.pgd_offset;
+    int name_offset = vmi->os.linux_instance.name_offset;
+
+    if (!list_head){
+        errprint("Task list head is not set.\n");
+        return VMI_FAILURE;
+    }
+
+    /* init_task is the last entry on the ring, so it is recorded too */
+    do{
+        addr_t task = next_process - tasks_offset, pgd = 0;
+        vmi_process_t *proc = process_table_add(table);
+
+        if (!proc){
+            return VMI_FAILURE;
+        }
+        proc->task = task;
+        vmi_read_32_va(vmi, task + pid_offset, 0, (uint32_t *) &proc->pid);
+        if (name_offset){
+            vmi_read_va(vmi, task + name_offset, 0, proc->name, sizeof(proc->name) - 1);
+        }
+
+        /* kernel threads have no mm, and so no dtb of their own */
+        vmi_read_addr_va(vmi, task + mm_offset, 0, &proc->mm);
+        if (proc->mm && VMI_SUCCESS == vmi_read_addr_va(vmi, proc->mm + pgd_offset, 0, &pgd)){
+            proc->dtb = vmi_translate_kv2p(vmi, pgd);
+        }
+
+        if (VMI_FAILURE == vmi_read_addr_va(vmi, next_process, 0, &next_process) || !next_process){
+            errprint("Task list is broken after pid %d.\n", proc->pid);
+            return VMI_FAILURE;
+        }
+    } while (next_process != list_head);
+
+    return VMI_SUCCESS;
+}
@@ -29,85 +29,443 @@
 #include <stdio.h>
 #include <ctype.h>
 #include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
 
 #define MAX_ROW_LENGTH 500
 
-static int get_symbol_row (FILE *f, char *row, char *symbol, int position)
+// System.map is parsed once into a table of symbols sorted by address, a
+// hash index over their names and a string pool.  The three are laid out
+// in one buffer that is also written next to System.map as an index file,
+// so other instances using the same kernel build can map it read-only
+// instead of parsing the text again.  The index records the size and
+// mtime of the System.map it came from and is rebuilt when they differ.
+// Instances opened from a pool go one step further and share the loaded
+// index itself, which then belongs to the pool.
+
+#define SYSMAP_INDEX_SUFFIX ".vmidx"
+#define SYSMAP_POOL_KEY "sysmap:"
+#define SYSMAP_INDEX_MAGIC "LVMISYM"
+#define SYSMAP_INDEX_VERSION 1
+#define SYSMAP_NIL 0xffffffffU
+
+struct sysmap_header{
+    char magic[8];
+    uint32_t version;
+    uint32_t count;             // symbols
+    uint32_t nbuckets;          // power of two
+    uint32_t reserved;
+    uint64_t source_size;       // of System.map
+    int64_t source_mtime;
+    uint64_t strings_size;
+};
+
+struct sysmap_symbol{
+    uint64_t address;
+    uint32_t name;              // offset in the string pool
+    uint32_t next;              // next symbol in the same hash bucket
+};
+
+struct linux_sysmap{
+    const struct sysmap_header *header;
+    const struct sysmap_symbol *symbols;    // sorted by address
+    const uint32_t *buckets;
+    const char *strings;
+    void *base;
+    size_t size;
+    int mapped;                 // base is an mmap of the index file
+    int pooled;                 // owned by the instance's pool
+};
+
+// FNV-1a, fixed here since the index outlives any one process
+static uint32_t sysmap_hash (const char *name)
 {
-    int ret = VMI_FAILURE;
+    uint32_t hash = 2166136261U;
 
-    while (fgets(row, MAX_ROW_LENGTH, f) != NULL){
-        char *token = NULL;
-
-        /* find the correct token to check */
-        int curpos = 0;
-        int position_copy = position;
-        while (position_copy > 0 && curpos < MAX_ROW_LENGTH){
-            if (isspace(row[curpos])){
-                while (isspace(row[curpos])){
-                    row[curpos] = '\0';
-                    ++curpos;
-                }
-                --position_copy;
-                continue;
-            }
-            ++curpos;
+    while (*name){
+        hash ^= (uint8_t) *name++;
+        hash *= 16777619U;
+    }
+    return hash;
+}
+
+static size_t sysmap_index_size (uint32_t count, uint32_t nbuckets, uint64_t strings_size)
+{
+    return sizeof(struct sysmap_header) + count * sizeof(struct sysmap_symbol) +
+           nbuckets * sizeof(uint32_t) + strings_size;
+}
+
+// point the table at a buffer holding an index, if the index is sound
+// and was built from the System.map described by st
+static status_t sysmap_attach (struct linux_sysmap *map, void *base, size_t size, struct stat *st)
+{
+    const struct sysmap_header *header = (const struct sysmap_header *) base;
+    uint64_t visited = 0;
+    uint32_t i = 0, sym = 0;
+
+    if (size < sizeof(struct sysmap_header) ||
+        memcmp(header->magic, SYSMAP_INDEX_MAGIC, sizeof(header->magic)) ||
+        header->version != SYSMAP_INDEX_VERSION ||
+        header->source_size != (uint64_t) st->st_size ||
+        header->source_mtime != (int64_t) st->st_mtime ||
+        !header->nbuckets || (header->nbuckets & (header->nbuckets - 1)) ||
+        !header->strings_size ||
+        size != sysmap_index_size(header->count, header->nbuckets, header->strings_size)){
+        return VMI_FAILURE;
+    }
+
+    map->header = header;
+    map->symbols = (const struct sysmap_symbol *) (header + 1);
+    map->buckets = (const uint32_t *) (map->symbols + header->count);
+    map->strings = (const char *) (map->buckets + header->nbuckets);
+
+    if (map->strings[header->strings_size - 1] != '\0'){
+        return VMI_FAILURE;
+    }
+    for (i = 0; i < header->count; ++i){
+        if (map->symbols[i].name >= header->strings_size ||
+            (map->symbols[i].next != SYSMAP_NIL && map->symbols[i].next >= header->count)){
+            return VMI_FAILURE;
+        }
+    }
+    for (i = 0; i < header->nbuckets; ++i){
+        if (map->buckets[i] != SYSMAP_NIL && map->buckets[i] >= header->count){
+            return VMI_FAILURE;
         }
-        if (position_copy == 0){
-            token = row + curpos;
-            while (curpos < MAX_ROW_LENGTH){
-                if (isspace(row[curpos])){
-                    row[curpos] = '\0';
-                    break;
-                }
-                ++curpos;
+    }
+
+    /* each symbol is on exactly one chain, so all the chains together hold
+     * count symbols; any more means a chain loops back on itself or runs
+     * into another one, and a lookup would never end */
+    for (i = 0; i < header->nbuckets; ++i){
+        for (sym = map->buckets[i]; sym != SYSMAP_NIL; sym = map->symbols[sym].next){
+            if (++visited > header->count){
+                return VMI_FAILURE;
             }
         }
-        else{ /* some went wrong in the loop above */
-            goto error_exit;
+    }
+
+    map->base = base;
+    map->size = size;
+    return VMI_SUCCESS;
+}
+
+static status_t sysmap_map_index (struct linux_sysmap *map, const char *path, struct stat *st)
+{
+    struct stat ist;
+    void *base = NULL;
+    int fd = -1;
+
+    if ((fd = open(path, O_RDONLY)) < 0){
+        return VMI_FAILURE;
+    }
+    if (fstat(fd, &ist) || !ist.st_size){
+        close(fd);
+        return VMI_FAILURE;
+    }
+    base = mmap(NULL, ist.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (MAP_FAILED == base){
+        return VMI_FAILURE;
+    }
+    if (VMI_FAILURE == sysmap_attach(map, base, ist.st_size, st)){
+        dbprint("--ignoring stale or damaged symbol index %s\n", path);
+        munmap(base, ist.st_size);
+        return VMI_FAILURE;
+    }
+    map->mapped = 1;
+    dbprint("--mapped symbol index %s (%u symbols)\n", path, map->header->count);
+    return VMI_SUCCESS;
+}
+
+struct sysmap_row{
+    uint64_t address;
+    uint32_t name;
+    uint32_t line;
+};
+
+static int sysmap_row_compare (const void *a, const void *b)
+{
+    const struct sysmap_row *ra = (const struct sysmap_row *) a;
+    const struct sysmap_row *rb = (const struct sysmap_row *) b;
+
+    if (ra->address != rb->address){
+        return (ra->address < rb->address) ? -1 : 1;
+    }
+    return (ra->line < rb->line) ? -1 : (ra->line > rb->line);
+}
+
+// parse System.map ("address type name" per line) into an index buffer
+static void *sysmap_parse (FILE *f, struct stat *st, size_t *size)
+{
+    char row[MAX_ROW_LENGTH];
+    struct sysmap_row *rows = NULL;
+    uint32_t *by_line = NULL;
+    char *strings = NULL, *base = NULL;
+    uint32_t count = 0, nrows = 0, nbuckets = 1, i = 0;
+    uint64_t strings_size = 0, strings_max = 0;
+    struct sysmap_header *header = NULL;
+    struct sysmap_symbol *symbols = NULL;
+    uint32_t *buckets = NULL;
+
+    while (fgets(row, MAX_ROW_LENGTH, f) != NULL){
+        char *p = NULL, *name = NULL;
+        uint64_t address = strtoull(row, &p, 16);
+        size_t len = 0;
+
+        if (p == row){
+            continue;
         }
 
-        /* check the token */
-        if (strncmp(token, symbol, MAX_ROW_LENGTH) == 0){
-            ret = VMI_SUCCESS;
-            break;
+        /* skip the type to get to the name */
+        while (isspace(*p)) ++p;
+        while (*p && !isspace(*p)) ++p;
+        while (isspace(*p)) ++p;
+        name = p;
+        while (*p && !isspace(*p)) ++p;
+        if (p == name){
+            continue;
         }
+        len = p - name;
+
+        if (count == nrows){
+            uint32_t grow = nrows ? nrows * 2 : 4096;
+            struct sysmap_row *more = realloc(rows, grow * sizeof(struct sysmap_row));
+            if (!more){
+                errprint("Failed to grow the symbol table to %u rows.\n", grow);
+                goto error_exit;
+            }
+            rows = more;
+            nrows = grow;
+        }
+        while (strings_size + len + 1 > strings_max){
+            uint64_t grow = strings_max ? strings_max * 2 : 65536;
+            char *more = realloc(strings, grow);
+            if (!more){
+                errprint("Failed to grow the symbol names to %llu bytes.\n", grow);
+                goto error_exit;
+            }
+            strings = more;
+            strings_max = grow;
+        }
+        memcpy(strings + strings_size, name, len);
+        strings[strings_size + len] = '\0';
+        rows[count].address = address;
+        rows[count].name = strings_size;
+        rows[count].line = count;
+        strings_size += len + 1;
+        ++count;
+    }
+    if (!count){
+        goto error_exit;
+    }
+    qsort(rows, count, sizeof(struct sysmap_row), sysmap_row_compare);
+
+    while (nbuckets < count){
+        nbuckets <<= 1;
+    }
+    *size = sysmap_index_size(count, nbuckets, strings_size);
+    base = safe_malloc(*size);
+    header = (struct sysmap_header *) base;
+    symbols = (struct sysmap_symbol *) (header + 1);
+    buckets = (uint32_t *) (symbols + count);
+
+    memset(header, 0, sizeof(struct sysmap_header));
+    memcpy(header->magic, SYSMAP_INDEX_MAGIC, sizeof(header->magic));
+    header->version = SYSMAP_INDEX_VERSION;
+    header->count = count;
+    header->nbuckets = nbuckets;
+    header->source_size = st->st_size;
+    header->source_mtime = st->st_mtime;
+    header->strings_size = strings_size;
+    memcpy(buckets + nbuckets, strings, strings_size);
+    memset(buckets, 0xff, nbuckets * sizeof(uint32_t));
+
+    by_line = (uint32_t *) safe_malloc(count * sizeof(uint32_t));
+    for (i = 0; i < count; ++i){
+        symbols[i].address = rows[i].address;
+        symbols[i].name = rows[i].name;
+        by_line[rows[i].line] = i;
+    }
+
+    /* chain in reverse file order, so a name defined more than once
+     * resolves to its first line, as the old linear scan did */
+    for (i = count; i-- > 0; ){
+        uint32_t sym = by_line[i];
+        uint32_t bucket = sysmap_hash(strings + symbols[sym].name) & (nbuckets - 1);
+        symbols[sym].next = buckets[bucket];
+        buckets[bucket] = sym;
     }
 
+    free(by_line);
+    free(rows);
+    free(strings);
+    return base;
+
 error_exit:
-    if (ret == VMI_FAILURE){
-        memset(row, 0, MAX_ROW_LENGTH);
+    free(rows);
+    free(strings);
+    return NULL;
+}
+
+// write the index beside System.map; a temporary file and a rename keep
+// readers from ever seeing a partial index
+static void sysmap_write_index (const char *path, const void *base, size_t size)
+{
+    char *tmp = safe_malloc(strlen(path) + 8);
+    int fd = -1;
+
+    sprintf(tmp, "%s.XXXXXX", path);
+    if ((fd = mkstemp(tmp)) < 0){
+        dbprint("--could not create symbol index %s\n", path);
+        goto exit;
     }
-    return ret;
+    if (write(fd, base, size) != (ssize_t) size ||
+        fchmod(fd, 0644) || close(fd) || rename(tmp, path)){
+        dbprint("--could not write symbol index %s\n", path);
+        unlink(tmp);
+        goto exit;
+    }
+    dbprint("--wrote symbol index %s\n", path);
+exit:
+    free(tmp);
 }
 
-status_t linux_system_map_symbol_to_address (vmi_instance_t vmi, char *symbol, addr_t *address)
+static void sysmap_free (void *data)
+{
+    struct linux_sysmap *map = data;
+
+    if (map->mapped){
+        munmap(map->base, map->size);
+    }
+    else{
+        free(map->base);
+    }
+    free(map);
+}
+
+static struct linux_sysmap *sysmap_open (vmi_instance_t vmi)
 {
+    struct linux_sysmap *map = NULL;
+    struct stat st;
+    char *path = NULL;
+    char *key = NULL;
     FILE *f = NULL;
-    char *row = NULL;
-    int ret = VMI_SUCCESS;
+    void *base = NULL;
+    size_t size = 0;
 
+    if (vmi->sysmap_index){
+        return vmi->sysmap_index;
+    }
     if ((NULL == vmi->sysmap) || (strlen(vmi->sysmap) == 0)){
         vmi->sysmap = strndup("unknown", 10);
     }
-
-    row = safe_malloc(MAX_ROW_LENGTH);
-    if ((f = fopen(vmi->sysmap, "r")) == NULL){
+    if (vmi->pool){
+        key = safe_malloc(strlen(SYSMAP_POOL_KEY) + strlen(vmi->sysmap) + 1);
+        sprintf(key, "%s%s", SYSMAP_POOL_KEY, vmi->sysmap);
+        if ((map = pool_shared_get(vmi->pool, key)) != NULL){
+            vmi->sysmap_index = map;
+            goto exit;
+        }
+    }
+    if ((f = fopen(vmi->sysmap, "r")) == NULL || fstat(fileno(f), &st)){
         fprintf(stderr, "ERROR: could not find System.map file after checking:\n");
         fprintf(stderr, "\t%s\n", vmi->sysmap);
         fprintf(stderr, "To fix this problem, add the correct sysmap entry to /etc/libvmi.conf\n");
-        ret = VMI_FAILURE;
-        goto error_exit;
-    }
-    if (get_symbol_row(f, row, symbol, 2) == VMI_FAILURE){
-        ret = VMI_FAILURE;
-        goto error_exit;
+        goto exit;
     }
 
-    *address = (addr_t) strtoull(row, NULL, 16);
+    map = (struct linux_sysmap *) safe_malloc(sizeof(struct linux_sysmap));
+    memset(map, 0, sizeof(struct linux_sysmap));
+    path = safe_malloc(strlen(vmi->sysmap) + strlen(SYSMAP_INDEX_SUFFIX) + 1);
+    sprintf(path, "%s%s", vmi->sysmap, SYSMAP_INDEX_SUFFIX);
 
-error_exit:
-    if (row) free(row);
+    if (VMI_FAILURE == sysmap_map_index(map, path, &st)){
+        if ((base = sysmap_parse(f, &st, &size)) == NULL ||
+            VMI_FAILURE == sysmap_attach(map, base, size, &st)){
+            errprint("No symbols found in %s.\n", vmi->sysmap);
+            if (base) free(base);
+            free(map);
+            map = NULL;
+            goto exit;
+        }
+        dbprint("--parsed %s (%u symbols)\n", vmi->sysmap, map->header->count);
+        sysmap_write_index(path, base, size);
+    }
+    if (vmi->pool){
+        map->pooled = 1;
+        map = pool_shared_add(vmi->pool, key, map, sysmap_free);
+    }
+    vmi->sysmap_index = map;
+
+exit:
+    if (key) free(key);
+    if (path) free(path);
     if (f) fclose(f);
-    return ret;
+    return map;
+}
+
+void linux_system_map_destroy (vmi_instance_t vmi)
+{
+    struct linux_sysmap *map = vmi->sysmap_index;
+
+    if (!map){
+        return;
+    }
+    if (!map->pooled){
+        sysmap_free(map);
+    }
+    vmi->sysmap_index = NULL;
+}
+
+status_t linux_system_map_symbol_to_address (vmi_instance_t vmi, char *symbol, addr_t *address)
+{
+    struct linux_sysmap *map = sysmap_open(vmi);
+    uint32_t sym = 0;
+
+    if (!map){
+        return VMI_FAILURE;
+    }
+    sym = map->buckets[sysmap_hash(symbol) & (map->header->nbuckets - 1)];
+    while (sym != SYSMAP_NIL){
+        if (strncmp(map->strings + map->symbols[sym].name, symbol, MAX_ROW_LENGTH) == 0){
+            *address = (addr_t) map->symbols[sym].address;
+            return VMI_SUCCESS;
+        }
+        sym = map->symbols[sym].next;
+    }
+    return VMI_FAILURE;
+}
+
+const char *linux_system_map_address_to_symbol (vmi_instance_t vmi, addr_t address, addr_t *offset)
+{
+    struct linux_sysmap *map = sysmap_open(vmi);
+    uint32_t low = 0, high = 0;
+
+    if (!map || !map->header->count || address < map->symbols[0].address){
+        return NULL;
+    }
+
+    /* last symbol at or below address; of several at the same address,
+     * the one listed first */
+    high = map->header->count;
+    while (high - low > 1){
+        uint32_t mid = low + (high - low) / 2;
+        if (map->symbols[mid].address <= address){
+            low = mid;
+        }
+        else{
+            high = mid;
+        }
+    }
+    while (low && map->symbols[low - 1].address == map->symbols[low].address){
+        --low;
+    }
+
+    if (offset){
+        *offset = address - map->symbols[low].address;
+    }
+    return map->strings + map->symbols[low].name;
 }
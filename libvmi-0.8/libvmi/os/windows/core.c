@@ -65,27 +65,30 @@ static status_t find_page_mode (vmi_instance_t vmi)
 
     dbprint("--trying VMI_PM_LEGACY\n");
     vmi->page_mode = VMI_PM_LEGACY;
+    v2p_walker_init(vmi);
     if (VMI_SUCCESS == vmi_read_addr_ksym(vmi, "KernBase", &proc)){
         goto found_pm;
     }
-    v2p_cache_flush(vmi);
+    vmi_v2pcache_flush(vmi);
 
     dbprint("--trying VMI_PM_PAE\n");
     vmi->page_mode = VMI_PM_PAE;
+    v2p_walker_init(vmi);
     if (VMI_SUCCESS == vmi_read_addr_ksym(vmi, "KernBase", &proc)){
         goto found_pm;
     }
-    v2p_cache_flush(vmi);
+    vmi_v2pcache_flush(vmi);
 
     dbprint("--trying VMI_PM_IA32E\n");
     vmi->page_mode = VMI_PM_IA32E;
+    v2p_walker_init(vmi);
     if (VMI_SUCCESS == vmi_read_addr_ksym(vmi, "KernBase", &proc)){
         goto found_pm;
     }
 
 
     // KernBase was NOT found ////////////////
-    v2p_cache_flush(vmi);
+    vmi_v2pcache_flush(vmi);
     return VMI_FAILURE;
 
 found_pm:
@@ -107,6 +110,7 @@ static status_t get_kpgd_method2 (vmi_instance_t vmi)
             goto error_exit;
         }
         printf("LibVMI Suggestion: set win_sysproc=0x%llx in libvmi.conf for faster startup.\n", sysproc);
+        vmi->os.windows_instance.sysproc = sysproc;
     }
     dbprint("--got PA to PsInititalSystemProcess (0x%.16llx).\n", sysproc);
 
@@ -132,6 +136,7 @@ error_exit:
 
 addr_t windows_find_cr3 (vmi_instance_t vmi)
 {
+    windows_discovery_load(vmi);
     get_kpgd_method2(vmi);
     return vmi->kpgd;
 }
@@ -207,6 +212,11 @@ error_exit:
 
 status_t windows_init (vmi_instance_t vmi)
 {
+    /* reuse what an earlier run found, unless find_cr3 already did */
+    if (!vmi->os.windows_instance.ntoskrnl){
+        windows_discovery_load(vmi);
+    }
+
     /* get base address for kernel image in memory */
     if (VMI_PM_UNKNOWN == vmi->page_mode){
         if (VMI_FAILURE == find_page_mode(vmi)){
@@ -243,6 +253,7 @@ status_t windows_init (vmi_instance_t vmi)
     goto error_exit;
 
 found_kpgd:
+    windows_discovery_save(vmi);
     return VMI_SUCCESS;
 error_exit:
     return VMI_FAILURE;
@@ -0,0 +1,289 @@
+/* The LibVMI Library is an introspection library that simplifies access to 
+ * memory in a target virtual machine or in a file containing a dump of 
+ * a system's physical memory.  LibVMI is based on the XenAccess Library.
+ *
+ * Copyright 2011 Sandia Corporation. Under the terms of Contract
+ * DE-AC04-94AL85000 with Sandia Corporation, the U.S. Government
+ * retains certain rights in this software.
+ *
+ * Author: Bryan D. Payne (bdpayne@acm.org)
+ *
+ * This file is part of LibVMI.
+ *
+ * LibVMI is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * LibVMI is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public
+ * License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with LibVMI.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Windows init scans physical memory for the KD version block, the
+// EPROCESS name offset and the System process.  The results are saved per
+// domain, together with a fingerprint of the ntoskrnl PE header, so that a
+// restarted monitor can check each saved value against the guest with a
+// read or two instead of scanning again.  A value that fails its check is
+// left unset and is rediscovered the usual way.
+
+#define _GNU_SOURCE
+#include "libvmi.h"
+#include "private.h"
+#include <stdio.h>
+#include <stddef.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#define DISCOVERY_DIR_ENV "LIBVMI_CACHE_DIR"
+#define DISCOVERY_DIR "/var/cache/libvmi"
+#define DISCOVERY_MAGIC "libvmi-windows-discovery"
+#define DISCOVERY_VERSION 1
+#define DISCOVERY_HEADER_BYTES 1024
+
+struct windows_discovery{
+    uint64_t fingerprint;       // of the ntoskrnl PE header
+    uint32_t page_mode;
+    addr_t kpgd;
+    addr_t ntoskrnl;
+    addr_t ntoskrnl_va;
+    addr_t kdvb;
+    addr_t sysproc;
+    uint64_t pname_offset;
+    uint64_t version;
+};
+
+// the ntoskrnl PE header holds its build timestamp, checksum and size,
+// so it tells kernel builds apart; zero if there is no image at paddr
+static uint64_t discovery_fingerprint (vmi_instance_t vmi, addr_t paddr)
+{
+    uint8_t image[DISCOVERY_HEADER_BYTES];
+    uint64_t hash = 14695981039346656037ULL;
+    int i = 0;
+
+    if (!paddr ||
+        DISCOVERY_HEADER_BYTES != vmi_read_pa(vmi, paddr, image, DISCOVERY_HEADER_BYTES) ||
+        VMI_FAILURE == validate_pe_image(image, DISCOVERY_HEADER_BYTES)){
+        return 0;
+    }
+    for (i = 0; i < DISCOVERY_HEADER_BYTES; ++i){
+        hash ^= image[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+static char *discovery_path (vmi_instance_t vmi)
+{
+    const char *dir = getenv(DISCOVERY_DIR_ENV);
+    char *path = NULL, *p = NULL;
+
+    if (!dir || !*dir){
+        dir = DISCOVERY_DIR;
+    }
+    if (!vmi->image_type){
+        return NULL;
+    }
+    path = safe_malloc(strlen(dir) + strlen(vmi->image_type) + 16);
+    sprintf(path, "%s/", dir);
+    p = path + strlen(path);
+    sprintf(p, "%s.windows", vmi->image_type);
+
+    /* the domain name (or file path) becomes a single file name */
+    for (; *p; ++p){
+        if (*p == '/' || *p == ' ' || *p == '\t'){
+            *p = '_';
+        }
+    }
+    return path;
+}
+
+static status_t discovery_read (const char *path, struct windows_discovery *rec)
+{
+    FILE *f = NULL;
+    char key[64];
+    unsigned long long value = 0;
+    int version = 0;
+
+    if ((f = fopen(path, "r")) == NULL){
+        return VMI_FAILURE;
+    }
+    memset(rec, 0, sizeof(struct windows_discovery));
+    if (fscanf(f, DISCOVERY_MAGIC " %d", &version) != 1 || version != DISCOVERY_VERSION){
+        fclose(f);
+        return VMI_FAILURE;
+    }
+    while (fscanf(f, "%63s %llx", key, &value) == 2){
+        if (!strcmp(key, "fingerprint")) rec->fingerprint = value;
+        else if (!strcmp(key, "page_mode")) rec->page_mode = value;
+        else if (!strcmp(key, "kpgd")) rec->kpgd = value;
+        else if (!strcmp(key, "ntoskrnl")) rec->ntoskrnl = value;
+        else if (!strcmp(key, "ntoskrnl_va")) rec->ntoskrnl_va = value;
+        else if (!strcmp(key, "kdvb")) rec->kdvb = value;
+        else if (!strcmp(key, "sysproc")) rec->sysproc = value;
+        else if (!strcmp(key, "pname_offset")) rec->pname_offset = value;
+        else if (!strcmp(key, "version")) rec->version = value;
+    }
+    fclose(f);
+    return VMI_SUCCESS;
+}
+
+static void discovery_write (const char *path, struct windows_discovery *rec)
+{
+    const char *dir = getenv(DISCOVERY_DIR_ENV);
+    char *tmp = safe_malloc(strlen(path) + 8);
+    FILE *f = NULL;
+    int fd = -1;
+
+    if (!dir || !*dir){
+        dir = DISCOVERY_DIR;
+    }
+    if (mkdir(dir, 0755) && errno != EEXIST){
+        dbprint("--could not create discovery cache directory %s\n", dir);
+        goto exit;
+    }
+
+    /* write a temporary file and rename it, so readers never see half a record */
+    sprintf(tmp, "%s.XXXXXX", path);
+    if ((fd = mkstemp(tmp)) < 0 || (f = fdopen(fd, "w")) == NULL){
+        dbprint("--could not write discovery cache %s\n", path);
+        if (fd >= 0) close(fd);
+        goto exit;
+    }
+    fprintf(f, "%s %d\n", DISCOVERY_MAGIC, DISCOVERY_VERSION);
+    fprintf(f, "fingerprint 0x%.16llx\n", (unsigned long long) rec->fingerprint);
+    fprintf(f, "page_mode 0x%x\n", rec->page_mode);
+    fprintf(f, "kpgd 0x%.16llx\n", (unsigned long long) rec->kpgd);
+    fprintf(f, "ntoskrnl 0x%.16llx\n", (unsigned long long) rec->ntoskrnl);
+    fprintf(f, "ntoskrnl_va 0x%.16llx\n", (unsigned long long) rec->ntoskrnl_va);
+    fprintf(f, "kdvb 0x%.16llx\n", (unsigned long long) rec->kdvb);
+    fprintf(f, "sysproc 0x%.16llx\n", (unsigned long long) rec->sysproc);
+    fprintf(f, "pname_offset 0x%llx\n", (unsigned long long) rec->pname_offset);
+    fprintf(f, "version 0x%llx\n", (unsigned long long) rec->version);
+    if (fchmod(fd, 0644) || fclose(f) || rename(tmp, path)){
+        dbprint("--could not write discovery cache %s\n", path);
+        unlink(tmp);
+        goto exit;
+    }
+    dbprint("--saved discovery cache %s\n", path);
+exit:
+    free(tmp);
+}
+
+/* the KD version block is a KDBG debugger data header */
+static int discovery_kdvb_valid (vmi_instance_t vmi, addr_t kdvb)
+{
+    char tag[4];
+    addr_t tag_offset = offsetof(DBGKD_DEBUG_DATA_HEADER64, OwnerTag);
+
+    return kdvb &&
+           sizeof(tag) == vmi_read_va(vmi, kdvb + tag_offset, 0, tag, sizeof(tag)) &&
+           !memcmp(tag, "KDBG", sizeof(tag));
+}
+
+/* the System process is named System and holds the kernel page directory */
+static int discovery_sysproc_valid (vmi_instance_t vmi, addr_t sysproc, int pname_offset)
+{
+    char name[7];
+    addr_t pgd = 0;
+
+    return sysproc && pname_offset &&
+           sizeof(name) == vmi_read_pa(vmi, sysproc + pname_offset, name, sizeof(name)) &&
+           !memcmp(name, "System", sizeof(name)) &&
+           VMI_SUCCESS == vmi_read_addr_pa(vmi, sysproc + vmi->os.windows_instance.pdbase_offset, &pgd) &&
+           pgd == vmi->kpgd;
+}
+
+status_t windows_discovery_load (vmi_instance_t vmi)
+{
+    struct windows_discovery rec;
+    page_mode_t page_mode = vmi->page_mode;
+    addr_t kpgd = vmi->kpgd;
+    char *path = discovery_path(vmi);
+    status_t ret = VMI_FAILURE;
+
+    if (!path || VMI_FAILURE == discovery_read(path, &rec)){
+        goto exit;
+    }
+
+    /* same kernel build, loaded at the same place? */
+    if (!rec.fingerprint || discovery_fingerprint(vmi, rec.ntoskrnl) != rec.fingerprint){
+        dbprint("--discovery cache %s is for another kernel\n", path);
+        goto exit;
+    }
+
+    /* paging mode and kernel page directory must map ntoskrnl where it is */
+    if (VMI_PM_UNKNOWN != page_mode && rec.page_mode != page_mode){
+        dbprint("--discovery cache %s has another paging mode\n", path);
+        goto exit;
+    }
+    vmi->page_mode = rec.page_mode;
+    vmi->kpgd = rec.kpgd;
+    v2p_walker_init(vmi);
+    vmi_v2pcache_flush(vmi);
+    if (vmi_translate_kv2p(vmi, rec.ntoskrnl_va) != rec.ntoskrnl){
+        dbprint("--discovery cache %s has a stale kernel page directory\n", path);
+        vmi->page_mode = page_mode;
+        vmi->kpgd = kpgd;
+        v2p_walker_init(vmi);
+        vmi_v2pcache_flush(vmi);
+        goto exit;
+    }
+    if (!vmi->cr3){
+        vmi->cr3 = rec.kpgd;
+    }
+    vmi->os.windows_instance.ntoskrnl = rec.ntoskrnl;
+    vmi->os.windows_instance.ntoskrnl_va = rec.ntoskrnl_va;
+
+    if (!vmi->os.windows_instance.kdversion_block && discovery_kdvb_valid(vmi, rec.kdvb)){
+        vmi->os.windows_instance.kdversion_block = rec.kdvb;
+        vmi->os.windows_instance.version = rec.version;
+    }
+    if (!vmi->os.windows_instance.sysproc){
+        int pname_offset = vmi->os.windows_instance.pname_offset ?
+                           vmi->os.windows_instance.pname_offset : rec.pname_offset;
+        if (discovery_sysproc_valid(vmi, rec.sysproc, pname_offset)){
+            vmi->os.windows_instance.pname_offset = pname_offset;
+            vmi->os.windows_instance.sysproc = rec.sysproc;
+        }
+    }
+    dbprint("--loaded discovery cache %s (kdvb 0x%llx, sysproc 0x%llx)\n", path,
+            vmi->os.windows_instance.kdversion_block, vmi->os.windows_instance.sysproc);
+    ret = VMI_SUCCESS;
+
+exit:
+    if (path) free(path);
+    return ret;
+}
+
+void windows_discovery_save (vmi_instance_t vmi)
+{
+    struct windows_discovery rec, old;
+    char *path = discovery_path(vmi);
+
+    if (!path){
+        return;
+    }
+    memset(&rec, 0, sizeof(struct windows_discovery));
+    rec.ntoskrnl = vmi->os.windows_instance.ntoskrnl;
+    rec.fingerprint = discovery_fingerprint(vmi, rec.ntoskrnl);
+    rec.page_mode = vmi->page_mode;
+    rec.kpgd = vmi->kpgd;
+    rec.ntoskrnl_va = vmi->os.windows_instance.ntoskrnl_va;
+    rec.kdvb = vmi->os.windows_instance.kdversion_block;
+    rec.sysproc = vmi->os.windows_instance.sysproc;
+    rec.pname_offset = vmi->os.windows_instance.pname_offset;
+    rec.version = vmi->os.windows_instance.version;
+
+    if (rec.fingerprint && (VMI_FAILURE == discovery_read(path, &old) ||
+                            memcmp(&old, &rec, sizeof(struct windows_discovery)))){
+        discovery_write(path, &rec);
+    }
+    free(path);
+}
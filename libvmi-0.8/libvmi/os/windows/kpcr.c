@@ -29,14 +29,6 @@
 #define _GNU_SOURCE
 #include <string.h>
 
-struct _DBGKD_DEBUG_DATA_HEADER64
-{
-    uint64_t List[2];
-    uint32_t OwnerTag;
-    uint32_t Size;
-} __attribute__ ((packed));
-typedef struct _DBGKD_DEBUG_DATA_HEADER64 DBGKD_DEBUG_DATA_HEADER64;
-
 struct _KDDEBUGGER_DATA64
 {
     DBGKD_DEBUG_DATA_HEADER64 Header;
@@ -115,3 +115,64 @@ addr_t windows_pid_to_pgd (vmi_instance_t vmi, int pid)
 error_exit:
     return pgd;
 }
+
+/* walks the active process list once, recording every EPROCESS on it */
+status_t windows_snapshot_processes (vmi_instance_t vmi, vmi_process_table_t *table)
+{
+    addr_t list_head = 0, next_process = 0;
+    int pid_offset = vmi->os.windows_instance.pid_offset;
+    int tasks_offset = vmi->os.windows_instance.tasks_offset;
+    int pdbase_offset = vmi->os.windows_instance.pdbase_offset;
+    int pname_offset = vmi->os.windows_instance.pname_offset;
+
+    /* PsActiveProcessHead anchors the list but isn't an EPROCESS itself;
+     * without the symbol, find it as System's Blink, since System is always
+     * the first process on the list and init_task is the link after it */
+    if (VMI_SUCCESS == windows_symbol_to_address(vmi, "PsActiveProcessHead", &list_head)){
+        vmi_read_addr_va(vmi, list_head, 0, &next_process);
+        if (next_process == list_head){
+            return VMI_SUCCESS;
+        }
+    }
+    else{
+        addr_t width = (VMI_PM_IA32E == vmi->page_mode) ? 8 : 4;
+        addr_t system = 0, first = 0;
+
+        dbprint("--PsActiveProcessHead not found, finding it from init_task\n");
+        if (!vmi->init_task ||
+            VMI_FAILURE == vmi_read_addr_va(vmi, vmi->init_task + width, 0, &system) ||
+            VMI_FAILURE == vmi_read_addr_va(vmi, system + width, 0, &list_head) ||
+            VMI_FAILURE == vmi_read_addr_va(vmi, list_head, 0, &first) ||
+            first != system){
+            errprint("Could not find the process list head.\n");
+            return VMI_FAILURE;
+        }
+        next_process = system;
+    }
+    if (!next_process){
+        errprint("Process list head is not set.\n");
+        return VMI_FAILURE;
+    }
+
+    do{
+        addr_t eprocess = next_process - tasks_offset;
+        vmi_process_t *proc = process_table_add(table);
+
+        if (!proc){
+            return VMI_FAILURE;
+        }
+        proc->task = eprocess;
+        vmi_read_32_va(vmi, eprocess + pid_offset, 0, (uint32_t *) &proc->pid);
+        vmi_read_addr_va(vmi, eprocess + pdbase_offset, 0, &proc->dtb);
+        if (pname_offset){
+            vmi_read_va(vmi, eprocess + pname_offset, 0, proc->name, sizeof(proc->name) - 1);
+        }
+
+        if (VMI_FAILURE == vmi_read_addr_va(vmi, next_process, 0, &next_process) || !next_process){
+            errprint("Process list is broken after pid %d.\n", proc->pid);
+            return VMI_FAILURE;
+        }
+    } while (next_process != list_head);
+
+    return VMI_SUCCESS;
+}
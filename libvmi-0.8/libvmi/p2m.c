@@ -0,0 +1,220 @@
+/* The LibVMI Library is an introspection library that simplifies access to 
+ * memory in a target virtual machine or in a file containing a dump of 
+ * a system's physical memory.  LibVMI is based on the XenAccess Library.
+ *
+ * Copyright 2011 Sandia Corporation. Under the terms of Contract
+ * DE-AC04-94AL85000 with Sandia Corporation, the U.S. Government
+ * retains certain rights in this software.
+ *
+ * Author: Bryan D. Payne (bdpayne@acm.org)
+ *
+ * This file is part of LibVMI.
+ *
+ * LibVMI is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * LibVMI is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public
+ * License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with LibVMI.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Second stage translation, guest frame number (gfn) to machine frame
+// number (mfn).  The mappings come from a pluggable provider, and are
+// fetched in chunks of P2M_CHUNK_SIZE frames into a two level array, so
+// that after the first touch of a chunk every lookup is a pair of array
+// loads in user space.  The p2m of a guest changes rarely (ballooning,
+// live migration), so the array is only dropped on vmi_p2m_flush or when
+// a new provider is set.
+
+#include "libvmi.h"
+#include "private.h"
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#define P2M_CHUNK_SHIFT 12
+#define P2M_CHUNK_SIZE (1ULL << P2M_CHUNK_SHIFT)
+#define P2M_MAX_CHUNKS (1ULL << 21)   // 32TB of 4KB frames
+
+// File backed provider.  The file is an array of 64-bit mfns in host
+// byte order, indexed by gfn, with VMI_INVALID_MFN for unmapped frames.
+struct p2m_file{
+    int fd;
+    uint64_t frames;    /**< number of gfns in the file */
+};
+
+static status_t p2m_file_populate (void *data, uint64_t gfn, uint64_t count, uint64_t *mfns)
+{
+    struct p2m_file *file = (struct p2m_file *) data;
+    uint64_t avail = 0, i = 0;
+    ssize_t got = 0;
+
+    for (i = 0; i < count; ++i){
+        mfns[i] = VMI_INVALID_MFN;
+    }
+    if (gfn >= file->frames){
+        return VMI_SUCCESS;
+    }
+
+    avail = file->frames - gfn;
+    if (avail > count){
+        avail = count;
+    }
+    got = pread(file->fd, mfns, avail * sizeof(uint64_t), gfn * sizeof(uint64_t));
+    if (got < 0 || (uint64_t) got != avail * sizeof(uint64_t)){
+        errprint("Failed to read p2m file at gfn 0x%llx.\n", gfn);
+        return VMI_FAILURE;
+    }
+    return VMI_SUCCESS;
+}
+
+static void p2m_file_destroy (void *data)
+{
+    struct p2m_file *file = (struct p2m_file *) data;
+    if (file){
+        close(file->fd);
+        free(file);
+    }
+}
+
+void p2m_flush (vmi_instance_t vmi)
+{
+    uint64_t i = 0;
+
+    if (vmi->p2m_chunks){
+        for (i = 0; i < vmi->p2m_nchunks; ++i){
+            if (vmi->p2m_chunks[i]) free(vmi->p2m_chunks[i]);
+        }
+        free(vmi->p2m_chunks);
+    }
+    vmi->p2m_chunks = NULL;
+    vmi->p2m_nchunks = 0;
+}
+
+void p2m_destroy (vmi_instance_t vmi)
+{
+    p2m_flush(vmi);
+    if (vmi->p2m.destroy){
+        vmi->p2m.destroy(vmi->p2m.data);
+    }
+    memset(&vmi->p2m, 0, sizeof(vmi_p2m_provider_t));
+}
+
+/* the chunk holding gfn, fetched from the provider on first use */
+static uint64_t *p2m_get_chunk (vmi_instance_t vmi, uint64_t gfn)
+{
+    uint64_t index = gfn >> P2M_CHUNK_SHIFT;
+    uint64_t *chunk = NULL;
+
+    if (index >= P2M_MAX_CHUNKS){
+        dbprint("--P2M: gfn 0x%llx is beyond the p2m table\n", gfn);
+        return NULL;
+    }
+    if (index >= vmi->p2m_nchunks){
+        uint64_t nchunks = vmi->p2m_nchunks ? vmi->p2m_nchunks : 64;
+        uint64_t **chunks = NULL;
+        while (nchunks <= index){
+            nchunks *= 2;
+        }
+        if ((chunks = realloc(vmi->p2m_chunks, nchunks * sizeof(uint64_t *))) == NULL){
+            errprint("Failed to grow the p2m table to 0x%llx chunks.\n", nchunks);
+            return NULL;
+        }
+        memset(chunks + vmi->p2m_nchunks, 0, (nchunks - vmi->p2m_nchunks) * sizeof(uint64_t *));
+        vmi->p2m_chunks = chunks;
+        vmi->p2m_nchunks = nchunks;
+    }
+
+    if ((chunk = vmi->p2m_chunks[index]) == NULL){
+        chunk = (uint64_t *) safe_malloc(P2M_CHUNK_SIZE * sizeof(uint64_t));
+        if (VMI_FAILURE == vmi->p2m.populate(vmi->p2m.data, index << P2M_CHUNK_SHIFT, P2M_CHUNK_SIZE, chunk)){
+            free(chunk);
+            return NULL;
+        }
+        vmi->p2m_chunks[index] = chunk;
+        dbprint("--P2M: fetched gfns 0x%llx - 0x%llx\n",
+            index << P2M_CHUNK_SHIFT, ((index + 1) << P2M_CHUNK_SHIFT) - 1);
+    }
+    return chunk;
+}
+
+status_t vmi_set_p2m_provider (vmi_instance_t vmi, const vmi_p2m_provider_t *provider)
+{
+    if (!provider || !provider->populate){
+        return VMI_FAILURE;
+    }
+    p2m_destroy(vmi);
+    vmi->p2m = *provider;
+    return VMI_SUCCESS;
+}
+
+status_t vmi_set_p2m_file (vmi_instance_t vmi, const char *path)
+{
+    struct p2m_file *file = NULL;
+    vmi_p2m_provider_t provider;
+    struct stat st;
+    int fd = open(path, O_RDONLY);
+
+    if (fd < 0){
+        errprint("Failed to open p2m file %s: %s\n", path, strerror(errno));
+        return VMI_FAILURE;
+    }
+    if (fstat(fd, &st) != 0){
+        errprint("Failed to stat p2m file %s.\n", path);
+        close(fd);
+        return VMI_FAILURE;
+    }
+
+    file = (struct p2m_file *) safe_malloc(sizeof(struct p2m_file));
+    file->fd = fd;
+    file->frames = st.st_size / sizeof(uint64_t);
+
+    provider.populate = p2m_file_populate;
+    provider.destroy = p2m_file_destroy;
+    provider.data = file;
+    return vmi_set_p2m_provider(vmi, &provider);
+}
+
+void vmi_p2m_flush (vmi_instance_t vmi)
+{
+    p2m_flush(vmi);
+}
+
+status_t vmi_gfn_to_mfn (vmi_instance_t vmi, uint64_t gfn, uint64_t *mfn)
+{
+    uint64_t *chunk = NULL;
+
+    if (!vmi->p2m.populate){
+        dbprint("--P2M: no provider set\n");
+        return VMI_FAILURE;
+    }
+    if ((chunk = p2m_get_chunk(vmi, gfn)) == NULL){
+        return VMI_FAILURE;
+    }
+    *mfn = chunk[gfn & (P2M_CHUNK_SIZE - 1)];
+    return (VMI_INVALID_MFN == *mfn) ? VMI_FAILURE : VMI_SUCCESS;
+}
+
+addr_t vmi_translate_v2m (vmi_instance_t vmi, addr_t dtb, addr_t vaddr)
+{
+    addr_t paddr = vmi_pagetable_lookup(vmi, dtb, vaddr);
+    uint64_t mfn = 0;
+
+    if (!paddr){
+        return 0;
+    }
+    if (VMI_FAILURE == vmi_gfn_to_mfn(vmi, paddr >> 12, &mfn)){
+        return 0;
+    }
+    return (mfn << 12) | (paddr & 0xFFF);
+}
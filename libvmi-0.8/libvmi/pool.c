@@ -0,0 +1,158 @@
+/* The LibVMI Library is an introspection library that simplifies access to 
+ * memory in a target virtual machine or in a file containing a dump of 
+ * a system's physical memory.  LibVMI is based on the XenAccess Library.
+ *
+ * Copyright 2011 Sandia Corporation. Under the terms of Contract
+ * DE-AC04-94AL85000 with Sandia Corporation, the U.S. Government
+ * retains certain rights in this software.
+ *
+ * Author: Bryan D. Payne (bdpayne@acm.org)
+ *
+ * This file is part of LibVMI.
+ *
+ * LibVMI is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * LibVMI is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public
+ * License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with LibVMI.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "libvmi.h"
+#include "private.h"
+#include <string.h>
+#include <sys/stat.h>
+
+#include "glib_compat.h"
+
+#define POOL_CONFIG_FILE "/etc/libvmi.conf"
+
+// A pool is reference counted: its owner holds one reference and every
+// instance opened from it holds another, so the shared resources outlive
+// vmi_pool_destroy until the last instance is gone.  Shared resources are
+// added once under a key and never replaced; they are released with the
+// pool.
+
+struct pool_resource{
+    void *data;
+    void (*release)(void *);
+};
+
+static void pool_resource_free (gpointer data)
+{
+    struct pool_resource *res = data;
+    if (res){
+        if (res->release) res->release(res->data);
+        free(res);
+    }
+}
+
+static char *pool_read_config (void)
+{
+    FILE *f = NULL;
+    struct stat st;
+    char *config = NULL;
+
+    if ((f = fopen(POOL_CONFIG_FILE, "r")) == NULL){
+        dbprint("--pool: no config file at %s\n", POOL_CONFIG_FILE);
+        return NULL;
+    }
+    if (fstat(fileno(f), &st) == 0){
+        config = safe_malloc(st.st_size + 1);
+        if (fread(config, 1, st.st_size, f) != (size_t) st.st_size){
+            free(config);
+            config = NULL;
+        }
+        else{
+            config[st.st_size] = '\0';
+        }
+    }
+    fclose(f);
+    return config;
+}
+
+void pool_retain (vmi_pool_t pool)
+{
+    pthread_mutex_lock(&pool->lock);
+    pool->refs++;
+    pthread_mutex_unlock(&pool->lock);
+}
+
+void pool_release (vmi_pool_t pool)
+{
+    uint32_t refs = 0;
+
+    pthread_mutex_lock(&pool->lock);
+    refs = --pool->refs;
+    pthread_mutex_unlock(&pool->lock);
+    if (refs){
+        return;
+    }
+
+    g_hash_table_destroy(pool->shared);
+    if (pool->config) free(pool->config);
+    pthread_mutex_destroy(&pool->lock);
+    pthread_mutex_destroy(&pool->init_lock);
+    free(pool);
+}
+
+void *pool_shared_get (vmi_pool_t pool, const char *key)
+{
+    struct pool_resource *res = NULL;
+
+    pthread_mutex_lock(&pool->lock);
+    res = g_hash_table_lookup(pool->shared, key);
+    pthread_mutex_unlock(&pool->lock);
+    return res ? res->data : NULL;
+}
+
+// Adds \a data under \a key and returns it.  If another instance got there
+// first, \a data is released and the resource already in the pool is
+// returned instead.
+void *pool_shared_add (vmi_pool_t pool, const char *key, void *data, void (*release)(void *))
+{
+    struct pool_resource *res = NULL;
+
+    pthread_mutex_lock(&pool->lock);
+    if ((res = g_hash_table_lookup(pool->shared, key)) == NULL){
+        res = safe_malloc(sizeof(struct pool_resource));
+        res->data = data;
+        res->release = release;
+        g_hash_table_insert(pool->shared, strdup(key), res);
+        data = NULL;
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    if (data && release){
+        release(data);
+    }
+    return res->data;
+}
+
+status_t vmi_pool_init (vmi_pool_t *pool)
+{
+    *pool = (vmi_pool_t) safe_malloc(sizeof(struct vmi_pool));
+    memset(*pool, 0, sizeof(struct vmi_pool));
+
+    pthread_mutex_init(&(*pool)->lock, NULL);
+    pthread_mutex_init(&(*pool)->init_lock, NULL);
+    (*pool)->refs = 1;
+    (*pool)->config = pool_read_config();
+    (*pool)->shared = g_hash_table_new_full(g_str_hash, g_str_equal, free, pool_resource_free);
+    return VMI_SUCCESS;
+}
+
+status_t vmi_pool_destroy (vmi_pool_t pool)
+{
+    if (!pool){
+        return VMI_FAILURE;
+    }
+    pool_release(pool);
+    return VMI_SUCCESS;
+}
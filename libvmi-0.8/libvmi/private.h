@@ -38,6 +38,7 @@
 #include <math.h>
 #include <ctype.h>
 #include <time.h>
+#include <pthread.h>
 #include "libvmi.h"
 
 /**
@@ -48,12 +49,29 @@
  * be created using the vmi_init function.  When you are done with an instance,
  * its resources can be freed using the vmi_destroy function.
  */
+/* the page table entry that produced a translation, kept with cached
+ * translations so they can be revalidated by reading just that entry */
+typedef struct v2p_leaf{
+    addr_t addr;            /**< physical address of the entry */
+    uint64_t value;         /**< entry as read during the walk */
+    int width;              /**< entry size in bytes, 0 if unknown */
+    addr_t size;            /**< bytes mapped by the entry, 0 if unknown */
+} v2p_leaf_t;
+
+struct v2p_memo;
+struct linux_sysmap;
+struct v2p_tlb;
+struct memory_cache_entry;
+struct driver_instance;
+typedef addr_t (*v2p_walker_t) (vmi_instance_t vmi, addr_t dtb, addr_t vaddr, struct v2p_memo *memo);
+
 struct vmi_instance{
     vmi_mode_t mode;        /**< VMI_FILE, VMI_XEN, VMI_KVM */
     uint32_t flags;         /**< flags passed to init function */
     uint32_t init_mode;     /**< VMI_INIT_PARTIAL or VMI_INIT_COMPLETE */
     char *configstr;        /**< string holding config info */
     char *sysmap;           /**< system map file for domain's running kernel */
+    struct linux_sysmap *sysmap_index;/**< symbols from sysmap, see os/linux/symbols.c */
     char *image_type;       /**< image type that we are accessing */
     uint32_t page_offset;   /**< page offset for this instance */
     uint32_t page_shift;    /**< page shift for last mapped page */
@@ -89,15 +107,59 @@ struct vmi_instance{
             win_ver_t version;   /**< version of Windows */
         } windows_instance;
     } os;
+    v2p_walker_t v2p_walker;/**< page table walker for page_mode */
+    page_mode_t v2p_walker_mode;/**< page_mode that v2p_walker was picked for */
     GHashTable *pid_cache;  /**< hash table to hold the PID cache data */
     GHashTable *sym_cache;  /**< hash table to hold the sym cache data */
-    GHashTable *v2p_cache;  /**< hash table to hold the v2p cache data */
+    struct v2p_tlb *v2p_cache;/**< software TLB holding the v2p cache data */
+    uint32_t v2p_large;     /**< large page size classes in the v2p cache */
+    GHashTable *ps_cache;   /**< hash table to hold paging structure entries */
+    uint32_t ps_cache_size_max;/**< max size of paging structure cache */
+    uint64_t ps_cache_tick; /**< use counter for paging structure cache LRU */
+    uint64_t cache_epoch;   /**< current epoch for the address caches */
+    uint64_t cache_epoch_start;/**< time the current epoch began (msec) */
+    uint32_t cache_epoch_interval;/**< epoch length in msec, 0 for no limit */
+    GHashTable *walk_snapshots;/**< per dtb state for incremental walks */
+    vmi_p2m_provider_t p2m; /**< source of gfn to mfn translations */
+    uint64_t **p2m_chunks;  /**< cached p2m, in chunks fetched on demand */
+    uint64_t p2m_nchunks;   /**< size of the p2m_chunks array */
+    pthread_mutex_t read_lock;/**< guards the page cache and driver while concurrent */
+    int concurrent;         /**< set while worker threads read guest memory */
+    GHashTable *kshare;     /**< dtb -> kernel half PML4 entries shared with kpgd */
+    void *kshare_last;      /**< kshare entry of the last dtb looked up */
+    addr_t kshare_last_dtb;
+    uint64_t process_generation;/**< generation of the last process snapshot */
     void *driver;           /**< driver-specific information */
-    GHashTable *memory_cache;  /**< hash table for memory cache */
-    GList *memory_cache_lru;  /**< list holding the most recently used pages */
-    uint32_t memory_cache_age; /**< max age of memory cache entry */
-    uint32_t memory_cache_size;/**< current size of memory cache */
-    uint32_t memory_cache_size_max;/**< max size of memory cache */
+    struct driver_instance *driver_ptrs;/**< driver function table */
+    vmi_pool_t pool;        /**< pool this instance was opened from, or NULL */
+    struct memory_cache_entry ***memory_cache;/**< frame number -> memory cache entry, two level */
+    uint64_t memory_cache_nleaves;/**< size of the top level of memory_cache */
+    uint32_t memory_cache_count;/**< pages held in memory cache */
+    void *(*memory_cache_get_data)(vmi_instance_t, addr_t, uint32_t);/**< driver fetch for memory cache */
+    void (*memory_cache_release_data)(void *, size_t);/**< driver release for memory cache */
+    struct memory_cache_entry *memory_cache_lru;/**< most recently used page, head of the LRU ring */
+    uint32_t memory_cache_age; /**< max age of memory cache entry (msec), 0 for never */
+    uint64_t memory_cache_clock;/**< coarse clock of the current read batch, 0 if unread */
+    uint32_t memory_cache_batch;/**< nesting depth of read batches */
+    uint64_t memory_cache_fresh;/**< id of the current fresh read batch, 0 if none */
+    uint64_t memory_cache_fresh_next;/**< last fresh batch id handed out */
+    uint64_t memory_cache_window;/**< bumped when the VM is paused or resumed */
+    uint32_t memory_cache_paused;/**< nesting depth of vmi_pause_vm */
+    uint64_t memory_cache_size;/**< bytes held in memory cache */
+    uint64_t memory_cache_size_max;/**< byte budget of memory cache */
+};
+
+/**
+ * @brief LibVMI instance pool.
+ *
+ * Read-only resources shared by the instances opened from one pool.
+ */
+struct vmi_pool{
+    pthread_mutex_t lock;   /**< protects refs and shared */
+    pthread_mutex_t init_lock;/**< serializes instance init, the config parser is not reentrant */
+    uint32_t refs;          /**< the pool's owner plus one per open instance */
+    char *config;           /**< contents of /etc/libvmi.conf, read once */
+    GHashTable *shared;     /**< key -> resource shared between instances */
 };
 
 /** Windows' UNICODE_STRING structure (x86) */
@@ -114,6 +176,15 @@ typedef struct _windows_unicode_string64 {
     uint64_t pBuffer; // pointer to string contents
 } __attribute__((packed)) win64_unicode_string_t;
 
+/** Header of the KD version block (KDDEBUGGER_DATA64), same on x86 and x64 */
+struct _DBGKD_DEBUG_DATA_HEADER64
+{
+    uint64_t List[2];
+    uint32_t OwnerTag;
+    uint32_t Size;
+} __attribute__ ((packed));
+typedef struct _DBGKD_DEBUG_DATA_HEADER64 DBGKD_DEBUG_DATA_HEADER64;
+
 /*----------------------------------------------
  * convenience.c
  */
@@ -140,6 +211,7 @@ status_t pid_cache_get (vmi_instance_t vmi, int pid, addr_t *dtb);
 void pid_cache_set (vmi_instance_t vmi, int pid, addr_t dtb);
 status_t pid_cache_del (vmi_instance_t vmi, int pid);
 void pid_cache_flush (vmi_instance_t vmi);
+void pid_cache_flush_dtb (vmi_instance_t vmi, addr_t dtb);
 
 void sym_cache_init (vmi_instance_t vmi);
 void sym_cache_destroy (vmi_instance_t vmi);
@@ -151,20 +223,82 @@ void sym_cache_flush (vmi_instance_t vmi);
 void v2p_cache_init (vmi_instance_t vmi);
 void v2p_cache_destroy (vmi_instance_t vmi);
 status_t v2p_cache_get (vmi_instance_t vmi, addr_t va, addr_t dtb, addr_t *pa);
-void v2p_cache_set (vmi_instance_t vmi, addr_t va, addr_t dtb, addr_t pa);
+void v2p_cache_set (vmi_instance_t vmi, addr_t va, addr_t dtb, addr_t pa, const v2p_leaf_t *leaf);
 status_t v2p_cache_del (vmi_instance_t vmi, addr_t va, addr_t dtb);
 void v2p_cache_flush (vmi_instance_t vmi);
+void v2p_cache_flush_dtb (vmi_instance_t vmi, addr_t dtb);
+void v2p_cache_flush_range (vmi_instance_t vmi, addr_t dtb, addr_t va, addr_t len);
+
+/* paging structure levels held in the ps cache */
+#define PS_PML4E 0
+#define PS_PDPTE 1
+#define PS_PDE   2
+void ps_cache_init (vmi_instance_t vmi);
+void ps_cache_destroy (vmi_instance_t vmi);
+status_t ps_cache_get (vmi_instance_t vmi, addr_t dtb, int level, addr_t tag, uint64_t *value, addr_t *location);
+void ps_cache_set (vmi_instance_t vmi, addr_t dtb, int level, addr_t tag, uint64_t value, addr_t location);
+void ps_cache_flush (vmi_instance_t vmi);
+void ps_cache_flush_dtb (vmi_instance_t vmi, addr_t dtb);
+
+void cache_epoch_init (vmi_instance_t vmi);
+void cache_epoch_bump (vmi_instance_t vmi);
 
 /*-----------------------------------------
  * memory.c
  */
 void *vmi_read_page (vmi_instance_t vmi, addr_t frame_num);
+int entry_present (uint64_t entry);
+int page_size_flag (uint64_t entry);
+void v2p_walker_init (vmi_instance_t vmi);
+addr_t vmi_pagetable_lookup (vmi_instance_t vmi, addr_t dtb, addr_t vaddr);
+
+/* Two PML4 entries point at the same kernel subtree if they differ only in
+ * bits that the CPU sets behind our back or that are free for the OS:
+ * accessed (5), the ignored bits 6 and 8-11, and the ignored bits 52-62. */
+#define PML4E_IGNORED_BITS 0x7FF0000000000F60ULL
+#define PML4E_SAME_TABLE(a, b) ((((a) ^ (b)) & ~PML4E_IGNORED_BITS) == 0)
+addr_t kernel_share_dtb (vmi_instance_t vmi, addr_t dtb, addr_t vaddr);
+void kernel_share_mask (vmi_instance_t vmi, addr_t dtb, uint64_t mask[4]);
+void kernel_share_flush (vmi_instance_t vmi);
+void kernel_share_flush_dtb (vmi_instance_t vmi, addr_t dtb);
+void kernel_share_destroy (vmi_instance_t vmi);
+vmi_process_t *process_table_add (vmi_process_table_t *table);
+
+/*-----------------------------------------
+ * p2m.c
+ */
+void p2m_flush (vmi_instance_t vmi);
+void p2m_destroy (vmi_instance_t vmi);
+
+/*-----------------------------------------
+ * walk.c
+ */
+typedef void (*walk_leaf_func_t) (vmi_instance_t vmi, addr_t va, addr_t pa, addr_t size,
+    uint32_t flags, addr_t location, uint64_t entry, void *data);
+status_t walk_leaves (vmi_instance_t vmi, addr_t dtb, const uint64_t *roots, walk_leaf_func_t func, void *data);
+void walk_snapshot_destroy (vmi_instance_t vmi);
+
+/*-----------------------------------------
+ * ptscan.c
+ */
+#define PT_SCAN_WORDS 8     /* 512 entries, 64 per mask word */
+typedef struct pt_scan{
+    uint64_t present[PT_SCAN_WORDS];  /**< P bit set */
+    uint64_t large[PT_SCAN_WORDS];    /**< present with bit 7 set (PS, or PAT in a PTE) */
+    uint64_t accessed[PT_SCAN_WORDS]; /**< present with the A bit set */
+    uint64_t dirty[PT_SCAN_WORDS];    /**< present with the D bit set */
+    uint64_t swap[PT_SCAN_WORDS];     /**< not present but nonzero */
+} pt_scan_t;
+void pt_scan_page (const uint64_t *table, pt_scan_t *scan);
 
 /*-----------------------------------------
  * os/linux/...
  */
 status_t linux_init (vmi_instance_t instance);
 status_t linux_system_map_symbol_to_address (vmi_instance_t instance, char *symbol, addr_t *address);
+const char *linux_system_map_address_to_symbol (vmi_instance_t vmi, addr_t address, addr_t *offset);
+void linux_system_map_destroy (vmi_instance_t vmi);
+status_t linux_snapshot_processes (vmi_instance_t vmi, vmi_process_table_t *table);
 
 /*-----------------------------------------
  * os/windows/...
@@ -179,6 +313,9 @@ addr_t windows_find_cr3 (vmi_instance_t vmi);
 int find_pname_offset (vmi_instance_t vmi, check_magic_func check);
 void find_windows_version (vmi_instance_t vmi, addr_t KdVersionBlock);
 status_t validate_pe_image (const uint8_t * const image, size_t len);
+status_t windows_snapshot_processes (vmi_instance_t vmi, vmi_process_table_t *table);
+status_t windows_discovery_load (vmi_instance_t vmi);
+void windows_discovery_save (vmi_instance_t vmi);
 
 /*-----------------------------------------
  * strmatch.c
@@ -197,4 +334,12 @@ int boyer_moore (unsigned char *x, int m, unsigned char *y, int n);
 void timer_start ();
 void timer_stop (const char *id);
 
+/*-----------------------------------------
+ * pool.c
+ */
+void pool_retain (vmi_pool_t pool);
+void pool_release (vmi_pool_t pool);
+void *pool_shared_get (vmi_pool_t pool, const char *key);
+void *pool_shared_add (vmi_pool_t pool, const char *key, void *data, void (*release)(void *));
+
 #endif /* PRIVATE_H */
@@ -0,0 +1,232 @@
+/* The LibVMI Library is an introspection library that simplifies access to 
+ * memory in a target virtual machine or in a file containing a dump of 
+ * a system's physical memory.  LibVMI is based on the XenAccess Library.
+ *
+ * Copyright 2011 Sandia Corporation. Under the terms of Contract
+ * DE-AC04-94AL85000 with Sandia Corporation, the U.S. Government
+ * retains certain rights in this software.
+ *
+ * Author: Bryan D. Payne (bdpayne@acm.org)
+ *
+ * This file is part of LibVMI.
+ *
+ * LibVMI is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * LibVMI is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public
+ * License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with LibVMI.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Page table page scanner.  Classifies all 512 entries of a 4KB table page
+// of 8-byte entries in one pass, returning one bitmask per class instead of
+// testing each entry through vmi_get_bit.  Most entries in a typical table
+// are zero, so callers can visit only the set bits.  An SSE2 kernel is the
+// x86-64 baseline; an AVX2 kernel is selected at runtime when available.
+
+#include "libvmi.h"
+#include "private.h"
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__SSE2__)
+#define PT_SCAN_SSE2 1
+#include <emmintrin.h>
+#endif
+
+#if defined(__x86_64__) && defined(__GNUC__) && \
+    (__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9))
+#define PT_SCAN_AVX2 1
+#include <immintrin.h>
+#endif
+
+#define PTE_BIT_PRESENT  0
+#define PTE_BIT_ACCESSED 5
+#define PTE_BIT_DIRTY    6
+#define PTE_BIT_LARGE    7
+
+#ifndef PT_SCAN_SSE2
+static void pt_scan_scalar (const uint64_t *table, pt_scan_t *scan)
+{
+    int w = 0, i = 0;
+
+    for (w = 0; w < PT_SCAN_WORDS; ++w){
+        uint64_t present = 0, large = 0, accessed = 0, dirty = 0, nonzero = 0;
+
+        for (i = 0; i < 64; ++i){
+            uint64_t entry = table[w * 64 + i];
+            present  |= ((entry >> PTE_BIT_PRESENT) & 1) << i;
+            large    |= ((entry >> PTE_BIT_LARGE) & 1) << i;
+            accessed |= ((entry >> PTE_BIT_ACCESSED) & 1) << i;
+            dirty    |= ((entry >> PTE_BIT_DIRTY) & 1) << i;
+            nonzero  |= (uint64_t) (entry != 0) << i;
+        }
+        scan->present[w] = present;
+        scan->large[w] = large & present;
+        scan->accessed[w] = accessed & present;
+        scan->dirty[w] = dirty & present;
+        scan->swap[w] = nonzero & ~present;
+    }
+}
+#endif
+
+#ifdef PT_SCAN_SSE2
+/* Narrow 16 qword lanes to one byte each, keeping them in order.  Each
+ * pack halves the lane width; the lanes hold either a value masked to its
+ * low byte (narrowed unsigned) or all-ones / all-zero (narrowed signed),
+ * so none of the packs saturate. */
+static inline __m128i sse2_narrow16 (const __m128i *v, int is_signed)
+{
+    __m128i a = _mm_packs_epi32(v[0], v[1]);
+    __m128i b = _mm_packs_epi32(v[2], v[3]);
+    __m128i c = _mm_packs_epi32(v[4], v[5]);
+    __m128i d = _mm_packs_epi32(v[6], v[7]);
+    a = _mm_packs_epi32(a, b);
+    c = _mm_packs_epi32(c, d);
+    return is_signed ? _mm_packs_epi16(a, c) : _mm_packus_epi16(a, c);
+}
+
+/* one mask bit per byte after moving bit b to the top of each byte */
+#define SSE2_BITS(bytes, b) \
+    ((uint64_t) (uint16_t) _mm_movemask_epi8(_mm_slli_epi16((bytes), 7 - (b))))
+
+static void pt_scan_sse2 (const uint64_t *table, pt_scan_t *scan)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i low = _mm_set_epi32(0, 0xFF, 0, 0xFF);
+    __m128i lo[8], eq[8];
+    int w = 0, i = 0, j = 0;
+
+    for (w = 0; w < PT_SCAN_WORDS; ++w){
+        uint64_t present = 0, large = 0, accessed = 0, dirty = 0, iszero = 0;
+
+        for (i = 0; i < 64; i += 16){
+            __m128i bytes, zeros;
+
+            for (j = 0; j < 8; ++j){
+                __m128i v = _mm_loadu_si128((const __m128i *) &table[w * 64 + i + j * 2]);
+
+                /* no 64-bit compare in SSE2, so AND the two 32-bit halves */
+                __m128i e = _mm_cmpeq_epi32(v, zero);
+                eq[j] = _mm_and_si128(e, _mm_shuffle_epi32(e, _MM_SHUFFLE(2, 3, 0, 1)));
+                lo[j] = _mm_and_si128(v, low);
+            }
+            bytes = sse2_narrow16(lo, 0);
+            zeros = sse2_narrow16(eq, 1);
+
+            present  |= SSE2_BITS(bytes, PTE_BIT_PRESENT) << i;
+            large    |= SSE2_BITS(bytes, PTE_BIT_LARGE) << i;
+            accessed |= SSE2_BITS(bytes, PTE_BIT_ACCESSED) << i;
+            dirty    |= SSE2_BITS(bytes, PTE_BIT_DIRTY) << i;
+            iszero   |= (uint64_t) (uint16_t) _mm_movemask_epi8(zeros) << i;
+        }
+        scan->present[w] = present;
+        scan->large[w] = large & present;
+        scan->accessed[w] = accessed & present;
+        scan->dirty[w] = dirty & present;
+        scan->swap[w] = ~iszero & ~present;
+    }
+}
+#endif
+
+#ifdef PT_SCAN_AVX2
+/* The AVX2 packs work within each 128-bit lane.  Loading entries 4j..4j+1
+ * and 4j+4..4j+5 into one register, and 4j+2..4j+3 and 4j+6..4j+7 into the
+ * next, leaves every 4 bytes of the narrowed result holding 4 consecutive
+ * entries, so a single dword permute puts all 32 in order. */
+__attribute__((target("avx2")))
+static inline __m256i avx2_load_pair (const uint64_t *lo, const uint64_t *hi)
+{
+    return _mm256_inserti128_si256(
+        _mm256_castsi128_si256(_mm_loadu_si128((const __m128i *) lo)),
+        _mm_loadu_si128((const __m128i *) hi), 1);
+}
+
+__attribute__((target("avx2")))
+static inline __m256i avx2_narrow32 (const __m256i *v, int is_signed)
+{
+    __m256i a = _mm256_packs_epi32(v[0], v[1]);
+    __m256i b = _mm256_packs_epi32(v[2], v[3]);
+    __m256i c = _mm256_packs_epi32(v[4], v[5]);
+    __m256i d = _mm256_packs_epi32(v[6], v[7]);
+    a = _mm256_packs_epi32(a, b);
+    c = _mm256_packs_epi32(c, d);
+    a = is_signed ? _mm256_packs_epi16(a, c) : _mm256_packus_epi16(a, c);
+    return _mm256_permutevar8x32_epi32(a, _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7));
+}
+
+#define AVX2_BITS(bytes, b) \
+    ((uint64_t) (uint32_t) _mm256_movemask_epi8(_mm256_slli_epi16((bytes), 7 - (b))))
+
+__attribute__((target("avx2")))
+static void pt_scan_avx2 (const uint64_t *table, pt_scan_t *scan)
+{
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i low = _mm256_set1_epi64x(0xFF);
+    __m256i lo[8], eq[8];
+    int w = 0, i = 0, j = 0;
+
+    for (w = 0; w < PT_SCAN_WORDS; ++w){
+        uint64_t present = 0, large = 0, accessed = 0, dirty = 0, iszero = 0;
+
+        for (i = 0; i < 64; i += 32){
+            const uint64_t *base = &table[w * 64 + i];
+            __m256i bytes, zeros;
+
+            for (j = 0; j < 8; ++j){
+                const uint64_t *e = base + (j / 2) * 8 + (j % 2) * 2;
+                __m256i v = avx2_load_pair(e, e + 4);
+                eq[j] = _mm256_cmpeq_epi64(v, zero);
+                lo[j] = _mm256_and_si256(v, low);
+            }
+            bytes = avx2_narrow32(lo, 0);
+            zeros = avx2_narrow32(eq, 1);
+
+            present  |= AVX2_BITS(bytes, PTE_BIT_PRESENT) << i;
+            large    |= AVX2_BITS(bytes, PTE_BIT_LARGE) << i;
+            accessed |= AVX2_BITS(bytes, PTE_BIT_ACCESSED) << i;
+            dirty    |= AVX2_BITS(bytes, PTE_BIT_DIRTY) << i;
+            iszero   |= (uint64_t) (uint32_t) _mm256_movemask_epi8(zeros) << i;
+        }
+        scan->present[w] = present;
+        scan->large[w] = large & present;
+        scan->accessed[w] = accessed & present;
+        scan->dirty[w] = dirty & present;
+        scan->swap[w] = ~iszero & ~present;
+    }
+}
+#endif
+
+typedef void (*pt_scan_func_t) (const uint64_t *table, pt_scan_t *scan);
+static pt_scan_func_t pt_scan_func = NULL;
+
+/* pick the widest kernel the cpu supports, once */
+static pt_scan_func_t pt_scan_select (void)
+{
+#ifdef PT_SCAN_AVX2
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")){
+        dbprint("--PT scan: using AVX2\n");
+        return pt_scan_avx2;
+    }
+#endif
+#ifdef PT_SCAN_SSE2
+    dbprint("--PT scan: using SSE2\n");
+    return pt_scan_sse2;
+#else
+    return pt_scan_scalar;
+#endif
+}
+
+void pt_scan_page (const uint64_t *table, pt_scan_t *scan)
+{
+    if (!pt_scan_func){
+        pt_scan_func = pt_scan_select();
+    }
+    pt_scan_func(table, scan);
+}
@@ -27,6 +27,7 @@
 #include "libvmi.h"
 #include "private.h"
 #include "driver/interface.h"
+#include "driver/memory_cache.h"
 #include <string.h>
 #include <wchar.h>
 #include <iconv.h> // conversion between character sets
@@ -35,8 +36,60 @@
 ///////////////////////////////////////////////////////////
 // Classic read functions for access to memory
 
+#define READ_UNLOCKED_MIN 512   /* shorter copies are done under the read lock */
+
+/* Used while worker threads read guest memory at once.  The lock is held
+ * only to find or fetch a page and pin it in the page cache; the copy out
+ * is done with the lock dropped, so threads reading pages that are already
+ * cached mostly run in parallel.  The pin keeps the page from being evicted
+ * or refreshed under the copy.  Drivers and the cache index are still used
+ * by one thread at a time.  Short copies, and pages that could not be
+ * pinned (the cache is disabled, or the driver bypasses it), are done
+ * under the lock, since pinning costs more than copying a few words. */
+static size_t read_pa_concurrent (vmi_instance_t vmi, addr_t paddr, void *buf, size_t count, uint32_t flags)
+{
+    size_t buf_offset = 0;
+
+    while (count > 0){
+        addr_t phys_address = paddr + buf_offset;
+        addr_t pfn = phys_address >> vmi->page_shift;
+        addr_t offset = (vmi->page_size - 1) & phys_address;
+        size_t read_len = ((offset + count) > vmi->page_size) ? vmi->page_size - offset : count;
+        unsigned char *memory = NULL;
+
+        pthread_mutex_lock(&vmi->read_lock);
+        memory_cache_batch_begin(vmi, flags & VMI_READ_FRESH);
+        memory = vmi_read_page(vmi, pfn);
+        memory_cache_batch_end(vmi);
+        if (NULL == memory){
+            pthread_mutex_unlock(&vmi->read_lock);
+            break;
+        }
+        if (read_len < READ_UNLOCKED_MIN || VMI_FAILURE == memory_cache_pin(vmi, pfn << vmi->page_shift)){
+            memcpy(((char *) buf) + buf_offset, memory + offset, read_len);
+            pthread_mutex_unlock(&vmi->read_lock);
+        }
+        else{
+            pthread_mutex_unlock(&vmi->read_lock);
+            memcpy(((char *) buf) + buf_offset, memory + offset, read_len);
+            pthread_mutex_lock(&vmi->read_lock);
+            memory_cache_unpin(vmi, pfn << vmi->page_shift);
+            pthread_mutex_unlock(&vmi->read_lock);
+        }
+
+        count -= read_len;
+        buf_offset += read_len;
+    }
+    return buf_offset;
+}
+
 // Reads memory at a guest's physical address
 size_t vmi_read_pa (vmi_instance_t vmi, addr_t paddr, void *buf, size_t count)
+{
+    return vmi_read_pa_flags(vmi, paddr, buf, count, 0);
+}
+
+size_t vmi_read_pa_flags (vmi_instance_t vmi, addr_t paddr, void *buf, size_t count, uint32_t flags)
 {
     //TODO not sure how to best handle this with respect to page size.  Is this hypervisor dependent?
     //  For example, the pfn for a given paddr should vary based on the size of the page where the
@@ -49,6 +102,11 @@ size_t vmi_read_pa (vmi_instance_t vmi, addr_t paddr, void *buf, size_t count)
     addr_t offset = 0;
     size_t buf_offset = 0;
 
+    if (vmi->concurrent){
+        return read_pa_concurrent(vmi, paddr, buf, count, flags);
+    }
+    memory_cache_batch_begin(vmi, flags & VMI_READ_FRESH);
+
     while (count > 0){
         size_t read_len = 0;
 
@@ -58,7 +116,7 @@ size_t vmi_read_pa (vmi_instance_t vmi, addr_t paddr, void *buf, size_t count)
         offset = (vmi->page_size - 1) & phys_address;
         memory = vmi_read_page(vmi, pfn);
         if (NULL == memory){
-            return buf_offset;
+            break;
         }
 
         /* determine how much we can read */
@@ -77,10 +135,16 @@ size_t vmi_read_pa (vmi_instance_t vmi, addr_t paddr, void *buf, size_t count)
         buf_offset += read_len;
     }
 
+    memory_cache_batch_end(vmi);
     return buf_offset;
 }
 
 size_t vmi_read_va (vmi_instance_t vmi, addr_t vaddr, int pid, void *buf, size_t count)
+{
+    return vmi_read_va_flags(vmi, vaddr, pid, buf, count, 0);
+}
+
+size_t vmi_read_va_flags (vmi_instance_t vmi, addr_t vaddr, int pid, void *buf, size_t count, uint32_t flags)
 {
     unsigned char *memory = NULL;
     addr_t paddr = 0;
@@ -93,6 +157,7 @@ size_t vmi_read_va (vmi_instance_t vmi, addr_t vaddr, int pid, void *buf, size_t
         return 0;
     }
 
+    memory_cache_batch_begin(vmi, flags & VMI_READ_FRESH);
     while (count > 0){
         size_t read_len = 0;
         if (pid){
@@ -103,7 +168,7 @@ size_t vmi_read_va (vmi_instance_t vmi, addr_t vaddr, int pid, void *buf, size_t
         }
 
         if (!paddr) {
-            return buf_offset;
+            break;
         }
 
         /* access the memory */
@@ -111,7 +176,7 @@ size_t vmi_read_va (vmi_instance_t vmi, addr_t vaddr, int pid, void *buf, size_t
         offset = (vmi->page_size - 1) & paddr;
         memory = vmi_read_page(vmi, pfn);
         if (NULL == memory){
-            return buf_offset;
+            break;
         }
 
         /* determine how much we can read */
@@ -129,10 +194,175 @@ size_t vmi_read_va (vmi_instance_t vmi, addr_t vaddr, int pid, void *buf, size_t
         count -= read_len;
         buf_offset += read_len;
     }
+    memory_cache_batch_end(vmi);
 
     return buf_offset;
 }
 
+// One page sized piece of a vmi_read_va_iov request
+struct iov_chunk{
+    addr_t pa;
+    size_t req;                 // index of the request
+    size_t offset;              // into the request
+    uint32_t len;
+    int ok;
+};
+
+static int iov_chunk_compare (const void *a, const void *b)
+{
+    addr_t pa_a = ((const struct iov_chunk *) a)->pa;
+    addr_t pa_b = ((const struct iov_chunk *) b)->pa;
+    return (pa_a > pa_b) - (pa_a < pa_b);
+}
+
+status_t vmi_read_va_iov (vmi_instance_t vmi, addr_t dtb, const vmi_iov_t *req, size_t n, size_t *done)
+{
+    struct iov_chunk *chunks = NULL;
+    addr_t *va = NULL;
+    addr_t *pa = NULL;
+    size_t nchunks = 0, i = 0, j = 0;
+    status_t ret = VMI_SUCCESS;
+
+    if (!req || !done){
+        dbprint("--%s: bad arguments, returning without read\n", __FUNCTION__);
+        return VMI_FAILURE;
+    }
+    if (!dtb){
+        dtb = vmi->kpgd;
+    }
+
+    /* split every request at page boundaries */
+    for (i = 0; i < n; ++i){
+        done[i] = req[i].len;
+        if (req[i].len){
+            addr_t first = req[i].va >> vmi->page_shift;
+            addr_t last = (req[i].va + req[i].len - 1) >> vmi->page_shift;
+            nchunks += last - first + 1;
+        }
+    }
+    if (!nchunks){
+        return VMI_SUCCESS;
+    }
+    if (!dtb){
+        dbprint("--%s: no dtb, returning without read\n", __FUNCTION__);
+        memset(done, 0, n * sizeof(size_t));
+        return VMI_FAILURE;
+    }
+    chunks = (struct iov_chunk *) safe_malloc(nchunks * sizeof(struct iov_chunk));
+    va = (addr_t *) safe_malloc(nchunks * sizeof(addr_t));
+    pa = (addr_t *) safe_malloc(nchunks * sizeof(addr_t));
+
+    for (i = 0, j = 0; i < n; ++i){
+        size_t offset = 0;
+        while (offset < req[i].len){
+            addr_t vaddr = req[i].va + offset;
+            size_t in_page = vmi->page_size - (vaddr & (vmi->page_size - 1));
+            chunks[j].req = i;
+            chunks[j].offset = offset;
+            chunks[j].len = (req[i].len - offset < in_page) ? req[i].len - offset : in_page;
+            chunks[j].ok = 0;
+            va[j] = vaddr;
+            offset += chunks[j].len;
+            j++;
+        }
+    }
+
+    /* translate everything together, then fetch each frame once */
+    memory_cache_batch_begin(vmi, 0);
+    vmi_translate_batch(vmi, dtb, va, nchunks, pa);
+    for (j = 0; j < nchunks; ++j){
+        chunks[j].pa = pa[j];
+    }
+    qsort(chunks, nchunks, sizeof(struct iov_chunk), iov_chunk_compare);
+
+    for (j = 0; j < nchunks; ){
+        addr_t pfn = chunks[j].pa >> vmi->page_shift;
+        unsigned char *memory = chunks[j].pa ? vmi_read_page(vmi, pfn) : NULL;
+        for (; j < nchunks && (chunks[j].pa >> vmi->page_shift) == pfn; ++j){
+            if (memory && chunks[j].pa){
+                memcpy((char *) req[chunks[j].req].dst + chunks[j].offset,
+                       memory + (chunks[j].pa & (vmi->page_size - 1)), chunks[j].len);
+                chunks[j].ok = 1;
+            }
+        }
+    }
+    memory_cache_batch_end(vmi);
+
+    /* a request counts as read up to its first missing chunk */
+    for (j = 0; j < nchunks; ++j){
+        size_t r = chunks[j].req;
+        if (!chunks[j].ok && chunks[j].offset < done[r]){
+            done[r] = chunks[j].offset;
+        }
+    }
+    for (i = 0; i < n; ++i){
+        if (done[i] < req[i].len){
+            ret = VMI_FAILURE;
+        }
+    }
+
+    free(pa);
+    free(va);
+    free(chunks);
+    return ret;
+}
+
+status_t vmi_page_pin (vmi_instance_t vmi, addr_t pfn, void **ptr)
+{
+    status_t ret = VMI_FAILURE;
+    void *memory = NULL;
+
+    if (vmi->concurrent){
+        pthread_mutex_lock(&vmi->read_lock);
+    }
+    memory = vmi_read_page(vmi, pfn);
+    if (NULL != memory && VMI_SUCCESS == memory_cache_pin(vmi, pfn << vmi->page_shift)){
+        *ptr = memory;
+        ret = VMI_SUCCESS;
+    }
+    if (vmi->concurrent){
+        pthread_mutex_unlock(&vmi->read_lock);
+    }
+    return ret;
+}
+
+status_t vmi_page_pin_va (vmi_instance_t vmi, addr_t vaddr, int pid, void **ptr, addr_t *pfn)
+{
+    addr_t paddr = 0;
+    void *memory = NULL;
+
+    if (pid){
+        paddr = vmi_translate_uv2p(vmi, vaddr, pid);
+    }
+    else{
+        paddr = vmi_translate_kv2p(vmi, vaddr);
+    }
+    if (!paddr){
+        return VMI_FAILURE;
+    }
+
+    if (VMI_FAILURE == vmi_page_pin(vmi, paddr >> vmi->page_shift, &memory)){
+        return VMI_FAILURE;
+    }
+    *ptr = (unsigned char *) memory + (paddr & (vmi->page_size - 1));
+    *pfn = paddr >> vmi->page_shift;
+    return VMI_SUCCESS;
+}
+
+status_t vmi_page_unpin (vmi_instance_t vmi, addr_t pfn)
+{
+    status_t ret = VMI_FAILURE;
+
+    if (vmi->concurrent){
+        pthread_mutex_lock(&vmi->read_lock);
+    }
+    ret = memory_cache_unpin(vmi, pfn << vmi->page_shift);
+    if (vmi->concurrent){
+        pthread_mutex_unlock(&vmi->read_lock);
+    }
+    return ret;
+}
+
 size_t vmi_read_ksym (vmi_instance_t vmi, char *sym, void *buf, size_t count)
 {
     addr_t vaddr = vmi_translate_ksym2v(vmi, sym);
@@ -0,0 +1,348 @@
+/* The LibVMI Library is an introspection library that simplifies access to 
+ * memory in a target virtual machine or in a file containing a dump of 
+ * a system's physical memory.  LibVMI is based on the XenAccess Library.
+ *
+ * Copyright 2011 Sandia Corporation. Under the terms of Contract
+ * DE-AC04-94AL85000 with Sandia Corporation, the U.S. Government
+ * retains certain rights in this software.
+ *
+ * Author: Bryan D. Payne (bdpayne@acm.org)
+ *
+ * This file is part of LibVMI.
+ *
+ * LibVMI is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * LibVMI is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public
+ * License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with LibVMI.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Reverse map from guest frame numbers to the virtual pages that map them,
+// built from full walks of a set of address spaces.
+//
+// The index is two compressed sparse row tables.  Each has a pool of
+// entries grouped by frame and offsets into it for every frame, so the
+// mappings of a frame are pool[offset[frame]] to pool[offset[frame + 1] - 1].
+// The offsets are kept in leaves of RMAP_LEAF frames, found through a hash
+// table keyed by leaf number, and only leaves with a mapping in them are
+// allocated, so a stray frame high up in the physical address space (a
+// garbage PTE, say) costs one leaf rather than a pointer for every leaf
+// below it.  Offsets in a leaf are 32-bit and relative to a 64-bit base,
+// so the pool can hold more than 4G entries.
+// 4KB pages go in a table indexed by gfn.  Large pages go in a table
+// indexed by 2MB superframe (gfn >> 9), with one entry per superframe they
+// cover, so a 1GB page costs 512 entries instead of 262144.
+
+#include "libvmi.h"
+#include "private.h"
+#include <string.h>
+#include <stdlib.h>
+
+#define RMAP_SUPER_SHIFT 9      /* 4KB frames per 2MB superframe */
+#define RMAP_LEAF_SHIFT 9
+#define RMAP_LEAF (1ULL << RMAP_LEAF_SHIFT)
+#define RMAP_MAX_LEAVES (1ULL << 24)   // 32TB of 4KB frames
+
+/* one mapping of a frame, or of a superframe for large pages */
+struct rmap_record{
+    addr_t va;                  /**< va of the (super)frame */
+    uint32_t dtb;               /**< index into the dtbs array */
+    uint8_t level;
+    uint8_t flags;
+};
+
+/* offsets into the pool for RMAP_LEAF consecutive frames */
+struct rmap_index_leaf{
+    uint64_t index;             /**< frame >> RMAP_LEAF_SHIFT, the hash key */
+    uint64_t base;
+    uint32_t offsets[RMAP_LEAF + 1];    /**< relative to base */
+};
+
+/* records for one table, collected during the walks and then sorted */
+struct rmap_table{
+    uint64_t *keys;             /**< frame of each collected record */
+    struct rmap_record *records;
+    size_t count;
+    size_t size;
+    int failed;                 /**< a record could not be stored */
+    GHashTable *leaves;         /**< leaf number -> rmap_index_leaf */
+    struct rmap_record *pool;
+};
+
+struct vmi_rmap{
+    addr_t *dtbs;
+    size_t ndtbs;
+    uint32_t flags;
+    struct rmap_table small;
+    struct rmap_table large;
+};
+
+/* state for the walk of one address space */
+struct rmap_walk{
+    struct vmi_rmap *rmap;
+    uint32_t dtb;
+};
+
+static void rmap_table_add (struct rmap_table *table, uint64_t key, addr_t va, uint32_t dtb, int level, uint32_t flags)
+{
+    if (table->failed){
+        return;
+    }
+    if ((key >> RMAP_LEAF_SHIFT) >= RMAP_MAX_LEAVES){
+        dbprint("--RMAP: frame 0x%llx is beyond the index\n", key);
+        return;
+    }
+    if (table->count == table->size){
+        size_t size = table->size ? table->size * 2 : 4096;
+        uint64_t *keys = realloc(table->keys, size * sizeof(uint64_t));
+        struct rmap_record *records = NULL;
+
+        if (keys){
+            table->keys = keys;
+        }
+        if (!keys || (records = realloc(table->records, size * sizeof(struct rmap_record))) == NULL){
+            errprint("Failed to grow the reverse map to %lu entries.\n", (unsigned long) size);
+            table->failed = 1;
+            return;
+        }
+        table->records = records;
+        table->size = size;
+    }
+    table->keys[table->count] = key;
+    table->records[table->count].va = va;
+    table->records[table->count].dtb = dtb;
+    table->records[table->count].level = level;
+    table->records[table->count].flags = flags;
+    table->count++;
+}
+
+static struct rmap_index_leaf *rmap_table_leaf (struct rmap_table *table, uint64_t key)
+{
+    uint64_t index = key >> RMAP_LEAF_SHIFT;
+    return (struct rmap_index_leaf *) g_hash_table_lookup(table->leaves, &index);
+}
+
+/* running total of the pool while the leaves are laid out in it */
+struct rmap_layout{
+    uint64_t total;
+    int failed;
+};
+
+/* sets where each frame of the leaf starts, leaving offsets[f] at the start of f */
+static void rmap_leaf_layout (gpointer key, gpointer value, gpointer data)
+{
+    struct rmap_index_leaf *leaf = (struct rmap_index_leaf *) value;
+    struct rmap_layout *layout = (struct rmap_layout *) data;
+    uint64_t sum = 0;
+    int f = 0;
+
+    leaf->base = layout->total;
+    for (f = 0; f < RMAP_LEAF; ++f){
+        sum += leaf->offsets[f + 1];
+        if (sum > UINT32_MAX){
+            errprint("Too many reverse map entries for frame 0x%llx.\n", (leaf->index << RMAP_LEAF_SHIFT) + f);
+            layout->failed = 1;
+            return;
+        }
+        leaf->offsets[f + 1] = sum;
+    }
+    layout->total += sum;
+}
+
+/* shifts the offsets back up by one once the records are placed */
+static void rmap_leaf_shift (gpointer key, gpointer value, gpointer data)
+{
+    struct rmap_index_leaf *leaf = (struct rmap_index_leaf *) value;
+
+    memmove(leaf->offsets + 1, leaf->offsets, RMAP_LEAF * sizeof(uint32_t));
+    leaf->offsets[0] = 0;
+}
+
+/* counting sort of the collected records into the leaves and pool */
+static status_t rmap_table_finish (struct rmap_table *table)
+{
+    struct rmap_layout layout = { 0, 0 };
+    struct rmap_index_leaf *leaf = NULL;
+    size_t i = 0;
+
+    if (table->failed){
+        return VMI_FAILURE;
+    }
+
+    /* count the records of each frame, in the leaves that have any */
+    table->leaves = g_hash_table_new_full(g_int64_hash, g_int64_equal, NULL, free);
+    for (i = 0; i < table->count; ++i){
+        uint64_t key = table->keys[i];
+
+        if ((leaf = rmap_table_leaf(table, key)) == NULL){
+            leaf = (struct rmap_index_leaf *) safe_malloc(sizeof(struct rmap_index_leaf));
+            memset(leaf, 0, sizeof(struct rmap_index_leaf));
+            leaf->index = key >> RMAP_LEAF_SHIFT;
+            g_hash_table_insert(table->leaves, &leaf->index, leaf);
+        }
+        leaf->offsets[(key & (RMAP_LEAF - 1)) + 1]++;
+    }
+
+    /* the leaves take consecutive ranges of the pool, in any order */
+    g_hash_table_foreach(table->leaves, rmap_leaf_layout, &layout);
+    if (layout.failed){
+        return VMI_FAILURE;
+    }
+
+    /* place the records, moving each offsets[f] to the end of frame f */
+    table->pool = (struct rmap_record *) safe_malloc((table->count ? table->count : 1) * sizeof(struct rmap_record));
+    for (i = 0; i < table->count; ++i){
+        uint64_t key = table->keys[i];
+
+        leaf = rmap_table_leaf(table, key);
+        table->pool[leaf->base + leaf->offsets[key & (RMAP_LEAF - 1)]++] = table->records[i];
+    }
+    g_hash_table_foreach(table->leaves, rmap_leaf_shift, NULL);
+
+    free(table->keys);
+    free(table->records);
+    table->keys = NULL;
+    table->records = NULL;
+    return VMI_SUCCESS;
+}
+
+static void rmap_table_free (struct rmap_table *table)
+{
+    if (table->keys) free(table->keys);
+    if (table->records) free(table->records);
+    if (table->leaves) g_hash_table_destroy(table->leaves);
+    if (table->pool) free(table->pool);
+}
+
+static void rmap_leaf (vmi_instance_t vmi, addr_t va, addr_t pa, addr_t size,
+    uint32_t flags, addr_t location, uint64_t entry, void *data)
+{
+    struct rmap_walk *walk = (struct rmap_walk *) data;
+    struct vmi_rmap *rmap = walk->rmap;
+    uint64_t sf = 0, nsf = 0, i = 0;
+
+    if ((rmap->flags & VMI_RMAP_USER) && !(flags & VMI_MAP_USER)){
+        return;
+    }
+
+    if (size == 0x1000){
+        rmap_table_add(&rmap->small, pa >> 12, va, walk->dtb, 1, flags);
+        return;
+    }
+
+    /* large pages are aligned to their size, so they cover whole superframes */
+    sf = pa >> (12 + RMAP_SUPER_SHIFT);
+    nsf = size >> (12 + RMAP_SUPER_SHIFT);
+    for (i = 0; i < nsf; ++i){
+        rmap_table_add(&rmap->large, sf + i, va + (i << (12 + RMAP_SUPER_SHIFT)),
+            walk->dtb, (size > 0x400000) ? 3 : 2, flags);
+    }
+}
+
+vmi_rmap_t vmi_rmap_build (vmi_instance_t vmi, const addr_t *dtbs, size_t n, uint32_t flags)
+{
+    struct vmi_rmap *rmap = NULL;
+    struct rmap_walk walk;
+    uint64_t roots[8], shared[4], kshared[4] = { 0, 0, 0, 0 };
+    int kpgd_walked = 0;
+    size_t i = 0;
+    int w = 0;
+
+    if (!dtbs){
+        return NULL;
+    }
+
+    rmap = (struct vmi_rmap *) safe_malloc(sizeof(struct vmi_rmap));
+    memset(rmap, 0, sizeof(struct vmi_rmap));
+    rmap->flags = flags;
+    rmap->ndtbs = n;
+    rmap->dtbs = (addr_t *) safe_malloc((n + 1) * sizeof(addr_t));
+    memcpy(rmap->dtbs, dtbs, n * sizeof(addr_t));
+
+    /* kernel half PML4 entries shared with kpgd are left out of each
+     * process walk and indexed once, under kpgd */
+    walk.rmap = rmap;
+    for (i = 0; i < n; ++i){
+        memset(roots, 0xFF, sizeof(roots));
+        kernel_share_mask(vmi, dtbs[i], shared);
+        for (w = 0; w < 4; ++w){
+            roots[4 + w] &= ~shared[w];
+            kshared[w] |= shared[w];
+        }
+        if (vmi->kpgd && dtbs[i] == vmi->kpgd){
+            kpgd_walked = 1;
+        }
+
+        walk.dtb = i;
+        if (VMI_FAILURE == walk_leaves(vmi, dtbs[i], roots, rmap_leaf, &walk)){
+            dbprint("--RMAP: failed to walk dtb 0x%.16llx\n", dtbs[i]);
+        }
+    }
+    if (!kpgd_walked && (kshared[0] | kshared[1] | kshared[2] | kshared[3])){
+        memset(roots, 0, 4 * sizeof(uint64_t));
+        memcpy(roots + 4, kshared, sizeof(kshared));
+        rmap->dtbs[rmap->ndtbs] = vmi->kpgd;
+        walk.dtb = rmap->ndtbs++;
+        if (VMI_FAILURE == walk_leaves(vmi, vmi->kpgd, roots, rmap_leaf, &walk)){
+            dbprint("--RMAP: failed to walk kpgd 0x%.16llx\n", vmi->kpgd);
+        }
+    }
+
+    if (VMI_FAILURE == rmap_table_finish(&rmap->small) ||
+        VMI_FAILURE == rmap_table_finish(&rmap->large)){
+        vmi_rmap_destroy(rmap);
+        return NULL;
+    }
+    dbprint("--RMAP: %lu small and %lu large entries for %lu address spaces\n",
+        (unsigned long) rmap->small.count, (unsigned long) rmap->large.count, (unsigned long) n);
+    return rmap;
+}
+
+void vmi_rmap_destroy (vmi_rmap_t rmap)
+{
+    if (rmap){
+        rmap_table_free(&rmap->small);
+        rmap_table_free(&rmap->large);
+        free(rmap->dtbs);
+        free(rmap);
+    }
+}
+
+static size_t rmap_table_lookup (struct vmi_rmap *rmap, struct rmap_table *table, uint64_t key,
+    addr_t offset, vmi_rmap_entry_t *out, size_t max, size_t found)
+{
+    struct rmap_index_leaf *leaf = NULL;
+    uint64_t i = 0, end = 0;
+
+    if ((leaf = rmap_table_leaf(table, key)) == NULL){
+        return found;
+    }
+    i = leaf->base + leaf->offsets[key & (RMAP_LEAF - 1)];
+    end = leaf->base + leaf->offsets[(key & (RMAP_LEAF - 1)) + 1];
+    for (; i < end; ++i, ++found){
+        if (found < max){
+            out[found].dtb = rmap->dtbs[table->pool[i].dtb];
+            out[found].va = table->pool[i].va + offset;
+            out[found].level = table->pool[i].level;
+            out[found].flags = table->pool[i].flags;
+        }
+    }
+    return found;
+}
+
+size_t vmi_rmap_lookup (vmi_rmap_t rmap, uint64_t gfn, vmi_rmap_entry_t *out, size_t max)
+{
+    size_t found = 0;
+
+    found = rmap_table_lookup(rmap, &rmap->small, gfn, 0, out, max, found);
+    found = rmap_table_lookup(rmap, &rmap->large, gfn >> RMAP_SUPER_SHIFT,
+        (gfn & ((1ULL << RMAP_SUPER_SHIFT) - 1)) << 12, out, max, found);
+    return found;
+}
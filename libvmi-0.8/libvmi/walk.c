@@ -0,0 +1,957 @@
+/* The LibVMI Library is an introspection library that simplifies access to 
+ * memory in a target virtual machine or in a file containing a dump of 
+ * a system's physical memory.  LibVMI is based on the XenAccess Library.
+ *
+ * Copyright 2011 Sandia Corporation. Under the terms of Contract
+ * DE-AC04-94AL85000 with Sandia Corporation, the U.S. Government
+ * retains certain rights in this software.
+ *
+ * Author: Bryan D. Payne (bdpayne@acm.org)
+ *
+ * This file is part of LibVMI.
+ *
+ * LibVMI is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * LibVMI is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public
+ * License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with LibVMI.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Whole address space page table walks.  Rather than translating one page
+// at a time, these read each page table page once and visit every present
+// mapping below a directory table base in virtual address order.  The same
+// walk can also count the leaf entries of an address space by class.
+//
+// Incremental walks keep a hash and a summary of every table page seen in
+// the last walk of a dtb.  A leaf table whose hash is unchanged is not
+// decoded again, and the walk reports what changed since the last one.
+// This saves decoding, not reading: every table page is still read and
+// hashed, and upper level tables are always decoded, since a change in a
+// leaf table does not show up in the entry that points to it.  A table
+// reached more than once in a walk is decoded once, and its subtree counts
+// are reused for the other references, so the counts match a plain walk.
+//
+// vmi_walk_many spreads the walks of many address spaces over a pool of
+// threads.  Each thread owns a deque of tasks and steals from the others
+// when its own runs dry.  A task is an address space, or a single entry of
+// its root table once the address space has been split.  Kernel half root
+// entries that a process shares with kpgd are walked only once.
+
+#include "libvmi.h"
+#include "private.h"
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <glib.h>
+#include "glib_compat.h"
+
+/* layout of one level of the page table tree for a paging mode */
+struct pt_level{
+    int shift;          /**< vaddr bit where this level's index starts */
+    int entries;        /**< number of entries in a table at this level */
+    int entry_size;     /**< size of each entry in bytes */
+    int large_ok;       /**< nonzero if the PS bit maps a page here */
+};
+
+static const struct pt_level levels_legacy[] = {
+    { 22, 1024, 4, 1 },
+    { 12, 1024, 4, 0 }
+};
+
+static const struct pt_level levels_pae[] = {
+    { 30, 4, 8, 0 },
+    { 21, 512, 8, 1 },
+    { 12, 512, 8, 0 }
+};
+
+static const struct pt_level levels_ia32e[] = {
+    { 39, 512, 8, 0 },
+    { 30, 512, 8, 1 },
+    { 21, 512, 8, 1 },
+    { 12, 512, 8, 0 }
+};
+
+struct mapping_run{
+    addr_t va;
+    addr_t pa;
+    addr_t size;
+    uint32_t flags;
+    int valid;
+};
+
+#define TABLE_MASK_WORDS 16     /* one bit per entry, up to 1024 entries */
+
+/* what the last incremental walk saw in one page table page */
+struct table_record{
+    uint64_t hash;
+    uint64_t generation;                    /**< walk that last visited it */
+    uint64_t present[TABLE_MASK_WORDS];     /**< leaf entries that were present */
+    uint64_t swap[TABLE_MASK_WORDS];        /**< leaf entries that were swapped */
+    vmi_pte_stats_t stats;                  /**< counts for its leaf entries */
+    vmi_pte_stats_t subtree;                /**< counts for every leaf entry below it */
+    int level;                              /**< level it was decoded at */
+    int busy;                               /**< being decoded by the current walk */
+};
+
+/* state kept between incremental walks of one dtb */
+struct walk_snapshot{
+    GHashTable *tables;     /**< table physical address -> table_record */
+    uint64_t generation;
+};
+
+struct walk_state{
+    vmi_instance_t vmi;
+    const struct pt_level *levels;
+    int depth;
+    vmi_mapping_func_t func;
+    walk_leaf_func_t leaf;
+    vmi_walk_visitor_t visit;
+    void *data;
+    addr_t dtb;
+    int split;                  /**< only walk root entries first to last */
+    int first;
+    int last;
+    const uint64_t *roots;      /**< root entries to walk, one bit each, or NULL for all */
+    volatile int *abort;        /**< set by any thread to stop all walks */
+    struct mapping_run run;
+    vmi_pte_stats_t *stats;
+    struct walk_snapshot *snap;
+    vmi_pte_delta_t *delta;
+    int stop;
+};
+
+/* physical address of the next table, or of the page for a leaf entry */
+static addr_t entry_frame (struct walk_state *ws, uint64_t entry, int level, int leaf)
+{
+    int large = leaf && level < ws->depth - 1;
+
+    if (VMI_PM_LEGACY == ws->vmi->page_mode){
+        return large ? (entry & 0xFFC00000ULL) : (entry & 0xFFFFF000ULL);
+    }
+    else if (VMI_PM_PAE == ws->vmi->page_mode){
+        return large ? (entry & 0xFFFE00000ULL) : (entry & 0xFFFFFF000ULL);
+    }
+    else{
+        if (large){
+            addr_t mask = ~((1ULL << ws->levels[level].shift) - 1);
+            return entry & 0x000FFFFFFFFFF000ULL & mask;
+        }
+        return entry & 0x000FFFFFFFFFF000ULL;
+    }
+}
+
+/* effective flags after combining this entry with those above it */
+static uint32_t entry_flags (uint64_t entry, uint32_t parent)
+{
+    uint32_t flags = parent;
+
+    if (!(entry & 0x2)){
+        flags &= ~VMI_MAP_WRITE;
+    }
+    if (!(entry & 0x4)){
+        flags &= ~VMI_MAP_USER;
+    }
+    if (entry & (1ULL << 63)){
+        flags |= VMI_MAP_NX;
+    }
+    return flags;
+}
+
+static void flush_run (struct walk_state *ws)
+{
+    if (ws->abort && *ws->abort){
+        ws->stop = 1;
+    }
+    if (ws->run.valid && ws->func && !ws->stop){
+        if (VMI_FAILURE == ws->func(ws->vmi, ws->run.va, ws->run.pa, ws->run.size, ws->run.flags, ws->data)){
+            ws->stop = 1;
+        }
+    }
+    else if (ws->run.valid && ws->visit && !ws->stop){
+        if (VMI_FAILURE == ws->visit(ws->vmi, ws->dtb, ws->run.va, ws->run.pa, ws->run.size, ws->run.flags, ws->data)){
+            ws->stop = 1;
+        }
+    }
+    ws->run.valid = 0;
+}
+
+/* merge mappings that are contiguous in both va and pa with equal flags */
+static void add_mapping (struct walk_state *ws, addr_t va, addr_t pa, addr_t size, uint32_t flags)
+{
+    struct mapping_run *run = &ws->run;
+
+    if (run->valid &&
+        run->va + run->size == va &&
+        run->pa + run->size == pa &&
+        run->flags == flags){
+        run->size += size;
+        return;
+    }
+    flush_run(ws);
+    run->va = va;
+    run->pa = pa;
+    run->size = size;
+    run->flags = flags;
+    run->valid = 1;
+}
+
+/* sign extend bit 47 so that upper half addresses are canonical */
+static addr_t canonical_va (vmi_instance_t vmi, addr_t va)
+{
+    if (VMI_PM_IA32E == vmi->page_mode && (va & (1ULL << 47))){
+        va |= 0xFFFF000000000000ULL;
+    }
+    return va;
+}
+
+static void count_entry (vmi_pte_stats_t *stats, pte_class_t class)
+{
+    switch (class){
+    case VMI_PTE_PRESENT:     stats->present++;     break;
+    case VMI_PTE_EMPTY:       stats->empty++;       break;
+    case VMI_PTE_SWAP:        stats->swap++;        break;
+    case VMI_PTE_TRANSITION:  stats->transition++;  break;
+    case VMI_PTE_PROTOTYPE:   stats->prototype++;   break;
+    case VMI_PTE_DEMAND_ZERO: stats->demand_zero++; break;
+    default:                  stats->other++;       break;
+    }
+}
+
+static void stats_add (vmi_pte_stats_t *sum, const vmi_pte_stats_t *add)
+{
+    sum->present += add->present;
+    sum->large += add->large;
+    sum->empty += add->empty;
+    sum->swap += add->swap;
+    sum->transition += add->transition;
+    sum->prototype += add->prototype;
+    sum->demand_zero += add->demand_zero;
+    sum->other += add->other;
+}
+
+static void stats_sub (vmi_pte_stats_t *diff, const vmi_pte_stats_t *sub)
+{
+    diff->present -= sub->present;
+    diff->large -= sub->large;
+    diff->empty -= sub->empty;
+    diff->swap -= sub->swap;
+    diff->transition -= sub->transition;
+    diff->prototype -= sub->prototype;
+    diff->demand_zero -= sub->demand_zero;
+    diff->other -= sub->other;
+}
+
+/* record a leaf entry in the walk totals and in its table's record */
+static void note_leaf (struct walk_state *ws, struct table_record *rec, int i, pte_class_t class, int large)
+{
+    if (ws->stats){
+        count_entry(ws->stats, class);
+        ws->stats->large += large;
+    }
+    if (rec){
+        count_entry(&rec->stats, class);
+        rec->stats.large += large;
+        if (VMI_PTE_PRESENT == class){
+            rec->present[i / 64] |= 1ULL << (i % 64);
+        }
+        else if (VMI_PTE_SWAP == class){
+            rec->swap[i / 64] |= 1ULL << (i % 64);
+        }
+    }
+}
+
+static void note_empty (struct walk_state *ws, struct table_record *rec, uint64_t count)
+{
+    if (ws->stats){
+        ws->stats->empty += count;
+    }
+    if (rec){
+        rec->stats.empty += count;
+    }
+}
+
+/* Hash of a table page, in four independent lanes so that it keeps up
+ * with memory bandwidth.  The length is always a multiple of 32 bytes. */
+static uint64_t table_hash (const uint8_t *buf, size_t len)
+{
+    const uint64_t kMul = 0x9ddfea08eb382d69ULL;
+    const uint64_t *words = (const uint64_t *) buf;
+    uint64_t h[4] = { len, len ^ kMul, ~len, len * kMul };
+    size_t i = 0;
+    int k = 0;
+
+    for (i = 0; i + 4 <= len / 8; i += 4){
+        for (k = 0; k < 4; ++k){
+            h[k] = (h[k] ^ words[i + k]) * kMul;
+            h[k] ^= h[k] >> 47;
+        }
+    }
+    return (h[0] ^ (h[1] * 31) ^ (h[2] * 961) ^ (h[3] * 29791)) * kMul;
+}
+
+/* changes between what a table held at the last walk and now */
+static void delta_add (vmi_pte_delta_t *delta, const struct table_record *old, const struct table_record *rec)
+{
+    int w = 0;
+
+    for (w = 0; w < TABLE_MASK_WORDS; ++w){
+        uint64_t was = old->present[w] | old->swap[w];
+        uint64_t now = rec->present[w] | rec->swap[w];
+
+        delta->newly_present += __builtin_popcountll(rec->present[w] & ~old->present[w]);
+        delta->newly_swapped += __builtin_popcountll(rec->swap[w] & ~old->swap[w]);
+        delta->unmapped += __builtin_popcountll(was & ~now);
+    }
+}
+
+static void walk_table (struct walk_state *ws, addr_t table, int level, addr_t va_base, uint32_t parent);
+
+/* handle one nonzero entry; present and large are decoded by the caller */
+static void walk_entry (struct walk_state *ws, struct table_record *rec, addr_t table, int level, int i,
+    uint64_t entry, int present, int large, addr_t va_base, uint32_t parent)
+{
+    const struct pt_level *lvl = &ws->levels[level];
+    addr_t va = va_base | ((addr_t) i << lvl->shift);
+    uint32_t flags = 0;
+    int leaf = (level == ws->depth - 1);
+
+    if (!present){
+        if (leaf && (ws->stats || rec)){
+            note_leaf(ws, rec, i, vmi_pte_classify(ws->vmi, entry, NULL), 0);
+        }
+        return;
+    }
+
+    /* the PAE PDPT entries carry no permission bits */
+    if (VMI_PM_PAE == ws->vmi->page_mode && 0 == level){
+        flags = parent;
+    }
+    else{
+        flags = entry_flags(entry, parent);
+    }
+
+    if (!leaf && lvl->large_ok && large){
+        leaf = 1;
+        flags |= VMI_MAP_LARGE;
+    }
+
+    if (leaf){
+        note_leaf(ws, rec, i, VMI_PTE_PRESENT, (flags & VMI_MAP_LARGE) ? 1 : 0);
+        add_mapping(ws, canonical_va(ws->vmi, va), entry_frame(ws, entry, level, 1),
+            1ULL << lvl->shift, flags);
+        if (ws->leaf){
+            ws->leaf(ws->vmi, canonical_va(ws->vmi, va), entry_frame(ws, entry, level, 1),
+                1ULL << lvl->shift, flags, table + i * lvl->entry_size, entry, ws->data);
+        }
+    }
+    else{
+        walk_table(ws, entry_frame(ws, entry, level, 0), level + 1, va, flags);
+    }
+}
+
+static struct table_record *snapshot_record (struct walk_snapshot *snap, addr_t table)
+{
+    struct table_record *rec = g_hash_table_lookup(snap->tables, &table);
+
+    if (!rec){
+        addr_t *key = (addr_t *) safe_malloc(sizeof(addr_t));
+        *key = table;
+        rec = (struct table_record *) safe_malloc(sizeof(struct table_record));
+        memset(rec, 0, sizeof(struct table_record));
+        g_hash_table_insert(snap->tables, key, rec);
+    }
+    return rec;
+}
+
+static void walk_table (struct walk_state *ws, addr_t table, int level, addr_t va_base, uint32_t parent)
+{
+    const struct pt_level *lvl = &ws->levels[level];
+    size_t table_size = lvl->entries * lvl->entry_size;
+    uint8_t *buf = safe_malloc(table_size);
+    int leaf_level = (level == ws->depth - 1);
+    struct table_record *rec = NULL;
+    struct table_record old;
+    vmi_pte_stats_t before;
+    int i = 0, w = 0;
+
+    if (table_size != vmi_read_pa(ws->vmi, table, buf, table_size)){
+        dbprint("--Walk: failed to read table at 0x%.16llx\n", table);
+        goto exit;
+    }
+
+    /* a split walk covers only part of the root table */
+    if (0 == level && ws->split){
+        memset(buf, 0, ws->first * lvl->entry_size);
+        memset(buf + (ws->last + 1) * lvl->entry_size, 0, (lvl->entries - ws->last - 1) * lvl->entry_size);
+    }
+    else if (0 == level && ws->roots){
+        for (i = 0; i < lvl->entries; ++i){
+            if (!(ws->roots[i / 64] & (1ULL << (i % 64)))){
+                memset(buf + i * lvl->entry_size, 0, lvl->entry_size);
+            }
+        }
+    }
+
+    if (ws->snap){
+        uint64_t hash = table_hash(buf, table_size);
+
+        rec = snapshot_record(ws->snap, table);
+        ws->delta->tables++;
+
+        /* a table reachable twice in this walk is only decoded once, but
+         * its subtree is counted each time, as vmi_get_pte_stats does.  A
+         * table reached from inside itself (a recursive mapping) or at
+         * another level is decoded again, without a record. */
+        if (rec->generation == ws->snap->generation){
+            if (!rec->busy && rec->level == level){
+                stats_add(ws->stats, &rec->subtree);
+                goto exit;
+            }
+            rec = NULL;
+        }
+
+        /* an unchanged leaf table has nothing below it to look at */
+        else if (rec->generation && rec->hash == hash && leaf_level && rec->level == level){
+            rec->generation = ws->snap->generation;
+            rec->subtree = rec->stats;
+            stats_add(ws->stats, &rec->stats);
+            goto exit;
+        }
+
+        else{
+            if (!rec->generation || rec->hash != hash){
+                ws->delta->tables_changed++;
+            }
+            old = *rec;
+            memset(rec, 0, sizeof(struct table_record));
+            rec->hash = hash;
+            rec->generation = ws->snap->generation;
+            rec->level = level;
+            rec->busy = 1;
+            before = *ws->stats;
+        }
+    }
+
+    /* full 512 entry tables are scanned in one pass, then only the
+     * nonzero entries are visited, in order */
+    if (8 == lvl->entry_size && PT_SCAN_WORDS * 64 == lvl->entries){
+        uint64_t *entries = (uint64_t *) buf;
+        pt_scan_t scan;
+
+        pt_scan_page(entries, &scan);
+        for (w = 0; w < PT_SCAN_WORDS && !ws->stop; ++w){
+            uint64_t todo = scan.present[w] | scan.swap[w];
+
+            if (leaf_level){
+                note_empty(ws, rec, 64 - __builtin_popcountll(todo));
+            }
+            while (todo && !ws->stop){
+                uint64_t bit = todo & -todo;
+                i = w * 64 + __builtin_ctzll(todo);
+                todo ^= bit;
+                walk_entry(ws, rec, table, level, i, entries[i],
+                    (scan.present[w] & bit) != 0, (scan.large[w] & bit) != 0, va_base, parent);
+            }
+        }
+    }
+    else{
+        for (i = 0; i < lvl->entries && !ws->stop; ++i){
+            uint64_t entry = 0;
+
+            if (8 == lvl->entry_size){
+                entry = ((uint64_t *) buf)[i];
+            }
+            else{
+                entry = ((uint32_t *) buf)[i];
+            }
+
+            if (!entry){
+                if (leaf_level){
+                    note_empty(ws, rec, 1);
+                }
+                continue;
+            }
+            walk_entry(ws, rec, table, level, i, entry, entry & 0x1, (entry >> 7) & 0x1, va_base, parent);
+        }
+    }
+
+    if (rec){
+        delta_add(ws->delta, &old, rec);
+        rec->subtree = *ws->stats;
+        stats_sub(&rec->subtree, &before);
+        rec->busy = 0;
+    }
+
+exit:
+    free(buf);
+}
+
+/* set up the walk for the paging mode and return the root table */
+static addr_t walk_init (struct walk_state *ws, vmi_instance_t vmi, addr_t dtb)
+{
+    memset(ws, 0, sizeof(struct walk_state));
+    ws->vmi = vmi;
+
+    if (VMI_PM_LEGACY == vmi->page_mode){
+        ws->levels = levels_legacy;
+        ws->depth = 2;
+        return dtb & 0xFFFFF000ULL;
+    }
+    else if (VMI_PM_PAE == vmi->page_mode){
+        ws->levels = levels_pae;
+        ws->depth = 3;
+        return dtb & 0xFFFFFFE0ULL;
+    }
+    else if (VMI_PM_IA32E == vmi->page_mode){
+        ws->levels = levels_ia32e;
+        ws->depth = 4;
+        return dtb & 0x000FFFFFFFFFF000ULL;
+    }
+    errprint("Invalid paging mode during page table walk\n");
+    return 0;
+}
+
+status_t vmi_foreach_mapping (vmi_instance_t vmi, addr_t dtb, vmi_mapping_func_t func, void *data)
+{
+    struct walk_state ws;
+    addr_t root = walk_init(&ws, vmi, dtb);
+
+    if (!root || !func){
+        return VMI_FAILURE;
+    }
+    ws.func = func;
+    ws.data = data;
+
+    walk_table(&ws, root, 0, 0, VMI_MAP_WRITE | VMI_MAP_USER);
+    flush_run(&ws);
+
+    return ws.stop ? VMI_FAILURE : VMI_SUCCESS;
+}
+
+/* roots has one bit per root table entry to walk, or is NULL to walk them all */
+status_t walk_leaves (vmi_instance_t vmi, addr_t dtb, const uint64_t *roots, walk_leaf_func_t func, void *data)
+{
+    struct walk_state ws;
+    addr_t root = walk_init(&ws, vmi, dtb);
+
+    if (!root || !func){
+        return VMI_FAILURE;
+    }
+    ws.leaf = func;
+    ws.data = data;
+    ws.roots = roots;
+
+    walk_table(&ws, root, 0, 0, VMI_MAP_WRITE | VMI_MAP_USER);
+    return VMI_SUCCESS;
+}
+
+status_t vmi_get_pte_stats (vmi_instance_t vmi, addr_t dtb, vmi_pte_stats_t *stats)
+{
+    struct walk_state ws;
+    addr_t root = walk_init(&ws, vmi, dtb);
+
+    if (!root || !stats){
+        return VMI_FAILURE;
+    }
+    memset(stats, 0, sizeof(vmi_pte_stats_t));
+    ws.stats = stats;
+
+    walk_table(&ws, root, 0, 0, VMI_MAP_WRITE | VMI_MAP_USER);
+
+    dbprint("--PTE stats: %llu present, %llu swap, %llu empty\n",
+        stats->present, stats->swap, stats->empty);
+    return VMI_SUCCESS;
+}
+
+/* one address space, or one root table entry of it once split */
+struct walk_task{
+    addr_t dtb;
+    int entry;                  /**< root table entry, or -1 for all of them */
+};
+
+/* tasks[head] to tasks[tail - 1]; the owner works at the tail, thieves
+ * take from the head */
+struct walk_deque{
+    pthread_mutex_t lock;
+    struct walk_task *tasks;
+    size_t head;
+    size_t tail;
+    size_t size;
+};
+
+struct walk_pool{
+    vmi_instance_t vmi;
+    vmi_walk_visitor_t visit;
+    void *data;
+    int nworkers;
+    struct walk_deque *deques;
+    long pending;               /**< tasks queued or running */
+    pthread_mutex_t idle_lock;
+    pthread_cond_t idle_cond;   /**< signalled on new tasks, the last task done, or stop */
+    unsigned long pushes;       /**< times tasks were queued, under idle_lock */
+    volatile int stop;
+    int kshare;                 /**< kroot holds the kernel half of kpgd */
+    uint64_t kroot[256];
+    uint64_t kclaimed[4];       /**< kernel half entries already queued */
+};
+
+struct walk_worker{
+    struct walk_pool *pool;
+    int id;
+    pthread_t thread;
+};
+
+/* fails, leaving the deque as it was, if it cannot grow */
+static status_t deque_push (struct walk_deque *dq, struct walk_task *task)
+{
+    pthread_mutex_lock(&dq->lock);
+    if (dq->tail == dq->size){
+        if (dq->head){
+            memmove(dq->tasks, dq->tasks + dq->head, (dq->tail - dq->head) * sizeof(struct walk_task));
+            dq->tail -= dq->head;
+            dq->head = 0;
+        }
+        else{
+            size_t size = dq->size ? dq->size * 2 : 64;
+            struct walk_task *tasks = realloc(dq->tasks, size * sizeof(struct walk_task));
+
+            if (!tasks){
+                pthread_mutex_unlock(&dq->lock);
+                return VMI_FAILURE;
+            }
+            dq->tasks = tasks;
+            dq->size = size;
+        }
+    }
+    dq->tasks[dq->tail++] = *task;
+    pthread_mutex_unlock(&dq->lock);
+    return VMI_SUCCESS;
+}
+
+static int deque_pop (struct walk_deque *dq, struct walk_task *task, int steal)
+{
+    int found = 0;
+
+    pthread_mutex_lock(&dq->lock);
+    if (dq->head < dq->tail){
+        *task = steal ? dq->tasks[dq->head++] : dq->tasks[--dq->tail];
+        found = 1;
+    }
+    pthread_mutex_unlock(&dq->lock);
+    return found;
+}
+
+static int walk_next_task (struct walk_pool *pool, int id, struct walk_task *task)
+{
+    int i = 0;
+
+    if (deque_pop(&pool->deques[id], task, 0)){
+        return 1;
+    }
+    for (i = 1; i < pool->nworkers; ++i){
+        if (deque_pop(&pool->deques[(id + i) % pool->nworkers], task, 1)){
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* wake the idle workers; pushed counts as new tasks to look for */
+static void walk_wake (struct walk_pool *pool, int pushed)
+{
+    pthread_mutex_lock(&pool->idle_lock);
+    if (pushed){
+        pool->pushes++;
+    }
+    pthread_cond_broadcast(&pool->idle_cond);
+    pthread_mutex_unlock(&pool->idle_lock);
+}
+
+static void walk_run_task (struct walk_pool *pool, int id, struct walk_task *task);
+
+/* Split an address space into one task per present root table entry.
+ * The extra tasks go on our own deque, where idle threads can steal
+ * them; the first one is returned to be walked right away.  A task that
+ * cannot be queued is walked here instead. */
+static int walk_split (struct walk_pool *pool, int id, struct walk_state *ws, addr_t root, struct walk_task *task)
+{
+    const struct pt_level *lvl = &ws->levels[0];
+    size_t table_size = lvl->entries * lvl->entry_size;
+    uint8_t *buf = safe_malloc(table_size);
+    int i = 0, first = -1, pushed = 0;
+
+    if (table_size != vmi_read_pa(pool->vmi, root, buf, table_size)){
+        free(buf);
+        return -1;
+    }
+    for (i = 0; i < lvl->entries; ++i){
+        uint64_t entry = (8 == lvl->entry_size) ? ((uint64_t *) buf)[i] : ((uint32_t *) buf)[i];
+        struct walk_task part;
+
+        if (!(entry & 0x1)){
+            continue;
+        }
+        part.dtb = task->dtb;
+        part.entry = i;
+
+        /* shared with the kernel page tables, walked once for everyone */
+        if (pool->kshare && i >= 256 && PML4E_SAME_TABLE(entry, pool->kroot[i - 256])){
+            uint64_t bit = 1ULL << (i % 64);
+            if (__sync_fetch_and_or(&pool->kclaimed[(i - 256) / 64], bit) & bit){
+                continue;
+            }
+            part.dtb = pool->vmi->kpgd;
+        }
+        else if (first < 0){
+            first = i;
+            continue;
+        }
+        /* counted before it is visible to thieves; our own task keeps
+         * pending above zero if the push fails and it is taken back */
+        __sync_fetch_and_add(&pool->pending, 1);
+        if (VMI_FAILURE == deque_push(&pool->deques[id], &part)){
+            __sync_fetch_and_sub(&pool->pending, 1);
+            dbprint("--Walk: queue full, walking root entry %d of 0x%.16llx here\n", i, part.dtb);
+            walk_run_task(pool, id, &part);
+            continue;
+        }
+        pushed = 1;
+    }
+    free(buf);
+    if (pushed){
+        walk_wake(pool, 1);
+    }
+    return first;
+}
+
+static void walk_run_task (struct walk_pool *pool, int id, struct walk_task *task)
+{
+    struct walk_state ws;
+    addr_t root = walk_init(&ws, pool->vmi, task->dtb);
+    int entry = task->entry;
+
+    if (!root){
+        return;
+    }
+    if (entry < 0 && (entry = walk_split(pool, id, &ws, root, task)) < 0){
+        return;
+    }
+
+    ws.visit = pool->visit;
+    ws.data = pool->data;
+    ws.dtb = task->dtb;
+    ws.split = 1;
+    ws.first = entry;
+    ws.last = entry;
+    ws.abort = &pool->stop;
+
+    walk_table(&ws, root, 0, 0, VMI_MAP_WRITE | VMI_MAP_USER);
+    flush_run(&ws);
+    if (ws.stop){
+        pool->stop = 1;
+        walk_wake(pool, 0);
+    }
+}
+
+static void *walk_worker_main (void *arg)
+{
+    struct walk_worker *worker = (struct walk_worker *) arg;
+    struct walk_pool *pool = worker->pool;
+    struct walk_task task;
+    unsigned long seen = 0;
+    int done = 0;
+
+    while (!pool->stop && !done){
+        pthread_mutex_lock(&pool->idle_lock);
+        seen = pool->pushes;
+        pthread_mutex_unlock(&pool->idle_lock);
+
+        if (walk_next_task(pool, worker->id, &task)){
+            walk_run_task(pool, worker->id, &task);
+            if (0 == __sync_sub_and_fetch(&pool->pending, 1)){
+                walk_wake(pool, 0);
+            }
+            continue;
+        }
+
+        /* others may still split what they are walking, so sleep until
+         * they queue more or the last task is done */
+        pthread_mutex_lock(&pool->idle_lock);
+        while (__sync_fetch_and_add(&pool->pending, 0) && !pool->stop && pool->pushes == seen){
+            pthread_cond_wait(&pool->idle_cond, &pool->idle_lock);
+        }
+        done = !__sync_fetch_and_add(&pool->pending, 0);
+        pthread_mutex_unlock(&pool->idle_lock);
+    }
+    return NULL;
+}
+
+status_t vmi_walk_many (vmi_instance_t vmi, const addr_t *dtbs, size_t n,
+    vmi_walk_visitor_t visitor, void *data, int nthreads)
+{
+    struct walk_pool pool;
+    struct walk_worker *workers = NULL;
+    struct walk_task task;
+    size_t i = 0;
+    int w = 0;
+
+    if (!dtbs || !visitor){
+        return VMI_FAILURE;
+    }
+    if (nthreads <= 0){
+        nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+        if (nthreads <= 0){
+            nthreads = 1;
+        }
+    }
+
+    memset(&pool, 0, sizeof(struct walk_pool));
+    pool.vmi = vmi;
+    pool.visit = visitor;
+    pool.data = data;
+    pool.nworkers = nthreads;
+    if (VMI_PM_IA32E == vmi->page_mode && vmi->kpgd){
+        pool.kshare = (sizeof(pool.kroot) == vmi_read_pa(vmi,
+            (vmi->kpgd & 0x000FFFFFFFFFF000ULL) + 256 * 8, pool.kroot, sizeof(pool.kroot)));
+    }
+    pthread_mutex_init(&pool.idle_lock, NULL);
+    pthread_cond_init(&pool.idle_cond, NULL);
+    pool.deques = (struct walk_deque *) safe_malloc(nthreads * sizeof(struct walk_deque));
+    memset(pool.deques, 0, nthreads * sizeof(struct walk_deque));
+    for (w = 0; w < nthreads; ++w){
+        pthread_mutex_init(&pool.deques[w].lock, NULL);
+    }
+
+    for (i = 0; i < n; ++i){
+        task.dtb = dtbs[i];
+        task.entry = -1;
+        if (VMI_FAILURE == deque_push(&pool.deques[i % nthreads], &task)){
+            errprint("Failed to queue %lu address spaces to walk.\n", (unsigned long) n);
+            pool.stop = 1;
+            goto cleanup;
+        }
+    }
+    pool.pending = n;
+
+    /* the calling thread is worker 0, so the walk completes even if no
+     * other thread can be started */
+    workers = (struct walk_worker *) safe_malloc(nthreads * sizeof(struct walk_worker));
+    vmi->concurrent = (nthreads > 1);
+    for (w = 0; w < nthreads; ++w){
+        workers[w].pool = &pool;
+        workers[w].id = w;
+        if (w && pthread_create(&workers[w].thread, NULL, walk_worker_main, &workers[w])){
+            dbprint("--Walk: failed to start worker %d\n", w);
+            workers[w].pool = NULL;
+        }
+    }
+    walk_worker_main(&workers[0]);
+    for (w = 1; w < nthreads; ++w){
+        if (workers[w].pool){
+            pthread_join(workers[w].thread, NULL);
+        }
+    }
+    vmi->concurrent = 0;
+
+cleanup:
+    for (w = 0; w < nthreads; ++w){
+        pthread_mutex_destroy(&pool.deques[w].lock);
+        if (pool.deques[w].tasks) free(pool.deques[w].tasks);
+    }
+    pthread_cond_destroy(&pool.idle_cond);
+    pthread_mutex_destroy(&pool.idle_lock);
+    free(pool.deques);
+    free(workers);
+
+    return pool.stop ? VMI_FAILURE : VMI_SUCCESS;
+}
+
+static void walk_snapshot_free (gpointer data)
+{
+    struct walk_snapshot *snap = (struct walk_snapshot *) data;
+    if (snap){
+        g_hash_table_destroy(snap->tables);
+        free(snap);
+    }
+}
+
+static void walk_key_free (gpointer data)
+{
+    if (data) free(data);
+}
+
+static gboolean table_record_is_stale (gpointer key, gpointer value, gpointer data)
+{
+    struct table_record *rec = (struct table_record *) value;
+    struct walk_state *ws = (struct walk_state *) data;
+    int w = 0;
+
+    if (rec->generation == ws->snap->generation){
+        return FALSE;
+    }
+
+    /* the table is no longer reachable, so all of its entries went away */
+    for (w = 0; w < TABLE_MASK_WORDS; ++w){
+        ws->delta->unmapped += __builtin_popcountll(rec->present[w] | rec->swap[w]);
+    }
+    return TRUE;
+}
+
+status_t vmi_get_pte_delta (vmi_instance_t vmi, addr_t dtb, vmi_pte_stats_t *stats, vmi_pte_delta_t *delta)
+{
+    struct walk_state ws;
+    struct walk_snapshot *snap = NULL;
+    addr_t root = walk_init(&ws, vmi, dtb);
+
+    if (!root || !stats || !delta){
+        return VMI_FAILURE;
+    }
+
+    if (!vmi->walk_snapshots){
+        vmi->walk_snapshots = g_hash_table_new_full(g_int64_hash, g_int64_equal, walk_key_free, walk_snapshot_free);
+    }
+    if ((snap = g_hash_table_lookup(vmi->walk_snapshots, &dtb)) == NULL){
+        addr_t *key = (addr_t *) safe_malloc(sizeof(addr_t));
+        *key = dtb;
+        snap = (struct walk_snapshot *) safe_malloc(sizeof(struct walk_snapshot));
+        snap->tables = g_hash_table_new_full(g_int64_hash, g_int64_equal, walk_key_free, free);
+        snap->generation = 0;
+        g_hash_table_insert(vmi->walk_snapshots, key, snap);
+    }
+
+    memset(stats, 0, sizeof(vmi_pte_stats_t));
+    memset(delta, 0, sizeof(vmi_pte_delta_t));
+    ws.stats = stats;
+    ws.snap = snap;
+    ws.delta = delta;
+    snap->generation++;
+
+    walk_table(&ws, root, 0, 0, VMI_MAP_WRITE | VMI_MAP_USER);
+    g_hash_table_foreach_remove(snap->tables, table_record_is_stale, &ws);
+
+    dbprint("--PTE delta: %llu of %llu tables changed, +%llu present, +%llu swapped, -%llu unmapped\n",
+        delta->tables_changed, delta->tables, delta->newly_present, delta->newly_swapped, delta->unmapped);
+    return VMI_SUCCESS;
+}
+
+void vmi_pte_delta_reset (vmi_instance_t vmi, addr_t dtb)
+{
+    if (vmi->walk_snapshots){
+        g_hash_table_remove(vmi->walk_snapshots, &dtb);
+    }
+}
+
+void walk_snapshot_destroy (vmi_instance_t vmi)
+{
+    if (vmi->walk_snapshots){
+        g_hash_table_destroy(vmi->walk_snapshots);
+        vmi->walk_snapshots = NULL;
+    }
+}
@@ -27,6 +27,7 @@
 #include "libvmi.h"
 #include "private.h"
 #include "driver/interface.h"
+#include "driver/memory_cache.h"
 
 ///////////////////////////////////////////////////////////
 // Classic write functions for access to memory
@@ -38,6 +39,7 @@ size_t vmi_write_pa (vmi_instance_t vmi, addr_t paddr, void *buf, size_t count)
         return 0;
     }
     if (VMI_SUCCESS == driver_write(vmi, paddr, buf, count)){
+        memory_cache_invalidate(vmi, paddr, count);
         return count;
     }
     else{
@@ -83,6 +85,7 @@ size_t vmi_write_va (vmi_instance_t vmi, addr_t vaddr, int pid, void *buf, size_
         if (VMI_FAILURE == driver_write(vmi, paddr, ((char *) buf + (addr_t) buf_offset), write_len)){
             return buf_offset;
         }
+        memory_cache_invalidate(vmi, paddr, write_len);
 
         /* set variables for next loop */
         count -= write_len;
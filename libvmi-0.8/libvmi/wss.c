@@ -0,0 +1,376 @@
+/* The LibVMI Library is an introspection library that simplifies access to 
+ * memory in a target virtual machine or in a file containing a dump of 
+ * a system's physical memory.  LibVMI is based on the XenAccess Library.
+ *
+ * Copyright 2011 Sandia Corporation. Under the terms of Contract
+ * DE-AC04-94AL85000 with Sandia Corporation, the U.S. Government
+ * retains certain rights in this software.
+ *
+ * Author: Bryan D. Payne (bdpayne@acm.org)
+ *
+ * This file is part of LibVMI.
+ *
+ * LibVMI is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * LibVMI is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public
+ * License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with LibVMI.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Working set estimation from the accessed (A) and dirty (D) bits of leaf
+// page table entries.  Each sample walks the address spaces being tracked
+// and keeps, for every mapped page, the number of samples since its A bit
+// was last seen set.  Pages are tracked in chunks of 512 leaf slots (one
+// 2MB region), so that the state costs about a byte per mapped page.
+//
+// Clearing the A bits races with the guest setting D in the same byte, so
+// the bits to clear are collected during the walk and cleared afterwards
+// with the VM paused, re-reading each entry first.
+
+#include "libvmi.h"
+#include "private.h"
+#include <string.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include <glib.h>
+#include "glib_compat.h"
+
+#define WSS_CHUNK_SHIFT 21
+#define WSS_CHUNK_SLOTS 512
+#define WSS_AGE_MAX 255
+#define ENTRY_ACCESSED (1ULL << 5)
+#define ENTRY_DIRTY (1ULL << 6)
+
+/* one 2MB region of an address space */
+struct wss_chunk{
+    uint64_t sample;                    /**< last sample that saw a mapping here */
+    uint64_t mapped[WSS_CHUNK_SLOTS / 64];  /**< slots mapped as of that sample */
+    uint64_t prev[WSS_CHUNK_SLOTS / 64];    /**< slots mapped the sample before */
+    uint8_t age[WSS_CHUNK_SLOTS];       /**< samples since the A bit was seen */
+};
+
+struct wss_process{
+    addr_t dtb;
+    GHashTable *chunks;         /**< va >> WSS_CHUNK_SHIFT -> wss_chunk */
+    struct wss_chunk *last;     /**< chunk of the previous leaf, pages come in va order */
+    addr_t last_key;
+    vmi_wss_report_t report;
+};
+
+struct vmi_wss{
+    vmi_instance_t vmi;
+    uint32_t flags;
+    uint64_t sample;
+    uint64_t last_ms;
+    GHashTable *procs;          /**< dtb -> wss_process */
+    addr_t *to_clear;           /**< locations of entries with A set */
+    size_t clear_count;
+    size_t clear_size;
+    int clear_failed;           /**< an entry could not be queued this sample */
+};
+
+/* state for one walk */
+struct wss_walk{
+    struct vmi_wss *wss;
+    struct wss_process *proc;
+    vmi_wss_report_t report;
+};
+
+/* state for one sample across all address spaces */
+struct wss_sample{
+    struct vmi_wss *wss;
+    uint64_t now;
+    status_t ret;
+};
+
+static uint64_t wss_clock_ms (void)
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return (uint64_t) tv.tv_sec * 1000 + tv.tv_usec / 1000;
+}
+
+/* bucket 0 is 0 intervals, then 1, 2-3, 4-7, ... */
+static int wss_bucket (uint8_t age)
+{
+    int bucket = age ? 32 - __builtin_clz(age) : 0;
+    return bucket < VMI_WSS_AGE_BUCKETS ? bucket : VMI_WSS_AGE_BUCKETS - 1;
+}
+
+static void wss_key_free (gpointer data)
+{
+    if (data) free(data);
+}
+
+static void wss_process_free (gpointer data)
+{
+    struct wss_process *proc = (struct wss_process *) data;
+    if (proc){
+        g_hash_table_destroy(proc->chunks);
+        free(proc);
+    }
+}
+
+static struct wss_chunk *wss_get_chunk (struct wss_walk *walk, addr_t va)
+{
+    struct wss_process *proc = walk->proc;
+    addr_t key = va >> WSS_CHUNK_SHIFT;
+    struct wss_chunk *chunk = NULL;
+
+    if (proc->last && proc->last_key == key){
+        return proc->last;
+    }
+
+    if ((chunk = g_hash_table_lookup(proc->chunks, &key)) == NULL){
+        addr_t *k = (addr_t *) safe_malloc(sizeof(addr_t));
+        *k = key;
+        chunk = (struct wss_chunk *) safe_malloc(sizeof(struct wss_chunk));
+        memset(chunk, 0, sizeof(struct wss_chunk));
+        g_hash_table_insert(proc->chunks, k, chunk);
+    }
+
+    /* first visit in this sample, what was mapped before becomes prev */
+    if (chunk->sample != walk->wss->sample){
+        if (chunk->sample + 1 == walk->wss->sample){
+            memcpy(chunk->prev, chunk->mapped, sizeof(chunk->prev));
+        }
+        else{
+            memset(chunk->prev, 0, sizeof(chunk->prev));
+        }
+        memset(chunk->mapped, 0, sizeof(chunk->mapped));
+        chunk->sample = walk->wss->sample;
+    }
+
+    proc->last = chunk;
+    proc->last_key = key;
+    return chunk;
+}
+
+static status_t wss_queue_clear (struct vmi_wss *wss, addr_t location)
+{
+    if (wss->clear_count == wss->clear_size){
+        size_t size = wss->clear_size ? wss->clear_size * 2 : 1024;
+        addr_t *to_clear = realloc(wss->to_clear, size * sizeof(addr_t));
+
+        if (!to_clear){
+            errprint("Failed to grow the accessed bit queue to %lu entries.\n", (unsigned long) size);
+            return VMI_FAILURE;
+        }
+        wss->to_clear = to_clear;
+        wss->clear_size = size;
+    }
+    wss->to_clear[wss->clear_count++] = location;
+    return VMI_SUCCESS;
+}
+
+static void wss_leaf (vmi_instance_t vmi, addr_t va, addr_t pa, addr_t size,
+    uint32_t flags, addr_t location, uint64_t entry, void *data)
+{
+    struct wss_walk *walk = (struct wss_walk *) data;
+    struct wss_chunk *chunk = wss_get_chunk(walk, va);
+    int slot = (va >> 12) & (WSS_CHUNK_SLOTS - 1);
+    uint64_t bit = 1ULL << (slot % 64);
+    int accessed = (entry & ENTRY_ACCESSED) != 0;
+
+    if (!(chunk->prev[slot / 64] & bit)){
+        /* newly mapped, idle since it was mapped unless accessed */
+        chunk->age[slot] = accessed ? 0 : 1;
+    }
+    else if (accessed){
+        chunk->age[slot] = 0;
+    }
+    else if (chunk->age[slot] < WSS_AGE_MAX){
+        chunk->age[slot]++;
+    }
+    chunk->mapped[slot / 64] |= bit;
+
+    walk->report.mapped += size;
+    walk->report.idle[wss_bucket(chunk->age[slot])] += size;
+    if (accessed){
+        walk->report.accessed += size;
+        if ((walk->wss->flags & VMI_WSS_CLEAR) &&
+            VMI_FAILURE == wss_queue_clear(walk->wss, location)){
+            walk->wss->clear_failed = 1;
+        }
+    }
+    if (entry & ENTRY_DIRTY){
+        walk->report.dirty += size;
+    }
+}
+
+static gboolean wss_chunk_is_stale (gpointer key, gpointer value, gpointer data)
+{
+    struct wss_chunk *chunk = (struct wss_chunk *) value;
+    uint64_t sample = *(uint64_t *) data;
+    return chunk->sample != sample;
+}
+
+/* clear the A bits collected during the walk, with the VM paused so that
+ * the guest cannot set D between our read and write */
+static status_t wss_clear_accessed (struct vmi_wss *wss)
+{
+    status_t ret = VMI_SUCCESS;
+    size_t i = 0;
+
+    if (!wss->clear_count){
+        return VMI_SUCCESS;
+    }
+    if (VMI_FAILURE == vmi_pause_vm(wss->vmi)){
+        errprint("Failed to pause VM to clear accessed bits.\n");
+        wss->clear_count = 0;
+        return VMI_FAILURE;
+    }
+
+    for (i = 0; i < wss->clear_count; ++i){
+        addr_t location = wss->to_clear[i];
+        uint8_t low = 0;
+
+        /* A and D live in the low byte of the entry */
+        if (VMI_FAILURE == vmi_read_8_pa(wss->vmi, location, &low)){
+            ret = VMI_FAILURE;
+            continue;
+        }
+        if (low & ENTRY_ACCESSED){
+            low &= ~ENTRY_ACCESSED;
+            if (VMI_FAILURE == vmi_write_8_pa(wss->vmi, location, &low)){
+                ret = VMI_FAILURE;
+            }
+        }
+    }
+
+    vmi_resume_vm(wss->vmi);
+    if (VMI_FAILURE == ret){
+        errprint("Failed to clear some accessed bits.\n");
+    }
+    wss->clear_count = 0;
+    return ret;
+}
+
+vmi_wss_t vmi_wss_create (vmi_instance_t vmi, uint32_t flags)
+{
+    struct vmi_wss *wss = (struct vmi_wss *) safe_malloc(sizeof(struct vmi_wss));
+
+    memset(wss, 0, sizeof(struct vmi_wss));
+    wss->vmi = vmi;
+    wss->flags = flags;
+    wss->procs = g_hash_table_new_full(g_int64_hash, g_int64_equal, wss_key_free, wss_process_free);
+    return wss;
+}
+
+void vmi_wss_destroy (vmi_wss_t wss)
+{
+    if (wss){
+        g_hash_table_destroy(wss->procs);
+        if (wss->to_clear) free(wss->to_clear);
+        free(wss);
+    }
+}
+
+status_t vmi_wss_add_dtb (vmi_wss_t wss, addr_t dtb)
+{
+    struct wss_process *proc = NULL;
+    addr_t *key = NULL;
+
+    if (g_hash_table_lookup(wss->procs, &dtb)){
+        return VMI_FAILURE;
+    }
+    proc = (struct wss_process *) safe_malloc(sizeof(struct wss_process));
+    memset(proc, 0, sizeof(struct wss_process));
+    proc->dtb = dtb;
+    proc->chunks = g_hash_table_new_full(g_int64_hash, g_int64_equal, wss_key_free, free);
+
+    key = (addr_t *) safe_malloc(sizeof(addr_t));
+    *key = dtb;
+    g_hash_table_insert(wss->procs, key, proc);
+    return VMI_SUCCESS;
+}
+
+status_t vmi_wss_remove_dtb (vmi_wss_t wss, addr_t dtb)
+{
+    return g_hash_table_remove(wss->procs, &dtb) ? VMI_SUCCESS : VMI_FAILURE;
+}
+
+static void wss_sample_process (gpointer key, gpointer value, gpointer data)
+{
+    struct wss_process *proc = (struct wss_process *) value;
+    struct wss_sample *sample = (struct wss_sample *) data;
+    struct vmi_wss *wss = sample->wss;
+    struct wss_walk walk;
+
+    memset(&walk, 0, sizeof(struct wss_walk));
+    walk.wss = wss;
+    walk.proc = proc;
+    proc->last = NULL;
+
+    if (VMI_FAILURE == walk_leaves(wss->vmi, proc->dtb, NULL, wss_leaf, &walk)){
+        dbprint("--WSS: failed to walk dtb 0x%.16llx\n", proc->dtb);
+        sample->ret = VMI_FAILURE;
+        return;
+    }
+    proc->last = NULL;
+    g_hash_table_foreach_remove(proc->chunks, wss_chunk_is_stale, &wss->sample);
+
+    walk.report.samples = proc->report.samples + 1;
+    walk.report.interval_ms = wss->last_ms ? sample->now - wss->last_ms : 0;
+    proc->report = walk.report;
+
+    dbprint("--WSS: dtb 0x%.16llx mapped %llu accessed %llu dirty %llu\n",
+        proc->dtb, walk.report.mapped, walk.report.accessed, walk.report.dirty);
+}
+
+status_t vmi_wss_sample (vmi_wss_t wss)
+{
+    struct wss_sample sample;
+
+    sample.wss = wss;
+    sample.now = wss_clock_ms();
+    sample.ret = VMI_SUCCESS;
+
+    wss->sample++;
+    wss->clear_failed = 0;
+    g_hash_table_foreach(wss->procs, wss_sample_process, &sample);
+    wss->last_ms = sample.now;
+
+    /* what was queued is still cleared, but pages left out of the queue
+     * will show up as accessed again next sample */
+    if (wss->flags & VMI_WSS_CLEAR){
+        if (VMI_FAILURE == wss_clear_accessed(wss) || wss->clear_failed){
+            sample.ret = VMI_FAILURE;
+        }
+    }
+    return sample.ret;
+}
+
+status_t vmi_wss_run (vmi_wss_t wss, uint32_t interval_ms, uint32_t count)
+{
+    status_t ret = VMI_SUCCESS;
+    uint32_t i = 0;
+
+    for (i = 0; i < count; ++i){
+        if (i){
+            usleep(interval_ms * 1000);
+        }
+        if (VMI_FAILURE == vmi_wss_sample(wss)){
+            ret = VMI_FAILURE;
+        }
+    }
+    return ret;
+}
+
+status_t vmi_wss_get_report (vmi_wss_t wss, addr_t dtb, vmi_wss_report_t *report)
+{
+    struct wss_process *proc = g_hash_table_lookup(wss->procs, &dtb);
+
+    if (!proc || !report){
+        return VMI_FAILURE;
+    }
+    *report = proc->report;
+    return VMI_SUCCESS;
+}